@@ -178,54 +178,81 @@ class CSD_Processor { MEMALIGN(CSD_Processor)
 
 class MSMT_Processor { MEMALIGN (MSMT_Processor)
   public:
-    MSMT_Processor (const DWI::SDeconv::MSMT_CSD::Shared& shared, Image<bool>& mask_image,
+    MSMT_Processor (const DWI::SDeconv::MSMT_CSD::Shared& shared, Image<float>& dwi_image,
+      const vector<size_t>& inner_axes, Image<bool>& mask_image,
       vector< Image<float> > odf_images, Image<float> dwi_modelled = Image<float>()) :
         sdeconv (shared),
+        dwi_image (dwi_image),
+        inner_axes (inner_axes),
         mask_image (mask_image),
         odf_images (odf_images),
-        modelled_image (dwi_modelled),
-        dwi_data (shared.grad.rows()),
-        output_data (shared.problem.H.cols()) { }
+        modelled_image (dwi_modelled) { }
 
 
-    void operator() (Image<float>& dwi_image)
+    // deconvolve all voxels along the inner axes in a single block:
+    void operator() (const Iterator& pos)
     {
-      if (mask_image.valid()) {
-        assign_pos_of (dwi_image, 0, 3).to (mask_image);
-        if (!mask_image.value())
-          return;
-      }
+      assign_pos_of (pos, 0, 3).to (dwi_image);
 
-      dwi_data = dwi_image.row(3);
+      size_t num_voxels = 0;
+      for (auto l = Loop (inner_axes) (dwi_image); l; ++l)
+        if (in_mask())
+          ++num_voxels;
+      if (!num_voxels)
+        return;
 
-      sdeconv (dwi_data, output_data);
-      if (sdeconv.niter >= sdeconv.shared.problem.max_niter) {
-        INFO ("voxel [ " + str (dwi_image.index(0)) + " " + str (dwi_image.index(1)) + " " + str (dwi_image.index(2)) +
-            " ] did not reach full convergence");
-      }
+      dwi_data.resize (sdeconv.shared.grad.rows(), num_voxels);
+      size_t n = 0;
+      for (auto l = Loop (inner_axes) (dwi_image); l; ++l)
+        if (in_mask())
+          dwi_data.col (n++) = dwi_image.row(3);
 
-      size_t j = 0;
-      for (size_t i = 0; i < odf_images.size(); ++i) {
-        assign_pos_of (dwi_image, 0, 3).to (odf_images[i]);
-        for (auto l = Loop(3)(odf_images[i]); l; ++l)
-          odf_images[i].value() = output_data[j++];
-      }
+      sdeconv (dwi_data, output_data);
 
-      if (modelled_image.valid()) {
-        assign_pos_of (dwi_image, 0, 3).to (modelled_image);
-        dwi_data = sdeconv.shared.problem.H * output_data;
-        modelled_image.row(3) = dwi_data;
+      n = 0;
+      for (auto l = Loop (inner_axes) (dwi_image); l; ++l) {
+        if (!in_mask())
+          continue;
+
+        if (sdeconv.niter_block[n] >= sdeconv.shared.problem.max_niter) {
+          INFO ("voxel [ " + str (dwi_image.index(0)) + " " + str (dwi_image.index(1)) + " " + str (dwi_image.index(2)) +
+              " ] did not reach full convergence");
+        }
+
+        size_t j = 0;
+        for (size_t i = 0; i < odf_images.size(); ++i) {
+          assign_pos_of (dwi_image, 0, 3).to (odf_images[i]);
+          for (auto l = Loop(3)(odf_images[i]); l; ++l)
+            odf_images[i].value() = output_data(j++, n);
+        }
+
+        if (modelled_image.valid()) {
+          assign_pos_of (dwi_image, 0, 3).to (modelled_image);
+          modelled_image.row(3) = sdeconv.shared.problem.H * output_data.col (n);
+        }
+
+        ++n;
       }
     }
 
 
   private:
     DWI::SDeconv::MSMT_CSD sdeconv;
+    Image<float> dwi_image;
+    const vector<size_t>& inner_axes;
     Image<bool> mask_image;
     vector< Image<float> > odf_images;
     Image<float> modelled_image;
-    Eigen::VectorXd dwi_data;
-    Eigen::VectorXd output_data;
+    Eigen::MatrixXd dwi_data;
+    Eigen::MatrixXd output_data;
+
+    bool in_mask ()
+    {
+      if (!mask_image.valid())
+        return true;
+      assign_pos_of (dwi_image, 0, 3).to (mask_image);
+      return mask_image.value();
+    }
 };
 
 
@@ -276,6 +303,7 @@ void run ()
     CSD_Processor processor (shared, mask);
     auto dwi = header_in.get_image<float>().with_direct_io (3);
     ThreadedLoop ("performing constrained spherical deconvolution", dwi, 0, 3)
+        .with_work_stealing()
         .run (processor, dwi, fod);
 
   } else if (algorithm == 1) {
@@ -315,10 +343,10 @@ void run ()
     if (opt.size())
       dwi_modelled = Image<float>::create (opt[0][0], header_in);
 
-    MSMT_Processor processor (shared, mask, odfs, dwi_modelled);
     auto dwi = header_in.get_image<float>().with_direct_io (3);
-    ThreadedLoop ("performing multi-shell, multi-tissue CSD", dwi, 0, 3)
-        .run (processor, dwi);
+    auto loop = ThreadedLoop ("performing multi-shell, multi-tissue CSD", dwi, 0, 3).with_work_stealing();
+    MSMT_Processor processor (shared, dwi, loop.inner_axes, mask, odfs, dwi_modelled);
+    loop.run_outer (processor);
 
   } else {
     assert (0);
@@ -18,6 +18,7 @@
 
 #include <Eigen/Dense>
 #include <Eigen/Eigenvalues>
+#include <random>
 
 
 using namespace MR;
@@ -27,6 +28,8 @@ const char* const dtypes[] = { "float32", "float64", NULL };
 
 const char* const estimators[] = { "exp1", "exp2", NULL };
 
+const char* const eigensolvers[] = { "full", "partial", NULL };
+
 
 void usage ()
 {
@@ -92,7 +95,15 @@ void usage ()
     + Option ("estimator", "Select the noise level estimator (default = Exp2), either: \n"
                            "* Exp1: the original estimator used in Veraart et al. (2016), or \n"
                            "* Exp2: the improved estimator introduced in Cordero-Grande et al. (2019).")
-    +   Argument ("Exp1/Exp2").type_choice(estimators);
+    +   Argument ("Exp1/Exp2").type_choice(estimators)
+
+    + Option ("eigensolver", "Select the eigensolver used for each patch (default = full), either: \n"
+                             "* full: a full eigendecomposition of the patch covariance matrix, or \n"
+                             "* partial: compute all eigenvalues (as required for the noise level estimate), "
+                             "but compute eigenvectors only for the signal components retained after thresholding. "
+                             "This is faster for data with many DW volumes, and otherwise equivalent to "
+                             "within numerical precision.")
+    +   Argument ("full/partial").type_choice(eigensolvers);
 
 
   COPYRIGHT = "Copyright (c) 2016 New York University, University of Antwerp, and the MRtrix3 contributors \n \n"
@@ -125,16 +136,29 @@ class DenoisingFunctor {
 public:
 
   using MatrixType = Eigen::Matrix<F, Eigen::Dynamic, Eigen::Dynamic>;
+  using VectorType = Eigen::Matrix<F, Eigen::Dynamic, 1>;
   using SValsType = Eigen::VectorXd;
+  // the Gram matrix is accumulated in double precision, since it may be
+  // updated incrementally along many consecutive voxels:
+  using GramType = Eigen::Matrix<typename std::conditional<is_complex<F>::value, cdouble, double>::type, Eigen::Dynamic, Eigen::Dynamic>;
 
   DenoisingFunctor (int ndwi, const vector<int>& extent,
-                    Image<bool>& mask, Image<real_type>& noise, bool exp1)
+                    Image<bool>& mask, Image<real_type>& noise, bool exp1, bool partial)
     : extent {{extent[0]/2, extent[1]/2, extent[2]/2}},
       m (ndwi), n (extent[0]*extent[1]*extent[2]),
-      r (std::min(m,n)), q (std::max(m,n)), exp1(exp1),
+      r (std::min(m,n)), q (std::max(m,n)), exp1(exp1), partial (partial),
       X (m,n), pos {{0, 0, 0}},
+      gram_valid (false), gram_pos {{0, 0, 0}},
+      start (r),
       mask (mask), noise (noise)
-  { }
+  {
+    // fixed pseudo-random starting vector for inverse iteration:
+    std::mt19937 rng (r);
+    std::uniform_real_distribution<double> uniform (-1.0, 1.0);
+    for (ssize_t i = 0; i < r; ++i)
+      start[i] = uniform (rng);
+  }
+
 
   template <typename ImageType>
   void operator () (ImageType& dwi, ImageType& out)
@@ -146,16 +170,26 @@ public:
         return;
     }
 
-    // Load data in local window
-    load_data (dwi);
-
     // Compute Eigendecomposition:
     MatrixType XtX (r,r);
-    if (m <= n)
-      XtX.template triangularView<Eigen::Lower>() = X * X.adjoint();
-    else
+    if (m <= n) {
+      // Only the centre voxel of the patch is needed for the reconstruction;
+      // the Gram matrix is updated incrementally where possible
+      update_gram (dwi);
+      X.col (n/2) = dwi.row(3);
+      XtX.template triangularView<Eigen::Lower>() = gram.template cast<F>();
+    } else {
+      load_data (dwi);
       XtX.template triangularView<Eigen::Lower>() = X.adjoint() * X;
-    Eigen::SelfAdjointEigenSolver<MatrixType> eig (XtX);
+    }
+    Eigen::SelfAdjointEigenSolver<MatrixType> eig;
+    if (partial) {
+      // eigenvalues only; eigenvectors are computed below where needed
+      tri.compute (XtX);
+      eig.computeFromTridiagonal (tri.diagonal(), tri.subDiagonal(), Eigen::EigenvaluesOnly);
+    }
+    else
+      eig.compute (XtX);
     // eigenvalues sorted in increasing order:
     SValsType s = eig.eigenvalues().template cast<double>();
 
@@ -178,7 +212,19 @@ public:
       }
     }
 
-    if (cutoff_p > 0) {
+    if (cutoff_p > 0 && partial) {
+      // recombine data using only eigenvectors above threshold, computed
+      // in the basis of the tridiagonal matrix T = Q^H XtX Q:
+      const MatrixType V = tridiagonal_eigenvectors (s, cutoff_p).template cast<F>();
+      VectorType y = (m <= n) ? VectorType (X.col (n/2)) : VectorType (VectorType::Unit (r, n/2));
+      y = tri.matrixQ().adjoint() * y;
+      y = tri.matrixQ() * VectorType (V * (V.adjoint() * y));
+      if (m <= n)
+        X.col (n/2) = y;
+      else
+        X.col (n/2) = X * y;
+    }
+    else if (cutoff_p > 0) {
       // recombine data using only eigenvectors above threshold:
       s.head (cutoff_p).setZero();
       s.tail (r-cutoff_p).setOnes();
@@ -202,13 +248,162 @@ public:
 private:
   const std::array<ssize_t, 3> extent;
   const ssize_t m, n, r, q;
-  const bool exp1;
+  const bool exp1, partial;
   MatrixType X;
   std::array<ssize_t, 3> pos;
   double sigma2;
+  GramType gram, slice_in, slice_out;
+  bool gram_valid;
+  std::array<ssize_t, 3> gram_pos;
+  Eigen::Tridiagonalization<MatrixType> tri;
+  Eigen::VectorXd start;
   Image<bool> mask;
   Image<real_type> noise;
 
+  // Eigenvectors of the real symmetric tridiagonal matrix T held in tri,
+  // for eigenvalues lambda[first] to lambda[r-1], computed by inverse
+  // iteration using an LU factorisation of T - lambda I with partial
+  // pivoting (as in LAPACK ?stein). Eigenvectors whose eigenvalues are
+  // close together are explicitly reorthogonalised.
+  Eigen::MatrixXd tridiagonal_eigenvectors (const SValsType& lambda, const ssize_t first) const
+  {
+    const Eigen::VectorXd d = tri.diagonal().template cast<double>();
+    const Eigen::VectorXd e = tri.subDiagonal().template cast<double>();
+    double tnorm = 0.0;
+    for (ssize_t i = 0; i < r; ++i)
+      tnorm = std::max (tnorm, std::abs (d[i]) + (i > 0 ? std::abs (e[i-1]) : 0.0) + (i < r-1 ? std::abs (e[i]) : 0.0));
+    const double tiny = std::max (std::numeric_limits<double>::epsilon() * tnorm, std::numeric_limits<double>::min());
+    const double ortol = 1.0e-3 * tnorm;
+    const double pertol = 10.0 * std::numeric_limits<typename Eigen::NumTraits<F>::Real>::epsilon() * tnorm;
+
+    Eigen::MatrixXd V (r, r-first);
+    Eigen::VectorXd dd (r), dl (std::max (r-1, ssize_t(0))), du (dl.size()), du2 (std::max (r-2, ssize_t(0)));
+    vector<bool> pivot (r);
+    double lam_prev = 0.0;
+    ssize_t cluster = first;
+    for (ssize_t j = first; j < r; ++j) {
+      double lam = lambda[j];
+      if (j > first) {
+        // separate (near-)degenerate eigenvalues
+        if (lam - lam_prev < pertol)
+          lam = lam_prev + pertol;
+        if (lam - lam_prev > ortol)
+          cluster = j;
+      }
+      lam_prev = lam;
+
+      // factorise T - lam I:
+      dd = d.array() - lam;
+      dl = e; du = e; du2.setZero();
+      for (ssize_t i = 0; i < r-1; ++i) {
+        if (std::abs (dd[i]) >= std::abs (dl[i])) {
+          if (std::abs (dd[i]) < tiny)
+            dd[i] = dd[i] < 0.0 ? -tiny : tiny;
+          dl[i] /= dd[i];
+          dd[i+1] -= dl[i] * du[i];
+          pivot[i] = false;
+        } else {
+          const double fact = dd[i] / dl[i];
+          dd[i] = dl[i];
+          dl[i] = fact;
+          const double temp = du[i];
+          du[i] = dd[i+1];
+          dd[i+1] = temp - fact * dd[i+1];
+          if (i < r-2) {
+            du2[i] = du[i+1];
+            du[i+1] *= -fact;
+          }
+          pivot[i] = true;
+        }
+      }
+      if (std::abs (dd[r-1]) < tiny)
+        dd[r-1] = dd[r-1] < 0.0 ? -tiny : tiny;
+
+      auto v = V.col (j-first);
+      v = start;
+      for (size_t iter = 0; iter < 3; ++iter) {
+        // solve (T - lam I) x = v in place:
+        for (ssize_t i = 0; i < r-1; ++i) {
+          if (pivot[i]) {
+            const double temp = v[i];
+            v[i] = v[i+1];
+            v[i+1] = temp - dl[i] * v[i];
+          }
+          else
+            v[i+1] -= dl[i] * v[i];
+        }
+        v[r-1] /= dd[r-1];
+        if (r > 1)
+          v[r-2] = (v[r-2] - du[r-2] * v[r-1]) / dd[r-2];
+        for (ssize_t i = r-3; i >= 0; --i)
+          v[i] = (v[i] - du[i] * v[i+1] - du2[i] * v[i+2]) / dd[i];
+        for (ssize_t k = cluster; k < j; ++k)
+          v -= V.col (k-first).dot (v) * V.col (k-first);
+        v.normalize();
+      }
+    }
+    return V;
+  }
+
+  // Update the (lower triangle of the) Gram matrix X X^H for the patch
+  // centred on the current voxel. Since X X^H is a sum over the patch
+  // columns, if the previous Gram matrix was computed for the preceding
+  // voxel along any one axis, and neither patch is affected by the edge
+  // handling along that axis, it suffices to subtract the contribution of
+  // the slice leaving the patch and add that of the slice entering it.
+  // Otherwise, the Gram matrix is computed from scratch.
+  template <typename ImageType>
+  void update_gram (ImageType& dwi) {
+    pos[0] = dwi.index(0); pos[1] = dwi.index(1); pos[2] = dwi.index(2);
+    if (gram_valid) {
+      size_t axis = 3;
+      for (size_t a = 0; a != 3; ++a) {
+        if (pos[a] != gram_pos[a]) {
+          if (axis != 3 || pos[a] != gram_pos[a] + 1) {
+            axis = 3;
+            break;
+          }
+          axis = a;
+        }
+      }
+      if (axis != 3 && pos[axis] - extent[axis] - 1 >= 0 && pos[axis] + extent[axis] < dwi.size(axis)) {
+        load_slice (dwi, axis, -extent[axis]-1, slice_out);
+        load_slice (dwi, axis, extent[axis], slice_in);
+        gram.template selfadjointView<Eigen::Lower>().rankUpdate (slice_out, -1.0);
+        gram.template selfadjointView<Eigen::Lower>().rankUpdate (slice_in, 1.0);
+        gram_pos = pos;
+        return;
+      }
+    }
+    load_data (dwi);
+    gram.resize (m, m);
+    gram.template triangularView<Eigen::Lower>() = X.template cast<typename GramType::Scalar>() * X.template cast<typename GramType::Scalar>().adjoint();
+    gram_pos = pos;
+    gram_valid = true;
+  }
+
+  // load the columns of the patch at the given offset along axis,
+  // with the usual edge handling along the other two axes
+  template <typename ImageType>
+  void load_slice (ImageType& dwi, const size_t axis, const int offset, GramType& slice) {
+    const size_t axis1 = axis ? 0 : 1, axis2 = axis == 2 ? 1 : 2;
+    slice.resize (m, (2*extent[axis1]+1) * (2*extent[axis2]+1));
+    dwi.index(axis) = pos[axis] + offset;
+    size_t k = 0;
+    for (int b = -extent[axis2]; b <= extent[axis2]; b++) {
+      dwi.index(axis2) = wrapindex(b, axis2, dwi.size(axis2));
+      for (int a = -extent[axis1]; a <= extent[axis1]; a++, k++) {
+        dwi.index(axis1) = wrapindex(a, axis1, dwi.size(axis1));
+        for (dwi.index(3) = 0; dwi.index(3) < m; ++dwi.index(3))
+          slice(dwi.index(3),k) = typename GramType::Scalar (dwi.value());
+      }
+    }
+    // reset image position
+    dwi.index(0) = pos[0];
+    dwi.index(1) = pos[1];
+    dwi.index(2) = pos[2];
+  }
+
   template <typename ImageType>
   void load_data (ImageType& dwi) {
     pos[0] = dwi.index(0); pos[1] = dwi.index(1); pos[2] = dwi.index(2);
@@ -244,7 +439,7 @@ private:
 
 template <typename T>
 void process_image (Header& data, Image<bool>& mask, Image<real_type> noise,
-                    const std::string& output_name, const vector<int>& extent, bool exp1)
+                    const std::string& output_name, const vector<int>& extent, bool exp1, bool partial)
   {
     auto input = data.get_image<T>().with_direct_io(3);
     // create output
@@ -252,8 +447,8 @@ void process_image (Header& data, Image<bool>& mask, Image<real_type> noise,
     header.datatype() = DataType::from<T>();
     auto output = Image<T>::create (output_name, header);
     // run
-    DenoisingFunctor<T> func (data.size(3), extent, mask, noise, exp1);
-    ThreadedLoop ("running MP-PCA denoising", data, 0, 3).run (func, input, output);
+    DenoisingFunctor<T> func (data.size(3), extent, mask, noise, exp1, partial);
+    ThreadedLoop ("running MP-PCA denoising", data, 0, 3).with_work_stealing().run (func, input, output);
   }
 
 
@@ -294,6 +489,8 @@ void run ()
 
   bool exp1 = get_option_value("estimator", 1) == 0;    // default: Exp2 (unbiased estimator)
 
+  bool partial = get_option_value("eigensolver", 0) == 1;    // default: full eigendecomposition
+
   Image<real_type> noise;
   opt = get_options("noise");
   if (opt.size()) {
@@ -308,19 +505,19 @@ void run ()
   switch (prec) {
     case 0:
       INFO("select real float32 for processing");
-      process_image<float>(dwi, mask, noise, argument[1], extent, exp1);
+      process_image<float>(dwi, mask, noise, argument[1], extent, exp1, partial);
       break;
     case 1:
       INFO("select real float64 for processing");
-      process_image<double>(dwi, mask, noise, argument[1], extent, exp1);
+      process_image<double>(dwi, mask, noise, argument[1], extent, exp1, partial);
       break;
     case 2:
       INFO("select complex float32 for processing");
-      process_image<cfloat>(dwi, mask, noise, argument[1], extent, exp1);
+      process_image<cfloat>(dwi, mask, noise, argument[1], extent, exp1, partial);
       break;
     case 3:
       INFO("select complex float64 for processing");
-      process_image<cdouble>(dwi, mask, noise, argument[1], extent, exp1);
+      process_image<cdouble>(dwi, mask, noise, argument[1], extent, exp1, partial);
       break;
   }
 
@@ -51,6 +51,9 @@ using Stats::CFE::index_type;
 #define DEFAULT_CONNECTIVITY_THRESHOLD 0.01
 #define DEFAULT_SMOOTHING_STD 10.0
 
+// Number of subjects for which data are smoothed concurrently
+#define SUBJECT_BLOCK_SIZE 16
+
 void usage ()
 {
   AUTHOR = "David Raffelt (david.raffelt@florey.edu.au) and Robert E. Smith (robert.smith@florey.edu.au)";
@@ -84,7 +87,8 @@ void usage ()
 
   + Argument ("contrast", "the contrast vector, specified as a single row of weights").type_file_in ()
 
-  + Argument ("tracks", "the tracks used to determine fixel-fixel connectivity").type_tracks_in ()
+  + Argument ("tracks", "the tracks used to determine fixel-fixel connectivity; alternatively, a fixel connectivity file "
+                        "previously generated using the -export_connectivity option, in which case streamline mapping is skipped").type_file_in ()
 
   + Argument ("out_fixel_directory", "the output directory where results will be saved. Will be created if it does not exist").type_text();
 
@@ -122,7 +126,13 @@ void usage ()
   + Argument ("value").type_float (0.0, 90.0)
 
   + Option ("mask", "provide a fixel data file containing a mask of those fixels to be used during processing")
-  + Argument ("file").type_image_in();
+  + Argument ("file").type_image_in()
+
+  + Option ("export_connectivity", "export the normalised fixel-fixel connectivity matrix and smoothing weights to file; this file can "
+                                   "then be provided in place of the tracks in subsequent analyses that use the same fixel template, "
+                                   "mask, and connectivity parameters (-cfe_c, -smooth, -connectivity and -angle), such that the "
+                                   "matrix is memory-mapped from file rather than re-computed")
+  + Argument ("path").type_file_out();
 
 }
 
@@ -239,7 +249,8 @@ void run() {
       if (!MR::Path::exists (filename))
         throw Exception ("input fixel image not found: " + filename);
       header = Header::open (filename);
-      Fixel::fixels_match (index_header, header);
+      if (!Fixel::fixels_match (index_header, header))
+        throw Exception ("Input fixel image " + filename + " does not match fixel template");
       identifiers.push_back (filename);
       progress++;
     }
@@ -278,113 +289,148 @@ void run() {
   if (contrast.rows() > 1)
     throw Exception ("only a single contrast vector (defined as a row) is currently supported");
 
-  // Compute fixel-fixel connectivity
-  Stats::CFE::init_connectivity_matrix_type connectivity_matrix (num_fixels);
-  vector<uint16_t> fixel_TDI (num_fixels, 0);
-  const std::string track_filename = argument[4];
-  DWI::Tractography::Properties properties;
-  DWI::Tractography::Reader<float> track_file (track_filename, properties);
-  // Read in tracts, and compute whole-brain fixel-fixel connectivity
-  const size_t num_tracks = properties["count"].empty() ? 0 : to<size_t> (properties["count"]);
-  if (!num_tracks)
-    throw Exception ("no tracks found in input file");
-  if (num_tracks < 1000000)
-    WARN ("more than 1 million tracks should be used to ensure robust fixel-fixel connectivity");
-  {
-    DWI::Tractography::Mapping::TrackLoader loader (track_file, num_tracks, "pre-computing fixel-fixel connectivity");
-    DWI::Tractography::Mapping::TrackMapperBase mapper (index_image);
-    mapper.set_upsample_ratio (DWI::Tractography::Mapping::determine_upsample_ratio (index_header, properties, 0.333f));
-    mapper.set_use_precise_mapping (true);
-    Stats::CFE::TrackProcessor tract_processor (index_image, directions, mask, fixel_TDI, connectivity_matrix, angular_threshold);
-    Thread::run_queue (
-        loader,
-        Thread::batch (DWI::Tractography::Streamline<float>()),
-        mapper,
-        Thread::batch (DWI::Tractography::Mapping::SetVoxelDir()),
-        tract_processor);
-  }
-  track_file.close();
-
-  // Normalise connectivity matrix, threshold, and put in a more efficient format
-  Stats::CFE::norm_connectivity_matrix_type norm_connectivity_matrix (mask_fixels);
-  // Also pre-compute fixel-fixel weights for smoothing.
-  Stats::CFE::norm_connectivity_matrix_type smoothing_weights (mask_fixels);
-  bool do_smoothing = false;
-
-  const float gaussian_const2 = 2.0 * smooth_std_dev * smooth_std_dev;
-  float gaussian_const1 = 1.0;
-  if (smooth_std_dev > 0.0) {
-    do_smoothing = true;
-    gaussian_const1 = 1.0 / (smooth_std_dev *  std::sqrt (2.0 * Math::pi));
-  }
+  // Parameters that determine the contents of the fixel-fixel connectivity
+  //   matrix; these must match for a connectivity file to be re-used
+  KeyValues connectivity_properties;
+  connectivity_properties["cfe_c"] = str(cfe_c);
+  connectivity_properties["angular threshold"] = str(angular_threshold);
+  connectivity_properties["connectivity threshold"] = str(connectivity_threshold);
+  connectivity_properties["smoothing FWHM"] = str(smooth_std_dev * 2.3548);
+
+  const bool do_smoothing = smooth_std_dev > 0.0;
+  Stats::CFE::CompressedMatrix connectivity, smoothing;
+  const std::string connectivity_source = argument[4];
+  if (Path::has_suffix (connectivity_source, ".tck")) {
+
+    // Compute fixel-fixel connectivity
+    Stats::CFE::init_connectivity_matrix_type connectivity_matrix (num_fixels);
+    vector<uint16_t> fixel_TDI (num_fixels, 0);
+    DWI::Tractography::Properties properties;
+    DWI::Tractography::Reader<float> track_file (connectivity_source, properties);
+    // Read in tracts, and compute whole-brain fixel-fixel connectivity
+    const size_t num_tracks = properties["count"].empty() ? 0 : to<size_t> (properties["count"]);
+    if (!num_tracks)
+      throw Exception ("no tracks found in input file");
+    if (num_tracks < 1000000)
+      WARN ("more than 1 million tracks should be used to ensure robust fixel-fixel connectivity");
+    {
+      DWI::Tractography::Mapping::TrackLoader loader (track_file, num_tracks, "pre-computing fixel-fixel connectivity");
+      DWI::Tractography::Mapping::TrackMapperBase mapper (index_image);
+      mapper.set_upsample_ratio (DWI::Tractography::Mapping::determine_upsample_ratio (index_header, properties, 0.333f));
+      mapper.set_use_precise_mapping (true);
+      Stats::CFE::TrackProcessor tract_processor (index_image, directions, mask, fixel_TDI, connectivity_matrix, angular_threshold);
+      Thread::run_queue (
+          loader,
+          Thread::batch (DWI::Tractography::Streamline<float>()),
+          Thread::multi (mapper),
+          Thread::batch (DWI::Tractography::Mapping::SetVoxelDir()),
+          Thread::multi (tract_processor));
+    }
+    track_file.close();
 
-  {
-    ProgressBar progress ("normalising and thresholding fixel-fixel connectivity matrix", num_fixels);
-    for (index_type fixel = 0; fixel < num_fixels; ++fixel) {
-      mask.index(0) = fixel;
-      const int32_t row = fixel2row[fixel];
+    // Normalise connectivity matrix, threshold, and put in a more efficient format
+    Stats::CFE::norm_connectivity_matrix_type norm_connectivity_matrix (mask_fixels);
+    // Also pre-compute fixel-fixel weights for smoothing.
+    Stats::CFE::norm_connectivity_matrix_type smoothing_weights (mask_fixels);
+
+    const float gaussian_const2 = 2.0 * smooth_std_dev * smooth_std_dev;
+    float gaussian_const1 = 1.0;
+    if (do_smoothing)
+      gaussian_const1 = 1.0 / (smooth_std_dev *  std::sqrt (2.0 * Math::pi));
+
+    {
+      ProgressBar progress ("normalising and thresholding fixel-fixel connectivity matrix", num_fixels);
+      for (index_type fixel = 0; fixel < num_fixels; ++fixel) {
+        mask.index(0) = fixel;
+        const int32_t row = fixel2row[fixel];
 
-      if (mask.value()) {
+        if (mask.value()) {
 
-        // Here, the connectivity matrix needs to be modified to reflect the
-        //   fact that fixel indices in the template fixel image may not
-        //   correspond to rows in the statistical analysis
-        connectivity_value_type sum_weights = 0.0;
+          // Here, the connectivity matrix needs to be modified to reflect the
+          //   fact that fixel indices in the template fixel image may not
+          //   correspond to rows in the statistical analysis
+          connectivity_value_type sum_weights = 0.0;
 
-        for (auto& it : connectivity_matrix[fixel]) {
+          for (auto& it : connectivity_matrix[fixel]) {
 #ifndef NDEBUG
-          // Even if this fixel is within the mask, it should still not
-          //   connect to any fixel that is outside the mask
-          mask.index(0) = it.first;
-          assert (mask.value());
+            // Even if this fixel is within the mask, it should still not
+            //   connect to any fixel that is outside the mask
+            mask.index(0) = it.first;
+            assert (mask.value());
 #endif
-          const connectivity_value_type connectivity = it.second.value / connectivity_value_type (fixel_TDI[fixel]);
-          if (connectivity >= connectivity_threshold) {
-            if (do_smoothing) {
-              const value_type distance = std::sqrt (Math::pow2 (positions[fixel][0] - positions[it.first][0]) +
-                                                     Math::pow2 (positions[fixel][1] - positions[it.first][1]) +
-                                                     Math::pow2 (positions[fixel][2] - positions[it.first][2]));
-              const connectivity_value_type smoothing_weight = connectivity * gaussian_const1 * std::exp (-Math::pow2 (distance) / gaussian_const2);
-              if (smoothing_weight >= connectivity_threshold) {
-                smoothing_weights[row].push_back (Stats::CFE::NormMatrixElement (fixel2row[it.first], smoothing_weight));
-                sum_weights += smoothing_weight;
+            const connectivity_value_type connectivity = it.second.value / connectivity_value_type (fixel_TDI[fixel]);
+            if (connectivity >= connectivity_threshold) {
+              if (do_smoothing) {
+                const value_type distance = std::sqrt (Math::pow2 (positions[fixel][0] - positions[it.first][0]) +
+                                                       Math::pow2 (positions[fixel][1] - positions[it.first][1]) +
+                                                       Math::pow2 (positions[fixel][2] - positions[it.first][2]));
+                const connectivity_value_type smoothing_weight = connectivity * gaussian_const1 * std::exp (-Math::pow2 (distance) / gaussian_const2);
+                if (smoothing_weight >= connectivity_threshold) {
+                  smoothing_weights[row].push_back (Stats::CFE::NormMatrixElement (fixel2row[it.first], smoothing_weight));
+                  sum_weights += smoothing_weight;
+                }
               }
+              // Here we pre-exponentiate each connectivity value by C
+              norm_connectivity_matrix[row].push_back (Stats::CFE::NormMatrixElement (fixel2row[it.first], std::pow (connectivity, cfe_c)));
             }
-            // Here we pre-exponentiate each connectivity value by C
-            norm_connectivity_matrix[row].push_back (Stats::CFE::NormMatrixElement (fixel2row[it.first], std::pow (connectivity, cfe_c)));
           }
-        }
 
-        // Make sure the fixel is fully connected to itself
-        norm_connectivity_matrix[row].push_back (Stats::CFE::NormMatrixElement (uint32_t(row), connectivity_value_type(1.0)));
-        smoothing_weights[row].push_back (Stats::CFE::NormMatrixElement (uint32_t(row), connectivity_value_type(gaussian_const1)));
-        sum_weights += connectivity_value_type(gaussian_const1);
+          // Make sure the fixel is fully connected to itself
+          norm_connectivity_matrix[row].push_back (Stats::CFE::NormMatrixElement (uint32_t(row), connectivity_value_type(1.0)));
+          smoothing_weights[row].push_back (Stats::CFE::NormMatrixElement (uint32_t(row), connectivity_value_type(gaussian_const1)));
+          sum_weights += connectivity_value_type(gaussian_const1);
+
+          // Normalise smoothing weights
+          const connectivity_value_type norm_factor = connectivity_value_type(1.0) / sum_weights;
+          for (auto i : smoothing_weights[row])
+            i.normalise (norm_factor);
 
-        // Normalise smoothing weights
-        const connectivity_value_type norm_factor = connectivity_value_type(1.0) / sum_weights;
-        for (auto i : smoothing_weights[row])
-          i.normalise (norm_factor);
+          // Force deallocation of memory used for this fixel in the original matrix
+          std::map<uint32_t, Stats::CFE::connectivity>().swap (connectivity_matrix[fixel]);
 
-        // Force deallocation of memory used for this fixel in the original matrix
-        std::map<uint32_t, Stats::CFE::connectivity>().swap (connectivity_matrix[fixel]);
+        } else {
 
-      } else {
+          // If fixel is not in the mask, tract_processor should never assign
+          //   any connections to it
+          assert (connectivity_matrix[fixel].empty());
 
-        // If fixel is not in the mask, tract_processor should never assign
-        //   any connections to it
-        assert (connectivity_matrix[fixel].empty());
+        }
 
+        progress++;
       }
+    }
 
-      progress++;
+    // The connectivity matrix is now in vector rather than matrix form;
+    //   throw out the structure holding the original data
+    // (Note however that all entries in the original structure should
+    //   have been deleted during the prior loop)
+    Stats::CFE::init_connectivity_matrix_type().swap (connectivity_matrix);
+
+    // Pack both matrices into compressed form
+    connectivity = Stats::CFE::CompressedMatrix (std::move (norm_connectivity_matrix));
+    smoothing = Stats::CFE::CompressedMatrix (std::move (smoothing_weights));
+
+  } else {
+
+    KeyValues properties;
+    vector<int32_t> file_fixel2row;
+    Stats::CFE::load_connectivity (connectivity_source, file_fixel2row, connectivity, smoothing, properties);
+    if (file_fixel2row.size() != num_fixels)
+      throw Exception ("fixel connectivity file \"" + connectivity_source + "\" does not match fixel template");
+    if (file_fixel2row != fixel2row)
+      throw Exception ("fixel connectivity file \"" + connectivity_source + "\" was generated using a different fixel mask");
+    for (const auto& p : connectivity_properties) {
+      if (properties[p.first] != p.second)
+        throw Exception ("fixel connectivity file \"" + connectivity_source + "\" was generated using " + p.first + " = "
+                         + (properties[p.first].empty() ? std::string("(unknown)") : properties[p.first]) + " (currently " + p.second + ")");
     }
+    CONSOLE ("fixel-fixel connectivity loaded from file \"" + connectivity_source + "\"");
+
   }
 
-  // The connectivity matrix is now in vector rather than matrix form;
-  //   throw out the structure holding the original data
-  // (Note however that all entries in the original structure should
-  //   have been deleted during the prior loop)
-  Stats::CFE::init_connectivity_matrix_type().swap (connectivity_matrix);
+  opt = get_options ("export_connectivity");
+  if (opt.size())
+    Stats::CFE::save_connectivity (opt[0][0], fixel2row, connectivity, smoothing, connectivity_properties);
 
 
   Header output_header (header);
@@ -399,46 +445,81 @@ void run() {
 
 
   // Load input data
-  matrix_type data (mask_fixels, identifiers.size());
+  // Subject data files are imported concurrently; if smoothing is to be applied,
+  //   the data for a block of subjects are first imported into a row-major buffer,
+  //   and the smoothing filter is then applied to all subjects in that block at once
+  //   as a sparse-dense matrix product
+  const size_t num_subjects = identifiers.size();
+  matrix_type data (mask_fixels, num_subjects);
   data.setZero();
   {
-    ProgressBar progress (std::string ("loading input images") + (do_smoothing ? " and smoothing" : ""), identifiers.size());
-    for (size_t subject = 0; subject < identifiers.size(); subject++) {
-      LogLevelLatch log_level (0);
-
-      auto subject_data = Image<value_type>::open (identifiers[subject]).with_direct_io();
-      vector<value_type> subject_data_vector (mask_fixels, 0.0);
-      for (auto i = Loop (index_image, 0, 3)(index_image); i; ++i) {
-        index_image.index(3) = 1;
-        uint32_t offset = index_image.value();
-        uint32_t fixel_index = 0;
-        for (auto f = Fixel::Loop (index_image) (subject_data); f; ++f, ++fixel_index) {
-          if (!std::isfinite(static_cast<value_type>(subject_data.value())))
-            throw Exception ("subject data file " + identifiers[subject] + " contains non-finite value: " + str(subject_data.value()));
-          // Note that immediately on import, data are re-arranged according to fixel mask
-          const int32_t row = fixel2row[offset+fixel_index];
-          if (row >= 0)
-            subject_data_vector[row] = subject_data.value();
-        }
+    ProgressBar progress (std::string ("loading input images") + (do_smoothing ? " and smoothing" : ""), num_subjects);
+    // Latch the log level here rather than within each thread, since the latch
+    //   modifies the global log level
+    LogLevelLatch log_level (0);
+
+    const size_t block_size = do_smoothing ?
+                              std::min (num_subjects, std::max (size_t(SUBJECT_BLOCK_SIZE), Thread::number_of_threads())) :
+                              num_subjects;
+    Eigen::Matrix<value_type, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> raw_data;
+    if (do_smoothing)
+      raw_data.resize (mask_fixels, block_size);
+
+    for (size_t block_start = 0; block_start < num_subjects; block_start += block_size) {
+      const size_t block_end = std::min (num_subjects, block_start + block_size);
+
+      {
+        size_t next_subject = block_start;
+        auto source = [&] (size_t& subject) { subject = next_subject++; return (subject < block_end); };
+        auto loader = [&] (const size_t& subject, size_t& out)
+        {
+          auto subject_data = Image<value_type>::open (identifiers[subject]);
+          if (size_t(subject_data.size (0)) != size_t(num_fixels))
+            throw Exception ("Number of fixels in subject data file " + identifiers[subject] + " (" + str(subject_data.size (0)) + ") does not match fixel template (" + str(num_fixels) + ")");
+          vector<value_type> subject_data_vector (num_fixels);
+          subject_data.get_values (0, subject_data_vector.data(), num_fixels);
+          for (index_type fixel = 0; fixel != num_fixels; ++fixel) {
+            const value_type value = subject_data_vector[fixel];
+            if (!std::isfinite (value))
+              throw Exception ("subject data file " + identifiers[subject] + " contains non-finite value: " + str(value));
+            // Note that immediately on import, data are re-arranged according to fixel mask
+            const int32_t row = fixel2row[fixel];
+            if (row >= 0) {
+              if (do_smoothing)
+                raw_data (row, subject - block_start) = value;
+              else
+                data (row, subject) = value;
+            }
+          }
+          out = subject;
+          return true;
+        };
+        auto sink = [&] (const size_t&) { if (!do_smoothing) ++progress; return true; };
+        Thread::run_queue (source, size_t(), Thread::multi (loader), size_t(), sink);
       }
 
       // Smooth the data
       if (do_smoothing) {
-        for (size_t fixel = 0; fixel < mask_fixels; ++fixel) {
-          value_type value = 0.0;
-          for (auto i : smoothing_weights[fixel])
-            value += subject_data_vector[i.index()] * i.value();
-          data (fixel, subject) = value;
-        }
-      } else {
-        data.col (subject) = Eigen::Map<Eigen::Matrix<value_type, Eigen::Dynamic, 1> > (subject_data_vector.data(), mask_fixels);
+        const size_t block_subjects = block_end - block_start;
+        size_t next_fixel = 0;
+        auto source = [&] (size_t& fixel) { fixel = next_fixel++; return (fixel < mask_fixels); };
+        auto smoother = [&] (const size_t& fixel)
+        {
+          Eigen::Matrix<value_type, 1, Eigen::Dynamic> value (Eigen::Matrix<value_type, 1, Eigen::Dynamic>::Zero (block_subjects));
+          for (const auto& i : smoothing[fixel])
+            value += raw_data.row (i.index()).head (block_subjects) * value_type(i.value());
+          data.row (fixel).segment (block_start, block_subjects) = value;
+          return true;
+        };
+        Thread::run_queue (source, Thread::batch (size_t()), Thread::multi (smoother));
+        for (size_t subject = block_start; subject != block_end; ++subject)
+          ++progress;
       }
-      progress++;
     }
   }
 
   // Free the memory occupied by the data smoothing filter; no longer required
-  Stats::CFE::norm_connectivity_matrix_type().swap (smoothing_weights);
+  smoothing = Stats::CFE::CompressedMatrix();
 
   if (!data.allFinite())
     throw Exception ("input data contains non-finite value(s)");
@@ -460,7 +541,7 @@ void run() {
 
   Math::Stats::GLMTTest glm_ttest (data, design, contrast);
   std::shared_ptr<Stats::EnhancerBase> cfe_integrator;
-  cfe_integrator.reset (new Stats::CFE::Enhancer (norm_connectivity_matrix, cfe_dh, cfe_e, cfe_h));
+  cfe_integrator.reset (new Stats::CFE::FastEnhancer (connectivity, cfe_dh, cfe_e, cfe_h));
   vector_type empirical_cfe_statistic;
 
   // If performing non-stationarity adjustment we need to pre-compute the empirical CFE statistic
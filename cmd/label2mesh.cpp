@@ -68,7 +68,10 @@ void run ()
 
   using voxel_corner_t = Eigen::Array<int, 3, 1>;
 
+  // Gather the bounding box and the constituent voxels of every label in a
+  //   single pass, so that the label image need not be revisited per label
   vector<voxel_corner_t> lower_corners, upper_corners;
+  vector<vector<voxel_corner_t>> label_voxels;
 
   {
     for (auto i = Loop ("Importing label image", labels) (labels); i; ++i) {
@@ -78,12 +81,13 @@ void run ()
         if (index >= lower_corners.size()) {
           lower_corners.resize (index+1, voxel_corner_t (labels.size(0), labels.size(1), labels.size(2)));
           upper_corners.resize (index+1, voxel_corner_t (-1, -1, -1));
+          label_voxels.resize (index+1);
         }
 
-        for (size_t axis = 0; axis != 3; ++axis) {
-          lower_corners[index][axis] = std::min (lower_corners[index][axis], int(labels.index (axis)));
-          upper_corners[index][axis] = std::max (upper_corners[index][axis], int(labels.index (axis)));
-        }
+        const voxel_corner_t voxel (labels.index (0), labels.index (1), labels.index (2));
+        lower_corners[index] = lower_corners[index].min (voxel);
+        upper_corners[index] = upper_corners[index].max (voxel);
+        label_voxels[index].push_back (voxel);
 
       }
     }
@@ -100,21 +104,27 @@ void run ()
 
     auto worker = [&] (const size_t& in)
     {
-      vector<int> from, dimensions;
-      for (size_t axis = 0; axis != 3; ++axis) {
-        from.push_back (lower_corners[in][axis]);
-        dimensions.push_back (upper_corners[in][axis] - lower_corners[in][axis] + 1);
-      }
-      Adapter::Subset<Image<uint32_t>> subset (labels, from, dimensions);
+      if (label_voxels[in].size()) {
+        vector<int> from, dimensions;
+        for (size_t axis = 0; axis != 3; ++axis) {
+          from.push_back (lower_corners[in][axis]);
+          dimensions.push_back (upper_corners[in][axis] - lower_corners[in][axis] + 1);
+        }
+        Adapter::Subset<Image<uint32_t>> subset (labels, from, dimensions);
 
-      auto scratch = Image<bool>::scratch (subset, "Node " + str(in) + " mask");
-      for (auto i = Loop (subset) (subset, scratch); i; ++i)
-        scratch.value() = (subset.value() == in);
+        auto scratch = Image<bool>::scratch (subset, "Node " + str(in) + " mask");
+        for (const auto& voxel : label_voxels[in]) {
+          for (size_t axis = 0; axis != 3; ++axis)
+            scratch.index (axis) = voxel[axis] - lower_corners[in][axis];
+          scratch.value() = true;
+        }
+        vector<voxel_corner_t>().swap (label_voxels[in]);
 
-      if (blocky)
-        MR::Surface::Algo::image2mesh_blocky (scratch, meshes[in]);
-      else
-        MR::Surface::Algo::image2mesh_mc (scratch, meshes[in], 0.5);
+        if (blocky)
+          MR::Surface::Algo::image2mesh_blocky (scratch, meshes[in]);
+        else
+          MR::Surface::Algo::image2mesh_mc (scratch, meshes[in], 0.5);
+      }
       meshes[in].set_name (str(in));
       std::lock_guard<std::mutex> lock (mutex);
       ++progress;
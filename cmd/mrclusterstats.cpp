@@ -216,8 +216,7 @@ void run() {
 
   std::shared_ptr<Stats::EnhancerBase> enhancer;
   if (use_tfce) {
-    std::shared_ptr<Stats::TFCE::EnhancerBase> base (new Stats::Cluster::ClusterSize (connector, cluster_forming_threshold));
-    enhancer.reset (new Stats::TFCE::Wrapper (base, tfce_dh, tfce_E, tfce_H));
+    enhancer.reset (new Stats::Cluster::ClusterSizeTFCE (connector, tfce_dh, tfce_E, tfce_H));
   } else {
     enhancer.reset (new Stats::Cluster::ClusterSize (connector, cluster_forming_threshold));
   }
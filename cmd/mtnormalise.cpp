@@ -14,12 +14,16 @@
  * For more details, see http://www.mrtrix.org/.
  */
 
+#include <atomic>
+#include <mutex>
+
 #include "command.h"
 #include "image.h"
 #include "algo/loop.h"
 #include "transform.h"
 #include "math/least_squares.h"
 #include "algo/threaded_copy.h"
+#include "algo/threaded_loop.h"
 #include "adapter/replicate.h"
 
 using namespace MR;
@@ -184,20 +188,154 @@ struct PolyBasisFunction<2> { MEMALIGN (PolyBasisFunction<2>)
 };
 
 
-// Removes non-physical voxels from the mask
-FORCE_INLINE void refine_mask (Image<float>& summed,
-  Image<bool>& initial_mask,
-  Image<bool>& refined_mask) {
+// Thread-safe accumulation of the normal equations (X^T X b = X^T y) of a
+//   linear least-squares problem, such that the (num_voxels x n) design
+//   matrix never needs to be formed
+class NormalEquations { MEMALIGN(NormalEquations)
+  public:
+    NormalEquations (size_t n) :
+        XtX (Eigen::MatrixXd::Zero (n, n)),
+        Xty (Eigen::VectorXd::Zero (n)) { }
 
-  for (auto i = Loop (summed, 0, 3) (summed, initial_mask, refined_mask); i; ++i) {
-    if (std::isfinite((float) summed.value ()) && summed.value () > 0.f && initial_mask.value ())
-      refined_mask.value () = true;
-    else
-      refined_mask.value () = false;
-  }
+    size_t size () const { return Xty.size(); }
+
+    void add (const Eigen::VectorXd& x, const double y) {
+      XtX.selfadjointView<Eigen::Lower>().rankUpdate (x);
+      Xty.noalias() += y * x;
+    }
+
+    void add (const NormalEquations& that) {
+      std::lock_guard<std::mutex> lock (mutex);
+      XtX += that.XtX;
+      Xty += that.Xty;
+    }
+
+    Eigen::VectorXd solve () const {
+      return Eigen::MatrixXd (XtX.selfadjointView<Eigen::Lower>()).colPivHouseholderQr().solve (Xty);
+    }
+
+  private:
+    Eigen::MatrixXd XtX;
+    Eigen::VectorXd Xty;
+    std::mutex mutex;
+};
+
+
+// ThreadedLoop kernel: for each voxel within the mask, \a functor fills in
+//   one row of the design matrix and the corresponding observation; these are
+//   accumulated per thread and merged into the shared normal equations
+//   on destruction
+template <class Functor>
+class NormalEquationsKernel { MEMALIGN(NormalEquationsKernel<Functor>)
+  public:
+    NormalEquationsKernel (NormalEquations& shared, const Functor& functor) :
+        shared (shared),
+        local (shared.size()),
+        functor (functor),
+        x (shared.size()) { }
+
+    NormalEquationsKernel (const NormalEquationsKernel& that) :
+        shared (that.shared),
+        local (shared.size()),
+        functor (that.functor),
+        x (shared.size()) { }
+
+    ~NormalEquationsKernel () {
+      shared.add (local);
+    }
+
+    template <class MaskType, class... ImageType>
+    void operator() (MaskType& mask, ImageType&... images) {
+      if (mask.value()) {
+        double y;
+        functor (x, y, mask, images...);
+        local.add (x, y);
+      }
+    }
+
+  private:
+    NormalEquations& shared;
+    NormalEquations local;
+    Functor functor;
+    Eigen::VectorXd x;
+};
+
+template <class Functor>
+inline NormalEquationsKernel<Functor> normal_equations_kernel (NormalEquations& shared, const Functor& functor) {
+  return NormalEquationsKernel<Functor> (shared, functor);
 }
 
 
+// ThreadedLoop kernel: sums the tissue compartments of the input images and
+//   copies their (zero-clamped) values into the combined tissue image; voxels
+//   with non-physical summed tissue values are excluded from the initial mask
+template <class InputImageType>
+class LoadTissues { MEMALIGN(LoadTissues<InputImageType>)
+  public:
+    LoadTissues (const vector<InputImageType>& input_images, std::atomic<size_t>& num_voxels) :
+        input_images (input_images),
+        num_voxels (num_voxels) { }
+
+    void operator() (Image<bool>& orig_mask, Image<bool>& initial_mask, Image<float>& combined_tissue) {
+      float summed = 0.f;
+      for (size_t j = 0; j < input_images.size(); ++j) {
+        assign_pos_of (combined_tissue, 0, 3).to (input_images[j]);
+        const float value = input_images[j].value();
+        summed += value;
+        combined_tissue.index (3) = j;
+        combined_tissue.value() = std::max<float> (value, 0.f);
+      }
+      initial_mask.value() = std::isfinite (summed) && summed > 0.f && orig_mask.value();
+      if (initial_mask.value())
+        ++num_voxels;
+    }
+
+  private:
+    vector<InputImageType> input_images;
+    std::atomic<size_t>& num_voxels;
+};
+
+
+// ThreadedLoop kernel: computes the log of the balanced and normalised summed
+//   tissue image, resets the mask to the initial mask, and gathers the values
+//   within the mask
+class SummedLog { MEMALIGN(SummedLog)
+  public:
+    SummedLog (const Eigen::VectorXd& balance_factors, vector<float>& values) :
+        balance_factors (balance_factors),
+        values (values) { }
+
+    SummedLog (const SummedLog& that) :
+        balance_factors (that.balance_factors),
+        values (that.values) { }
+
+    ~SummedLog () {
+      std::lock_guard<std::mutex> lock (mutex);
+      values.insert (values.end(), local_values.begin(), local_values.end());
+    }
+
+    void operator() (Image<bool>& initial_mask, Image<bool>& mask, Image<float>& summed_log, Image<float>& combined_tissue, Image<float>& norm_field_image) {
+      double sum = 0.0;
+      for (size_t j = 0; j < size_t(balance_factors.size()); ++j) {
+        combined_tissue.index(3) = j;
+        sum += balance_factors(j) * combined_tissue.value() / norm_field_image.value();
+      }
+      summed_log.value() = std::log (sum);
+      mask.value() = initial_mask.value();
+      if (mask.value())
+        local_values.push_back (summed_log.value());
+    }
+
+  private:
+    const Eigen::VectorXd& balance_factors;
+    vector<float>& values;
+    vector<float> local_values;
+    static std::mutex mutex;
+};
+std::mutex SummedLog::mutex;
+
+
+
 template <int poly_order> void run_primitive ();
 
 void run ()
@@ -235,8 +373,9 @@ void run_primitive () {
 
   using ImageType = Image<float>;
   using MaskType = Image<bool>;
+  using InputImageType = Adapter::Replicate<ImageType>;
 
-  vector<Adapter::Replicate<ImageType>> input_images;
+  vector<InputImageType> input_images;
   vector<Header> output_headers;
   vector<std::string> output_filenames;
 
@@ -281,44 +420,26 @@ void run_primitive () {
   auto mask = MaskType::scratch (orig_mask, "Processing mask");
   auto prev_mask = MaskType::scratch (orig_mask, "Previous processing mask");
 
-  {
-    auto summed = ImageType::scratch (header_3D, "Summed tissue volumes");
-    for (size_t j = 0; j < input_images.size(); ++j) {
-      input_progress++;
-
-      for (auto i = Loop (0, 3) (summed, input_images[j]); i; ++i)
-        summed.value() += input_images[j].value();
-    }
-    refine_mask (summed, orig_mask, initial_mask);
-  }
-
-  threaded_copy (initial_mask, mask);
-
-
   // Load input images into single 4d-image and zero-clamp combined-tissue image
   Header h_combined_tissue (input_images[0]);
   h_combined_tissue.ndim () = 4;
   h_combined_tissue.size (3) = n_tissue_types;
   auto combined_tissue = ImageType::scratch (h_combined_tissue, "Tissue components");
 
-  for (size_t i = 0; i < n_tissue_types; ++i) {
-    input_progress++;
-
-    combined_tissue.index (3) = i;
-    for (auto l = Loop (0, 3) (combined_tissue, input_images[i]); l; ++l) {
-      combined_tissue.value () = std::max<float>(input_images[i].value (), 0.f);
-    }
-  }
-
   size_t num_voxels = 0;
-  for (auto i = Loop (mask) (mask); i; ++i) {
-    if (mask.value())
-      num_voxels++;
+  {
+    std::atomic<size_t> num_initial_voxels (0);
+    ThreadedLoop (combined_tissue, 0, 3).run (LoadTissues<InputImageType> (input_images, num_initial_voxels),
+                                              orig_mask, initial_mask, combined_tissue);
+    num_voxels = num_initial_voxels;
   }
+  input_progress++;
 
   if (!num_voxels)
     throw Exception ("Mask contains no valid voxels.");
 
+  threaded_copy (initial_mask, mask);
+
 
   const float normalisation_value = get_option_value ("value", DEFAULT_NORM_VALUE);
   const float log_norm_value = std::log (normalisation_value);
@@ -326,15 +447,28 @@ void run_primitive () {
   const size_t max_balance_iter = DEFAULT_BALANCE_MAXITER_VALUE;
 
   // Initialise normalisation fields in both image and log domain
-  Eigen::MatrixXd norm_field_weights;
+  Eigen::VectorXd norm_field_weights;
 
   auto norm_field_image = ImageType::scratch (header_3D, "Normalisation field (intensity)");
   auto norm_field_log = ImageType::scratch (header_3D, "Normalisation field (log-domain)");
 
-  for (auto i = Loop(norm_field_log) (norm_field_image, norm_field_log); i; ++i) {
-    norm_field_image.value() = 1.f;
-    norm_field_log.value() = 0.f;
-  }
+  ThreadedLoop (norm_field_log).run ([] (ImageType& field_image, ImageType& field_log) {
+    field_image.value() = 1.f;
+    field_log.value() = 0.f;
+  }, norm_field_image, norm_field_log);
+
+  // The polynomial basis is evaluated on scanner-space coordinates that are
+  //   centred on the image and scaled to unit half-extent; this spans the same
+  //   space of functions as the raw scanner coordinates, but keeps the normal
+  //   equations well-conditioned
+  Transform transform (mask);
+  const Eigen::Vector3 basis_centre = transform.voxel2scanner * Eigen::Vector3 (0.5 * (header_3D.size(0)-1), 0.5 * (header_3D.size(1)-1), 0.5 * (header_3D.size(2)-1));
+  default_type basis_scale = 0.0;
+  for (size_t axis = 0; axis != 3; ++axis)
+    basis_scale = std::max (basis_scale, 0.5 * header_3D.size (axis) * header_3D.spacing (axis));
+  auto basis_position = [&] (const Eigen::Vector3& vox) -> Eigen::Vector3 {
+    return (transform.voxel2scanner * vox - basis_centre) / basis_scale;
+  };
 
   Eigen::VectorXd balance_factors (Eigen::VectorXd::Ones (n_tissue_types));
 
@@ -347,22 +481,11 @@ void run_primitive () {
   auto outlier_rejection = [&](float outlier_range) {
 
     auto summed_log = ImageType::scratch (header_3D, "Log of summed tissue volumes");
-    for (auto i = Loop (0, 3) (summed_log, combined_tissue, norm_field_image); i; ++i) {
-      for (size_t j = 0; j < n_tissue_types; ++j) {
-        combined_tissue.index(3) = j;
-        summed_log.value() += balance_factors(j) * combined_tissue.value() / norm_field_image.value();
-      }
-      summed_log.value() = std::log(summed_log.value());
-    }
-
-    threaded_copy (initial_mask, mask);
 
     vector<float> summed_log_values;
     summed_log_values.reserve (num_voxels);
-    for (auto i = Loop (0, 3) (mask, summed_log); i; ++i) {
-      if (mask.value())
-        summed_log_values.push_back (summed_log.value());
-    }
+    ThreadedLoop (summed_log, 0, 3).run (SummedLog (balance_factors, summed_log_values),
+                                         initial_mask, mask, summed_log, combined_tissue, norm_field_image);
 
     num_voxels = summed_log_values.size();
 
@@ -375,14 +498,16 @@ void run_primitive () {
     const float lower_outlier_threshold = lower_quartile - outlier_range * (upper_quartile - lower_quartile);
     const float upper_outlier_threshold = upper_quartile + outlier_range * (upper_quartile - lower_quartile);
 
-    for (auto i = Loop (0, 3) (mask, summed_log); i; ++i) {
+    std::atomic<size_t> num_outliers (0);
+    ThreadedLoop (mask, 0, 3).run ([&] (MaskType& mask, ImageType& summed_log) {
       if (mask.value()) {
         if (summed_log.value() < lower_outlier_threshold || summed_log.value() > upper_outlier_threshold) {
           mask.value() = 0;
-          num_voxels--;
+          ++num_outliers;
         }
       }
-    }
+    }, mask, summed_log);
+    num_voxels -= num_outliers;
 
     if (log_level >= 3)
       display (mask);
@@ -411,21 +536,17 @@ void run_primitive () {
       if (n_tissue_types > 1) {
 
         // Solve for tissue balance factors
-        Eigen::MatrixXd X (num_voxels, n_tissue_types);
-        Eigen::VectorXd y (Eigen::VectorXd::Ones (num_voxels));
-        uint32_t index = 0;
-
-        for (auto i = Loop (0, 3) (mask, combined_tissue, norm_field_image); i; ++i) {
-          if (mask.value()) {
-            for (size_t j = 0; j < n_tissue_types; ++j) {
-              combined_tissue.index (3) = j;
-              X (index, j) = combined_tissue.value() / norm_field_image.value();
-            }
-            ++index;
-          }
-        }
-
-        balance_factors = X.colPivHouseholderQr().solve(y);
+        NormalEquations balance_equations (n_tissue_types);
+        ThreadedLoop (mask, 0, 3).run (normal_equations_kernel (balance_equations,
+              [n_tissue_types] (Eigen::VectorXd& x, double& y, MaskType&, ImageType& combined_tissue, ImageType& norm_field_image) {
+                for (size_t j = 0; j < n_tissue_types; ++j) {
+                  combined_tissue.index (3) = j;
+                  x[j] = combined_tissue.value() / norm_field_image.value();
+                }
+                y = 1.0;
+              }), mask, combined_tissue, norm_field_image);
+
+        balance_factors = balance_equations.solve();
 
         // Ensure our balance factors satisfy the condition that sum(log(balance_factors)) = 0
         double log_sum = 0.0;
@@ -444,53 +565,41 @@ void run_primitive () {
       // Perform outlier rejection on log-domain of summed images
       outlier_rejection(1.5f);
 
-      // Check for convergence
-      balance_converged = true;
-      for (auto i = Loop (0, 3) (mask, prev_mask); i; ++i) {
+      // Check for convergence, updating the previous mask in the same pass
+      std::atomic<bool> mask_changed (false);
+      ThreadedLoop (mask, 0, 3).run ([&] (MaskType& mask, MaskType& prev_mask) {
         if (mask.value() != prev_mask.value()) {
-          balance_converged = false;
-          break;
+          mask_changed = true;
+          prev_mask.value() = mask.value();
         }
-      }
-
-      threaded_copy (mask, prev_mask);
+      }, mask, prev_mask);
+      balance_converged = !mask_changed;
 
       balance_iter++;
     }
 
 
     // Solve for normalisation field weights in the log domain
-    Transform transform (mask);
-    Eigen::MatrixXd norm_field_basis (num_voxels, basis_function.n_basis_vecs);
-    Eigen::VectorXd y (num_voxels);
-    uint32_t index = 0;
-    for (auto i = Loop (0, 3) (mask, combined_tissue); i; ++i) {
-      if (mask.value()) {
-        Eigen::Vector3 vox (mask.index(0), mask.index(1), mask.index(2));
-        Eigen::Vector3 pos = transform.voxel2scanner * vox;
-        norm_field_basis.row (index) = basis_function (pos).col(0);
-
-        double sum = 0.0;
-        for (size_t j = 0; j < n_tissue_types; ++j) {
-          combined_tissue.index(3) = j;
-          sum += balance_factors(j) * combined_tissue.value() ;
-        }
-        y (index++) = std::log(sum) - log_norm_value;
-      }
-    }
-
-    norm_field_weights = norm_field_basis.colPivHouseholderQr().solve(y);
+    NormalEquations field_equations (basis_function.n_basis_vecs);
+    ThreadedLoop (mask, 0, 3).run (normal_equations_kernel (field_equations,
+          [&] (Eigen::VectorXd& x, double& y, MaskType& mask, ImageType& combined_tissue) {
+            x = basis_function (basis_position (Eigen::Vector3 (mask.index(0), mask.index(1), mask.index(2)))).col(0);
+            double sum = 0.0;
+            for (size_t j = 0; j < n_tissue_types; ++j) {
+              combined_tissue.index(3) = j;
+              sum += balance_factors(j) * combined_tissue.value() ;
+            }
+            y = std::log(sum) - log_norm_value;
+          }), mask, combined_tissue);
 
-    // Generate normalisation field in the log domain
-    for (auto i = Loop (0, 3) (norm_field_log); i; ++i) {
-      Eigen::Vector3 vox (norm_field_log.index(0), norm_field_log.index(1), norm_field_log.index(2));
-      Eigen::Vector3 pos = transform.voxel2scanner * vox;
-      norm_field_log.value() = basis_function (pos).col(0).dot (norm_field_weights.col(0));
-    }
+    norm_field_weights = field_equations.solve();
 
-    // Generate normalisation field in the image domain
-    for (auto i = Loop (0, 3) (norm_field_log, norm_field_image); i; ++i)
-      norm_field_image.value () = std::exp(norm_field_log.value());
+    // Generate normalisation field in both the log and image domains
+    ThreadedLoop (norm_field_log, 0, 3).run ([&] (ImageType& field_log, ImageType& field_image) {
+      const Eigen::Vector3 pos = basis_position (Eigen::Vector3 (field_log.index(0), field_log.index(1), field_log.index(2)));
+      field_log.value() = basis_function (pos).col(0).dot (norm_field_weights);
+      field_image.value() = std::exp (field_log.value());
+    }, norm_field_log, norm_field_image);
 
     progress++;
     iter++;
@@ -498,8 +607,6 @@ void run_primitive () {
 
   progress.done();
 
-  ProgressBar output_progress("writing output images");
-
   opt = get_options ("check_norm");
   if (opt.size()) {
     auto norm_field_output = ImageType::create (opt[0][0], header_3D);
@@ -515,30 +622,33 @@ void run_primitive () {
   // Compute log-norm scale parameter (geometric mean of normalisation field in outlier-free mask).
   float lognorm_scale (0.f);
   if (num_voxels) {
+    double lognorm_sum = 0.0;
     for (auto i = Loop (0,3) (mask, norm_field_log); i; ++i) {
       if (mask.value ())
-        lognorm_scale += norm_field_log.value ();
+        lognorm_sum += norm_field_log.value ();
     }
 
-    lognorm_scale = std::exp(lognorm_scale / (float)num_voxels);
+    lognorm_scale = std::exp (lognorm_sum / double(num_voxels));
   }
 
-
+  // Write all normalised outputs in a single pass
+  vector<ImageType> output_images;
   for (size_t j = 0; j < output_filenames.size(); ++j) {
-    output_progress++;
-
     output_headers[j].keyval()["lognorm_scale"] = str(lognorm_scale);
-    auto output_image = ImageType::create (output_filenames[j], output_headers[j]);
-    const size_t n_vols = input_images[j].size(3);
-    const Eigen::VectorXf zero_vec = Eigen::VectorXf::Zero (n_vols);
+    output_images.push_back (ImageType::create (output_filenames[j], output_headers[j]));
+  }
 
-    for (auto i = Loop (0,3) (output_image, input_images[j], norm_field_image); i; ++i) {
+  ThreadedLoop ("writing output images", norm_field_image, 0, 3).run ([input_images, output_images] (ImageType& field_image) mutable {
+    for (size_t j = 0; j < output_images.size(); ++j) {
+      assign_pos_of (field_image, 0, 3).to (input_images[j], output_images[j]);
       input_images[j].index(3) = 0;
-
-      if (input_images[j].value() < 0.f)
-        output_image.row(3) = zero_vec;
-      else
-        output_image.row(3) = Eigen::VectorXf{input_images[j].row(3)} / norm_field_image.value();
+      if (input_images[j].value() < 0.f) {
+        for (auto l = Loop (3) (output_images[j]); l; ++l)
+          output_images[j].value() = 0.f;
+      } else {
+        for (auto l = Loop (3) (input_images[j], output_images[j]); l; ++l)
+          output_images[j].value() = input_images[j].value() / field_image.value();
+      }
     }
-  }
+  }, norm_field_image);
 }
@@ -0,0 +1,319 @@
+/* Copyright (c) 2008-2019 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Covered Software is provided under this License on an "as is"
+ * basis, without warranty of any kind, either expressed, implied, or
+ * statutory, including, without limitation, warranties that the
+ * Covered Software is free of defects, merchantable, fit for a
+ * particular purpose or non-infringing.
+ * See the Mozilla Public License v. 2.0 for more details.
+ *
+ * For more details, see http://www.mrtrix.org/.
+ */
+
+#include "command.h"
+#include "header.h"
+#include "image.h"
+#include "phase_encoding.h"
+#include "algo/threaded_loop.h"
+#include "dwi/gradient.h"
+#include "dwi/shells.h"
+#include "dwi/sdeconv/msmt_csd.h"
+#include "math/SH.h"
+
+
+using namespace MR;
+using namespace App;
+
+
+#define DEFAULT_SS3T_NITER 3
+#define DEFAULT_SS3T_BZERO_PCT 10.0
+
+
+void usage ()
+{
+  AUTHOR = "Thijs Dhollander (thijs.dhollander@gmail.com)";
+
+  COPYRIGHT =
+    "Copyright (c) 2019 Thijs Dhollander and The Florey Institute of Neuroscience and Mental Health, Melbourne, Australia. "
+    "This Software is provided on an \"as is\" basis, without warranty of any kind, either expressed, implied, or statutory, "
+    "including, without limitation, warranties that the Software is free of defects, merchantable, fit for a particular purpose or non-infringing.";
+
+  SYNOPSIS = "SS3T-CSD: single-shell 3-tissue constrained spherical deconvolution";
+
+  DESCRIPTION
+    + "This is an implementation of SS3T-CSD for beta testing and distribution. Use with caution and check all results carefully."
+
+    + "The iterative algorithm alternates between estimating the WM FOD and GM compartment from the "
+      "data after removal of the current CSF signal, and the GM and CSF compartments from the data "
+      "after removal of the current WM signal. All iterations are performed in memory for each voxel "
+      "in turn; no intermediate images are written to disk."
+
+    + "For more information on how to use SS3T-CSD, please visit https://3Tissue.github.io/doc/ss3t-csd.html";
+
+  REFERENCES
+    + "Dhollander, T. & Connelly, A. " // Internal
+      "A novel iterative approach to reap the benefits of multi-tissue CSD from just single-shell (+b=0) diffusion MRI data. "
+      "Proc Intl Soc Mag Reson Med, 2016, 3010";
+
+  ARGUMENTS
+    + Argument ("in_dMRI_data", "Input dMRI dataset").type_image_in()
+    + Argument ("in_SFWM_resp", "Input single-fibre WM response function text file").type_file_in()
+    + Argument ("out_WM_FOD", "Output WM FOD image").type_image_out()
+    + Argument ("in_GM_resp", "Input GM response function text file").type_file_in()
+    + Argument ("out_GM", "Output GM image").type_image_out()
+    + Argument ("in_CSF_resp", "Input CSF response function text file").type_file_in()
+    + Argument ("out_CSF", "Output CSF image").type_image_out();
+
+  OPTIONS
+    + Option ("mask", "Only perform SS3T-CSD within a (brain) mask.")
+      + Argument ("image").type_image_in()
+
+    + Option ("niter", "Number of iterations. (default: " + str(DEFAULT_SS3T_NITER) + ")")
+      + Argument ("number").type_integer (2)
+
+    + Option ("bzero_pct", "Weight b=0 images contribution as a percentage of the number of (non b=0) DWIs. "
+                           "(default: " + str(DEFAULT_SS3T_BZERO_PCT) + " per cent)")
+      + Argument ("value").type_float (0.0)
+
+    + DWI::GradImportOptions()
+    + Stride::Options;
+}
+
+
+
+using value_type = float;
+
+
+
+// Signal decay metric of a response function: log ratio of the b=0 and non b=0 isotropic terms
+default_type sdm (const Eigen::MatrixXd& response)
+{
+  return response(1,0) > 0.0 ? std::log (response(0,0) / response(1,0)) : std::numeric_limits<default_type>::infinity();
+}
+
+
+
+Eigen::MatrixXd load_response (const std::string& path, const std::string& description)
+{
+  Eigen::MatrixXd response;
+  try {
+    response = load_matrix (path);
+  } catch (Exception& e) {
+    throw Exception (e, "File \"" + path + "\" is not a valid response function file");
+  }
+  if (response.rows() != 2)
+    throw Exception (description + " response file (" + path + ") contains " + str(response.rows()) + " lines. "
+                     "Exactly 2 lines are required, for b=0 and a single non b=0 shell.");
+  return response;
+}
+
+
+
+void check_isotropic (const Eigen::MatrixXd& response, const std::string& description, const std::string& path)
+{
+  if (response.cols() != 1)
+    throw Exception (description + " response file (" + path + ") contains " + str(response.cols()) + " coefficients per line. "
+                     "Both lines should only contain a single coefficient (lmax = 0), for isotropic b=0 and an isotropic non b=0 shell.");
+}
+
+
+
+
+
+class SS3T_Processor { MEMALIGN (SS3T_Processor)
+  public:
+    SS3T_Processor (const DWI::SDeconv::MSMT_CSD::Shared& shared_gm_wm,
+                    const DWI::SDeconv::MSMT_CSD::Shared& shared_gm_csf,
+                    const vector<size_t>& volumes,
+                    const size_t num_bzero,
+                    const default_type bzero_weight,
+                    const size_t niter,
+                    Image<bool>& mask_image,
+                    Image<value_type>& wm_image,
+                    Image<value_type>& gm_image,
+                    Image<value_type>& csf_image) :
+        gm_wm (shared_gm_wm),
+        gm_csf (shared_gm_csf),
+        volumes (volumes),
+        num_bzero (num_bzero),
+        bzero_weight (bzero_weight),
+        niter (niter),
+        mask_image (mask_image),
+        wm_image (wm_image),
+        gm_image (gm_image),
+        csf_image (csf_image),
+        dwi_data (volumes.size()),
+        residual (volumes.size()),
+        gm_wm_data (shared_gm_wm.problem.H.cols()),
+        gm_csf_data (shared_gm_csf.problem.H.cols()) { }
+
+
+    void operator() (Image<value_type>& dwi_image)
+    {
+      if (mask_image.valid()) {
+        assign_pos_of (dwi_image, 0, 3).to (mask_image);
+        if (!mask_image.value())
+          return;
+      }
+
+      for (size_t n = 0; n != volumes.size(); ++n) {
+        dwi_image.index(3) = volumes[n];
+        dwi_data[n] = dwi_image.value();
+      }
+      dwi_data.head (num_bzero) *= bzero_weight;
+
+      const auto& H_gm_wm (gm_wm.shared.problem.H);
+      const auto& H_gm_csf (gm_csf.shared.problem.H);
+      const ssize_t num_wm = H_gm_wm.cols() - 1;
+
+      // initialisation: GM & CSF only
+      solve (gm_csf, dwi_data, gm_csf_data, dwi_image);
+
+      for (size_t iter = 0; iter != niter; ++iter) {
+        // remove the current CSF signal; estimate GM & WM
+        residual.noalias() = dwi_data - H_gm_csf.col (1) * gm_csf_data[1];
+        solve (gm_wm, residual, gm_wm_data, dwi_image);
+        // remove the current WM signal; estimate GM & CSF
+        residual.noalias() = dwi_data - H_gm_wm.rightCols (num_wm) * gm_wm_data.tail (num_wm);
+        solve (gm_csf, residual, gm_csf_data, dwi_image);
+      }
+
+      assign_pos_of (dwi_image, 0, 3).to (wm_image, gm_image, csf_image);
+      wm_image.row(3) = gm_wm_data.tail (num_wm);
+      gm_image.value() = gm_csf_data[0];
+      csf_image.value() = gm_csf_data[1];
+    }
+
+
+  private:
+    DWI::SDeconv::MSMT_CSD gm_wm, gm_csf;
+    const vector<size_t>& volumes;
+    const size_t num_bzero;
+    const default_type bzero_weight;
+    const size_t niter;
+    Image<bool> mask_image;
+    Image<value_type> wm_image, gm_image, csf_image;
+    Eigen::VectorXd dwi_data, residual, gm_wm_data, gm_csf_data;
+
+
+    void solve (DWI::SDeconv::MSMT_CSD& sdeconv, const Eigen::VectorXd& data, Eigen::VectorXd& output, const Image<value_type>& dwi_image)
+    {
+      sdeconv (data, output);
+      if (sdeconv.niter >= sdeconv.shared.problem.max_niter) {
+        INFO ("voxel [ " + str (dwi_image.index(0)) + " " + str (dwi_image.index(1)) + " " + str (dwi_image.index(2)) +
+            " ] did not reach full convergence");
+      }
+    }
+};
+
+
+
+
+
+
+
+void run ()
+{
+  auto header_in = Header::open (argument[0]);
+  if (header_in.ndim() != 4)
+    throw Exception ("Input dMRI dataset (" + header_in.name() + ") should be a 4D image");
+  const Eigen::MatrixXd grad = DWI::get_valid_DW_scheme (header_in);
+
+  DWI::Shells shells (grad);
+  if (shells.count() != 2 || !shells[0].is_bzero() || shells[1].is_bzero())
+    throw Exception ("Need b=0 data and a single non b=0 shell.");
+  const default_type bvalue = std::round (shells[1].get_mean());
+  const vector<size_t> bzero_volumes = shells[0].get_volumes();
+  const vector<size_t> dwi_volumes = shells[1].get_volumes();
+  CONSOLE (str(shells.count()) + " unique b-value(s) detected: " + str(std::round (shells[0].get_mean())) + "," + str(bvalue) +
+           " with " + str(bzero_volumes.size()) + "," + str(dwi_volumes.size()) + " volumes");
+
+  Eigen::MatrixXd sfwm_response = load_response (argument[1], "Single-fibre WM");
+  if (sfwm_response.cols() < 5)
+    throw Exception ("Single-fibre WM response file (" + std::string(argument[1]) + ") contains " + str(sfwm_response.cols()) + " coefficients per line. "
+                     "A minimum of 5 coefficients (lmax at least 8) is required for each line, and the number of coefficients has to match for both lines.");
+  if ((sfwm_response.row(0).tail (sfwm_response.cols()-1).array() != 0.0).any())
+    throw Exception ("Single-fibre WM response file (" + std::string(argument[1]) + ") has anisotropic data on the first line. "
+                     "The first line should represent the isotropic WM response for b=0: a single coefficient followed by a number of zero valued coefficients on the same line.");
+  if ((sfwm_response.row(1).tail (sfwm_response.cols()-1).array() == 0.0).all())
+    throw Exception ("Single-fibre WM response file (" + std::string(argument[1]) + ") has isotropic data on the second line. "
+                     "The second line should represent the anisotropic WM response for the non b=0 shell: beyond the first coefficient on this line, at least another one (and typically all of them) should be non-zero on the same line.");
+
+  Eigen::MatrixXd gm_response = load_response (argument[3], "GM");
+  Eigen::MatrixXd csf_response = load_response (argument[5], "CSF");
+  check_isotropic (gm_response, "GM", argument[3]);
+  check_isotropic (csf_response, "CSF", argument[5]);
+
+  const default_type sfwm_sdm = sdm (sfwm_response);
+  const default_type gm_sdm = sdm (gm_response);
+  const default_type csf_sdm = sdm (csf_response);
+  CONSOLE ("SDM: SF WM = " + str(sfwm_sdm) + ", GM = " + str(gm_sdm) + ", CSF = " + str(csf_sdm));
+  if (csf_sdm < gm_sdm || gm_sdm < sfwm_sdm)
+    throw Exception ("Signal decay metric (SDM) ordering should be: SDM(SF WM) < SDM(GM) < SDM(CSF).");
+
+  auto mask = Image<bool>();
+  auto opt = get_options ("mask");
+  if (opt.size()) {
+    mask = Image<bool>::open (opt[0][0]);
+    check_dimensions (header_in, mask, 0, 3);
+  }
+
+  const size_t niter = get_option_value ("niter", DEFAULT_SS3T_NITER);
+  const default_type bzero_pct = get_option_value ("bzero_pct", DEFAULT_SS3T_BZERO_PCT);
+  if (bzero_pct <= 0.0)
+    throw Exception ("Requested b=0 contribution (via -bzero_pct) is " + str(bzero_pct) + " per cent. It should be strictly larger than zero percent.");
+
+  // Weighted data: all b=0 volumes first, scaled such that their total contribution
+  //   corresponds to the requested percentage of the number of non b=0 volumes
+  const default_type bzero_weight = std::sqrt ((default_type(dwi_volumes.size()) * bzero_pct) / (default_type(bzero_volumes.size()) * 100.0));
+  vector<size_t> volumes (bzero_volumes);
+  volumes.insert (volumes.end(), dwi_volumes.begin(), dwi_volumes.end());
+  Eigen::MatrixXd weighted_grad (Eigen::MatrixXd::Zero (volumes.size(), 4));
+  for (size_t n = 0; n != dwi_volumes.size(); ++n) {
+    weighted_grad.row (bzero_volumes.size() + n).head (3) = grad.row (dwi_volumes[n]).head (3);
+    weighted_grad (bzero_volumes.size() + n, 3) = bvalue;
+  }
+
+  sfwm_response.row(0) *= bzero_weight;
+  gm_response.row(0) *= bzero_weight;
+  csf_response.row(0) *= bzero_weight;
+
+  DWI::SDeconv::MSMT_CSD::Shared shared_gm_wm (weighted_grad);
+  shared_gm_wm.set_responses (vector<Eigen::MatrixXd> ({ gm_response, sfwm_response }));
+  shared_gm_wm.lmax = { 0, 8 };
+  shared_gm_wm.init();
+
+  DWI::SDeconv::MSMT_CSD::Shared shared_gm_csf (weighted_grad);
+  shared_gm_csf.set_responses (vector<Eigen::MatrixXd> ({ gm_response, csf_response }));
+  shared_gm_csf.lmax = { 0, 0 };
+  shared_gm_csf.init();
+
+  Header header_out (header_in);
+  header_out.ndim() = 4;
+  header_out.datatype() = DataType::Float32;
+  header_out.datatype().set_byte_order_native();
+  Stride::set_from_command_line (header_out, Stride::contiguous_along_axis (3, header_in));
+  DWI::stash_DW_scheme (header_out, grad);
+  PhaseEncoding::clear_scheme (header_out);
+  header_out.keyval()["SS3T-CSD_sdm_sfwm"] = str(sfwm_sdm);
+  header_out.keyval()["SS3T-CSD_sdm_gm"] = str(gm_sdm);
+  header_out.keyval()["SS3T-CSD_sdm_csf"] = str(csf_sdm);
+  header_out.keyval()["SS3T-CSD_niter"] = str(niter);
+  header_out.keyval()["SS3T-CSD_bzero_pct"] = str(bzero_pct);
+
+  header_out.size(3) = Math::SH::NforL (shared_gm_wm.lmax[1]);
+  auto wm = Image<value_type>::create (argument[2], header_out);
+  header_out.size(3) = 1;
+  auto gm = Image<value_type>::create (argument[4], header_out);
+  auto csf = Image<value_type>::create (argument[6], header_out);
+
+  SS3T_Processor processor (shared_gm_wm, shared_gm_csf, volumes, bzero_volumes.size(), bzero_weight, niter, mask, wm, gm, csf);
+  auto dwi = header_in.get_image<value_type>().with_direct_io (3);
+  ThreadedLoop ("performing SS3T-CSD (niter = " + str(niter) + ", bzero_pct = " + str(bzero_pct) + ")", dwi, 0, 3)
+      .run (processor, dwi);
+}
+
@@ -202,6 +202,44 @@ namespace MR
           return interp.value();
         }
 
+        using ImageBase<Reslice<Interpolator,ImageType>,value_type>::row;
+
+        //! read the values of all volumes along \a axis (>= 3) into \a values
+        /*! This is equivalent to reading row(axis), but the transformation,
+         * interpolation weights and neighbouring voxel locations are only
+         * computed once for the current spatial position (or once per
+         * sample when over-sampling), and then applied to all volumes at
+         * once. */
+        template <class VectorType>
+        void row (size_t axis, VectorType& values) {
+          using namespace Eigen;
+          assert (axis > 2);
+          if (oversampling) {
+            Vector3 d (x[0]+from[0], x[1]+from[1], x[2]+from[2]);
+            sum.setZero (interp.size (axis));
+            Vector3 s;
+            for (int z = 0; z < OS[2]; ++z) {
+              s[2] = d[2] + z*inc[2];
+              for (int y = 0; y < OS[1]; ++y) {
+                s[1] = d[1] + y*inc[1];
+                for (int x = 0; x < OS[0]; ++x) {
+                  s[0] = d[0] + x*inc[0];
+                  if (interp.voxel (direct_transform * s)) {
+                    Interp::row (interp, axis, sample);
+                    sum += sample.template cast<default_type>();
+                  }
+                }
+              }
+            }
+            values.resize (sum.size());
+            for (ssize_t n = 0; n < sum.size(); ++n)
+              values[n] = normalise<value_type> (sum[n], norm);
+            return;
+          }
+          interp.voxel (direct_transform * Vector3 (x[0], x[1], x[2]));
+          Interp::row (interp, axis, values);
+        }
+
         ssize_t get_index (size_t axis) const { return axis < 3 ? x[axis] : interp.index(axis); }
         void move_index (size_t axis, ssize_t increment) {
           if (axis < 3) x[axis] += increment;
@@ -210,6 +248,8 @@ namespace MR
 
       private:
         Interpolator<ImageType> interp;
+        Eigen::Matrix<value_type, Eigen::Dynamic, 1> sample;
+        Eigen::Matrix<default_type, Eigen::Dynamic, 1> sum;
         ssize_t x[3];
         const ssize_t dim[3];
         const default_type vox[3];
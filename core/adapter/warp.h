@@ -103,6 +103,33 @@ namespace MR
           return (value_type) val;
         }
 
+        using ImageBase<Warp<Interpolator,ImageType,WarpType>,value_type>::row;
+
+        //! read the values of all volumes along \a axis (>= 3) into \a values
+        /*! This is equivalent to reading row(axis), but the deformation,
+         * interpolation weights and Jacobian are only computed once for the
+         * current spatial position. */
+        template <class VectorType>
+        void row (size_t axis, VectorType& values) {
+          assert (axis > 2);
+          Eigen::Vector3 pos = get_position();
+          if (std::isnan(pos[0]) || std::isnan(pos[1]) || std::isnan(pos[2])) {
+            values.resize (interp.size (axis));
+            values.fill (value_when_out_of_bounds);
+            return;
+          }
+          interp.scanner (pos);
+          Interp::row (interp, axis, values);
+          if (jac_modulate) {
+            for (size_t dim = 0; dim < 3; ++dim)
+              jacobian_adapter.index(dim) = x[dim];
+            const default_type jacobian = jacobian_adapter.value().template cast<default_type>().determinant();
+            for (ssize_t n = 0; n < values.size(); ++n)
+              if (values[n] != 0.0)
+                values[n] = value_type (default_type (values[n]) * jacobian);
+          }
+        }
+
         ssize_t get_index (size_t axis) const { return axis < 3 ? x[axis] : interp.index(axis); }
         void move_index (size_t axis, ssize_t increment) {
           if (axis < 3) x[axis] += increment;
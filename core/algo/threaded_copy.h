@@ -32,6 +32,49 @@ namespace MR
         }
     };
 
+
+    // copy a whole row along the (single) inner axis of the loop at a
+    // time, for image types that support reading / writing spans of values:
+    template <class InputImageType, class OutputImageType>
+      struct __copy_row_func { MEMALIGN(__copy_row_func<InputImageType,OutputImageType>)
+        __copy_row_func (const InputImageType& in, const OutputImageType& out, const vector<size_t>& outer_axes, size_t axis) :
+          in (in), out (out), outer_axes (outer_axes), axis (axis),
+          in_values (in.size (axis)), out_values (in.size (axis)) { }
+
+        void operator() (const Iterator& pos) {
+          assign_pos_of (pos, outer_axes).to (in, out);
+          in.index (axis) = out.index (axis) = 0;
+          in.get_values (axis, in_values.data(), in_values.size());
+          for (ssize_t n = 0; n < in_values.size(); ++n)
+            out_values[n] = typename OutputImageType::value_type (in_values[n]);
+          out.set_values (axis, out_values.data(), out_values.size());
+        }
+
+        InputImageType in;
+        OutputImageType out;
+        const vector<size_t>& outer_axes;
+        const size_t axis;
+        Eigen::Array<typename InputImageType::value_type, Eigen::Dynamic, 1> in_values;
+        Eigen::Array<typename OutputImageType::value_type, Eigen::Dynamic, 1> out_values;
+      };
+
+
+    template <class LoopType, class InputImageType, class OutputImageType>
+      inline auto __run_copy (LoopType&& loop, InputImageType& in, OutputImageType& out, int)
+      -> decltype (in.get_values (0, nullptr, 0), out.set_values (0, nullptr, 0), void())
+      {
+        if (loop.inner_axes.size() == 1)
+          loop.run_outer (__copy_row_func<InputImageType,OutputImageType> (in, out, loop.outer_loop.axes, loop.inner_axes[0]));
+        else
+          loop.run (__copy_func(), in, out);
+      }
+
+    template <class LoopType, class InputImageType, class OutputImageType>
+      inline void __run_copy (LoopType&& loop, InputImageType& in, OutputImageType& out, long)
+      {
+        loop.run (__copy_func(), in, out);
+      }
+
   }
 
   //! \endcond
@@ -46,8 +89,7 @@ namespace MR
         const vector<size_t>& axes,
         size_t num_axes_in_thread = 1) 
     {
-      ThreadedLoop (source, axes, num_axes_in_thread)
-        .run (__copy_func(), source, destination);
+      __run_copy (ThreadedLoop (source, axes, num_axes_in_thread), source, destination, 0);
     }
 
   template <class InputImageType, class OutputImageType>
@@ -58,8 +100,7 @@ namespace MR
         size_t to_axis = std::numeric_limits<size_t>::max(),
         size_t num_axes_in_thread = 1)
     {
-      ThreadedLoop (source, from_axis, to_axis, num_axes_in_thread)
-        .run (__copy_func(), source, destination);
+      __run_copy (ThreadedLoop (source, from_axis, to_axis, num_axes_in_thread), source, destination, 0);
     }
 
 
@@ -73,8 +114,7 @@ namespace MR
         const vector<size_t>& axes,
         size_t num_axes_in_thread = 1)
     {
-      ThreadedLoop (message, source, axes, num_axes_in_thread)
-        .run (__copy_func(), source, destination);
+      __run_copy (ThreadedLoop (message, source, axes, num_axes_in_thread), source, destination, 0);
     }
 
   template <class InputImageType, class OutputImageType>
@@ -86,8 +126,7 @@ namespace MR
         size_t to_axis = std::numeric_limits<size_t>::max(), 
         size_t num_axes_in_thread = 1)
     {
-      ThreadedLoop (message, source, from_axis, to_axis, num_axes_in_thread)
-        .run (__copy_func(), source, destination);
+      __run_copy (ThreadedLoop (message, source, from_axis, to_axis, num_axes_in_thread), source, destination, 0);
     }
 
 
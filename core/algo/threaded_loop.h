@@ -22,6 +22,8 @@
 #include "algo/iterator.h"
 #include "thread.h"
 
+#define MRTRIX_THREADED_LOOP_CHUNK_DIVISOR 8
+
 namespace MR
 {
 
@@ -68,6 +70,15 @@ namespace MR
    *    time;
    * 4. repeat from step 1 until all the data have been processed.
    *
+   * Where the amount of work per outer position is small or uneven (e.g.
+   * only voxels within a mask are processed), the with_work_stealing()
+   * method can be invoked on the object returned by ThreadedLoop(). Each
+   * thread then processes chunks of consecutive outer positions from its own
+   * range, only synchronising with other threads once it runs out of work:
+   * ~~~{.cpp}
+   * ThreadedLoop ("processing", vox, 0, 3).with_work_stealing().run (func, vox);
+   * ~~~
+   *
    *
    * \section threaded_loop_constructor Instantiating a ThreadedLoop() object
    *
@@ -318,6 +329,20 @@ namespace MR
         Iterator iterator;
         OuterLoopType outer_loop;
         vector<size_t> inner_axes;
+        bool work_stealing;
+
+        //! use chunked, work-stealing scheduling of the outer loop positions
+        /*! By default, each thread obtains one position at a time along the
+         * outer axes. If enabled, the positions are instead split into
+         * contiguous ranges, one per thread, from which each thread takes
+         * chunks of decreasing size; a thread that exhausts its own range
+         * then steals half of the largest remaining range. This reduces
+         * contention when the work per position is small, and idle time when
+         * it is uneven. */
+        ThreadedLoopRunOuter& with_work_stealing (bool enable = true) {
+          work_stealing = enable;
+          return *this;
+        }
 
         //! invoke \a functor (const Iterator& pos) per voxel <em> in the outer axes only</em>
         template <class Functor>
@@ -329,6 +354,11 @@ namespace MR
               return;
             }
 
+            if (work_stealing) {
+              run_outer_chunked (functor);
+              return;
+            }
+
             std::mutex mutex;
             ProgressBar::SwitchToMultiThreaded progress_functions;
 
@@ -365,6 +395,136 @@ namespace MR
 
 
 
+        template <class Functor>
+          void run_outer_chunked (Functor&& functor)
+          {
+            const size_t num_threads = Thread::threads_to_execute();
+            size_t num_positions = 1;
+            for (auto axis : outer_loop.axes)
+              num_positions *= iterator.size (axis);
+
+            std::mutex mutex;
+            ProgressBar::SwitchToMultiThreaded progress_functions;
+
+            // range of linear outer loop indices still to be processed by
+            // each thread:
+            struct Range { NOMEMALIGN
+              std::mutex mutex;
+              size_t begin, end;
+              size_t remaining () {
+                std::lock_guard<std::mutex> lock (mutex);
+                return end - begin;
+              }
+            };
+            vector<Range> ranges (num_threads);
+            for (size_t n = 0; n < num_threads; ++n) {
+              ranges[n].begin = (n * num_positions) / num_threads;
+              ranges[n].end = ((n+1) * num_positions) / num_threads;
+            }
+
+            struct Shared { MEMALIGN(Shared)
+              Iterator& iterator;
+              decltype (outer_loop (iterator)) loop;
+              std::mutex& mutex;
+              vector<Range>& ranges;
+              size_t num_launched;
+
+              size_t thread_index () {
+                std::lock_guard<std::mutex> lock (mutex);
+                return num_launched++;
+              }
+
+              // take the next chunk from the thread's own range, stealing
+              // half of the largest remaining range once it is exhausted:
+              bool next (size_t index, size_t& begin, size_t& end) {
+                Range& own (ranges[index]);
+                while (true) {
+                  {
+                    std::lock_guard<std::mutex> lock (own.mutex);
+                    if (own.begin < own.end) {
+                      begin = own.begin;
+                      own.begin += std::max (size_t(1), (own.end - own.begin) / MRTRIX_THREADED_LOOP_CHUNK_DIVISOR);
+                      end = own.begin;
+                      return true;
+                    }
+                  }
+
+                  size_t victim = 0, max_remaining = 0;
+                  for (size_t n = 0; n < ranges.size(); ++n) {
+                    const size_t remaining = ranges[n].remaining();
+                    if (remaining > max_remaining) {
+                      max_remaining = remaining;
+                      victim = n;
+                    }
+                  }
+                  if (!max_remaining)
+                    return false;
+
+                  size_t stolen_begin, stolen_end;
+                  {
+                    std::lock_guard<std::mutex> lock (ranges[victim].mutex);
+                    Range& range (ranges[victim]);
+                    if (range.begin >= range.end)
+                      continue;
+                    stolen_end = range.end;
+                    range.end -= (range.end - range.begin + 1) / 2;
+                    stolen_begin = range.end;
+                  }
+                  std::lock_guard<std::mutex> lock (own.mutex);
+                  own.begin = stolen_begin;
+                  own.end = stolen_end;
+                }
+              }
+
+              // set the outer axes of pos from a linear index:
+              void set_position (size_t index, Iterator& pos) const {
+                for (auto axis : loop.axes) {
+                  pos.index (axis) = index % iterator.size (axis);
+                  index /= iterator.size (axis);
+                }
+              }
+
+              void increment (Iterator& pos) const {
+                for (auto axis : loop.axes) {
+                  if (++pos.index (axis) < iterator.size (axis))
+                    return;
+                  pos.index (axis) = 0;
+                }
+              }
+
+              void update_progress (size_t count) {
+                std::lock_guard<std::mutex> lock (mutex);
+                while (count--)
+                  ++loop;
+              }
+            } shared = { iterator, outer_loop (iterator), mutex, ranges, 0 };
+
+            struct PerThread { MEMALIGN(PerThread)
+              Shared& shared;
+              typename std::remove_reference<Functor>::type func;
+              void execute () {
+                const size_t index = shared.thread_index();
+                Iterator pos = shared.iterator;
+                size_t begin, end;
+                while (shared.next (index, begin, end)) {
+                  shared.set_position (begin, pos);
+                  for (size_t n = begin; n < end; ++n) {
+                    func (pos);
+                    shared.increment (pos);
+                  }
+                  shared.update_progress (end - begin);
+                }
+              }
+            } loop_thread = { shared, functor };
+
+            auto threads = Thread::run (Thread::multi (loop_thread, num_threads), "loop threads");
+
+            __manage_progress (&shared.loop, &threads);
+            threads.wait();
+          }
+
+
+
         //! invoke \a functor (const Iterator& pos) per voxel <em> in the outer axes only</em>
         template <class Functor, class... ImageType>
           void run (Functor&& functor, ImageType&&... vox)
@@ -0,0 +1,92 @@
+/* Copyright (c) 2008-2019 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Covered Software is provided under this License on an "as is"
+ * basis, without warranty of any kind, either expressed, implied, or
+ * statutory, including, without limitation, warranties that the
+ * Covered Software is free of defects, merchantable, fit for a
+ * particular purpose or non-infringing.
+ * See the Mozilla Public License v. 2.0 for more details.
+ *
+ * For more details, see http://www.mrtrix.org/.
+ */
+
+#ifndef __algo_union_find_h__
+#define __algo_union_find_h__
+
+#include <numeric>
+
+#include "types.h"
+
+namespace MR
+{
+  namespace Algo
+  {
+
+
+
+    //! A disjoint-set forest, with union by size and path halving
+    /*! Elements are identified by indices in the range [0, size()), and
+     * initially each reside in their own set. unite() merges the sets
+     * containing two elements, and find() yields the representative
+     * element of the set containing an element; both have effectively
+     * constant amortised cost. The number of elements in each set is
+     * available from its representative via count(). */
+    template <typename IndexType = uint32_t>
+    class UnionFind { NOMEMALIGN
+      public:
+        using index_type = IndexType;
+
+        UnionFind (const size_t num_elements = 0) { reset (num_elements); }
+
+        //! return all elements to their own individual sets
+        void reset (const size_t num_elements) {
+          parent.resize (num_elements);
+          std::iota (parent.begin(), parent.end(), index_type(0));
+          set_size.assign (num_elements, 1);
+        }
+
+        size_t size() const { return parent.size(); }
+
+        index_type find (index_type i) {
+          assert (size_t(i) < size());
+          while (parent[i] != i) {
+            parent[i] = parent[parent[i]];
+            i = parent[i];
+          }
+          return i;
+        }
+
+        //! merge the sets containing \a a and \a b, and return the representative of the result
+        index_type unite (index_type a, index_type b) {
+          a = find (a);
+          b = find (b);
+          if (a == b)
+            return a;
+          if (set_size[a] < set_size[b])
+            std::swap (a, b);
+          parent[b] = a;
+          set_size[a] += set_size[b];
+          return a;
+        }
+
+        //! the number of elements in the set represented by \a root
+        size_t count (const index_type root) const {
+          assert (parent[root] == root);
+          return set_size[root];
+        }
+
+      private:
+        vector<index_type> parent;
+        vector<size_t> set_size;
+    };
+
+
+
+  }
+}
+
+#endif
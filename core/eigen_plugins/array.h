@@ -17,8 +17,7 @@
 #define MRTRIX_OP(ARG) \
 template <class ImageType> inline Array& operator ARG (const MR::Helper::ConstRow<ImageType>& row) {\
   this->resize (row.image.size(row.axis),1); \
-  for (row.image.index(row.axis) = 0; row.image.index (row.axis) < row.image.size (row.axis); ++row.image.index (row.axis)) \
-    this->operator() (row.image.index (row.axis), 0) ARG row.image.value(); \
+  row.for_each ([this] (ssize_t n, typename ImageType::value_type value) { this->operator() (n, 0) ARG value; }); \
   return *this; \
 }
 
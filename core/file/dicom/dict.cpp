@@ -14,6 +14,8 @@
  * For more details, see http://www.mrtrix.org/.
  */
 
+#include <mutex>
+
 #include "file/dicom/element.h"
 
 namespace MR {
@@ -23,11 +25,20 @@ namespace MR {
       std::unordered_map<uint32_t, const char*> Element::dict;
 
 
+      // the dictionary is loaded on first use, possibly from several threads
+      // at once when scanning DICOM folders:
+      void Element::init_dict()
+      {
+        static std::once_flag loaded;
+        std::call_once (loaded, load_dict);
+      }
+
+
       // Note this implementation does not account for multiplicity
       // The invoking code is expected to have prior information as to how many
       // items are stored in any given tag.
 
-      void Element::init_dict()
+      void Element::load_dict()
       {
         INFO ("initialising DICOM dictionary");
 
@@ -113,9 +113,9 @@ namespace MR {
           }
 
           std::string tag_name () const {
-            if (dict.empty()) init_dict();
-            const char* s = dict[tag()];
-            return (s ? s : "");
+            init_dict();
+            const auto entry = dict.find (tag());
+            return (entry != dict.end() && entry->second ? entry->second : "");
           }
 
           uint32_t tag () const {
@@ -193,6 +193,7 @@ namespace MR {
 
           static std::unordered_map<uint32_t, const char*> dict;
           static void init_dict();
+          static void load_dict();
 
           bool check_get (size_t idx, size_t size) const { if (idx >= size) { error_in_get (idx); return false; } return true; }
           void error_in_get (size_t idx) const;
@@ -14,6 +14,11 @@
  * For more details, see http://www.mrtrix.org/.
  */
 
+#include <sys/stat.h>
+#include <fstream>
+#include <map>
+
+#include "file/config.h"
 #include "file/path.h"
 #include "file/dicom/element.h"
 #include "file/dicom/quick_scan.h"
@@ -22,6 +27,7 @@
 #include "file/dicom/study.h"
 #include "file/dicom/patient.h"
 #include "file/dicom/tree.h"
+#include "thread_queue.h"
 
 namespace MR {
   namespace File {
@@ -54,7 +60,232 @@ namespace MR {
 
 
 
-      void Tree::read_dir (const std::string& filename, ProgressBar& progress)
+      namespace {
+
+        // the result of scanning a single file, along with the size and
+        // modification time used to validate entries in the index cache:
+        class IndexEntry { NOMEMALIGN
+          public:
+            IndexEntry (const std::string& filename = "") :
+              filename (filename), size (0), mtime (0), has_image (false), scanned (false) { }
+
+            std::string filename;
+            int64_t size, mtime;
+            bool has_image, scanned;
+            QuickScan reader;
+
+            void stat () {
+              struct stat buf;
+              if (!::stat (filename.c_str(), &buf)) {
+                size = buf.st_size;
+                mtime = buf.st_mtime;
+              }
+            }
+
+            void scan () {
+              scanned = true;
+              has_image = false;
+              try {
+                if (reader.read (filename)) {
+                  INFO ("error reading file \"" + filename + "\" - ignored");
+                  return;
+                }
+                if (! (reader.dim[0] && reader.dim[1] && reader.bits_alloc && reader.data)) {
+                  INFO ("DICOM file \"" + filename + "\" does not seem to contain image data - ignored");
+                  return;
+                }
+                has_image = true;
+              }
+              catch (Exception& E) {
+                E.display (3);
+              }
+            }
+        };
+
+
+
+        //CONF option: DICOMIndexCacheDir
+        //CONF default: `` (none)
+        //CONF A folder in which to keep an index of the DICOM headers found
+        //CONF when scanning DICOM folders. Each file in the index is
+        //CONF identified by its path, size and modification time; on
+        //CONF subsequent accesses to the same DICOM folder, only those files
+        //CONF that are new or have changed need to be read, making series
+        //CONF selection much faster for large folders. By default, no index
+        //CONF is kept.
+        std::string index_cache_file (const std::string& folder)
+        {
+          const std::string cache_dir = File::Config::get ("DICOMIndexCacheDir");
+          if (cache_dir.empty())
+            return "";
+
+          // key the index on the absolute path of the folder:
+          std::string path (folder);
+          const bool is_absolute = path.size() && (strchr (PATH_SEPARATORS, path[0]) || (path.size() > 1 && path[1] == ':'));
+          if (!is_absolute) {
+            char buf[PATH_MAX];
+            if (!getcwd (buf, PATH_MAX))
+              return "";
+            path = Path::join (buf, path);
+          }
+          return Path::join (cache_dir, "dicom_index_" + str (std::hash<std::string>() (path)));
+        }
+
+
+
+        // binary I/O of the index cache entries:
+        template <typename T>
+          inline void write_value (std::ostream& out, T value) {
+            out.write (reinterpret_cast<const char*> (&value), sizeof (T));
+          }
+        inline void write_value (std::ostream& out, const std::string& value) {
+          write_value<uint64_t> (out, value.size());
+          out.write (value.data(), value.size());
+        }
+
+        template <typename T>
+          inline void read_value (std::istream& in, T& value) {
+            in.read (reinterpret_cast<char*> (&value), sizeof (T));
+          }
+        inline void read_value (std::istream& in, std::string& value) {
+          uint64_t size = 0;
+          read_value (in, size);
+          if (!in || size > (1U<<20))
+            throw Exception ("invalid string in DICOM index cache");
+          value.resize (size);
+          in.read (&value[0], size);
+        }
+
+        const std::string index_cache_magic ("mrtrix DICOM index 1\n");
+
+
+        void write_entry (std::ostream& out, const IndexEntry& entry)
+        {
+          write_value (out, entry.filename);
+          write_value (out, entry.size);
+          write_value (out, entry.mtime);
+          write_value<uint8_t> (out, entry.has_image);
+          if (!entry.has_image)
+            return;
+          const QuickScan& r (entry.reader);
+          for (const auto s : { &r.modality, &r.patient, &r.patient_ID, &r.patient_DOB,
+              &r.study, &r.study_ID, &r.study_date, &r.study_time,
+              &r.series, &r.series_date, &r.series_time, &r.sequence })
+            write_value (out, *s);
+          for (const auto n : { r.series_number, r.bits_alloc, r.dim[0], r.dim[1], r.data })
+            write_value<uint64_t> (out, n);
+          write_value<uint8_t> (out, r.transfer_syntax_supported);
+          write_value<uint64_t> (out, r.image_type.size());
+          for (const auto& type : r.image_type) {
+            write_value (out, type.first);
+            write_value<uint64_t> (out, type.second);
+          }
+        }
+
+
+        void read_entry (std::istream& in, IndexEntry& entry)
+        {
+          uint8_t flag;
+          read_value (in, entry.filename);
+          read_value (in, entry.size);
+          read_value (in, entry.mtime);
+          read_value (in, flag);
+          entry.has_image = flag;
+          if (!entry.has_image)
+            return;
+          QuickScan& r (entry.reader);
+          r.filename = entry.filename;
+          for (const auto s : { &r.modality, &r.patient, &r.patient_ID, &r.patient_DOB,
+              &r.study, &r.study_ID, &r.study_date, &r.study_time,
+              &r.series, &r.series_date, &r.series_time, &r.sequence })
+            read_value (in, *s);
+          for (const auto n : { &r.series_number, &r.bits_alloc, &r.dim[0], &r.dim[1], &r.data }) {
+            uint64_t value;
+            read_value (in, value);
+            *n = value;
+          }
+          read_value (in, flag);
+          r.transfer_syntax_supported = flag;
+          uint64_t num_types;
+          read_value (in, num_types);
+          r.image_type.clear();
+          for (uint64_t n = 0; n < num_types && in; ++n) {
+            std::string type;
+            uint64_t count;
+            read_value (in, type);
+            read_value (in, count);
+            r.image_type[type] = count;
+          }
+          if (!in)
+            throw Exception ("unexpected end of DICOM index cache");
+        }
+
+
+
+        std::map<std::string, IndexEntry> load_index_cache (const std::string& cache_file)
+        {
+          std::map<std::string, IndexEntry> index;
+          if (cache_file.empty() || !Path::is_file (cache_file))
+            return index;
+          try {
+            std::ifstream in (cache_file, std::ios::in | std::ios::binary);
+            std::string magic (index_cache_magic.size(), '\0');
+            in.read (&magic[0], magic.size());
+            if (!in || magic != index_cache_magic)
+              throw Exception ("unrecognised file format");
+            uint64_t num_entries;
+            read_value (in, num_entries);
+            for (uint64_t n = 0; n < num_entries; ++n) {
+              IndexEntry entry;
+              read_entry (in, entry);
+              index[entry.filename] = std::move (entry);
+            }
+            DEBUG ("loaded " + str(index.size()) + " entries from DICOM index cache \"" + cache_file + "\"");
+          }
+          catch (Exception& E) {
+            INFO ("error reading DICOM index cache \"" + cache_file + "\" (" + E[0] + ") - ignored");
+            index.clear();
+          }
+          return index;
+        }
+
+
+
+        void save_index_cache (const std::string& cache_file, const vector<IndexEntry>& entries)
+        {
+          // write to a temporary file first, so that concurrent accesses to the
+          // same folder never see a partially written index:
+          const std::string tmp_file = cache_file + "." + str (getpid());
+          {
+            std::ofstream out (tmp_file, std::ios::out | std::ios::binary | std::ios::trunc);
+            if (!out) {
+              INFO ("unable to write DICOM index cache \"" + cache_file + "\": " + strerror (errno));
+              return;
+            }
+            out.write (index_cache_magic.data(), index_cache_magic.size());
+            write_value<uint64_t> (out, entries.size());
+            for (const auto& entry : entries)
+              write_entry (out, entry);
+            if (!out) {
+              INFO ("error writing DICOM index cache \"" + cache_file + "\"");
+              std::remove (tmp_file.c_str());
+              return;
+            }
+          }
+          if (std::rename (tmp_file.c_str(), cache_file.c_str())) {
+            INFO ("unable to write DICOM index cache \"" + cache_file + "\": " + strerror (errno));
+            std::remove (tmp_file.c_str());
+          }
+        }
+
+      }
+
+
+
+
+
+
+      void Tree::read_dir (const std::string& filename, vector<std::string>& files, ProgressBar& progress)
       {
         try {
           Path::Dir folder (filename);
@@ -62,15 +293,9 @@ namespace MR {
           while ((entry = folder.read_name()).size()) {
             std::string name (Path::join (filename, entry));
             if (Path::is_dir (name))
-              read_dir (name, progress);
-            else {
-              try {
-                read_file (name);
-              }
-              catch (Exception& E) {
-                E.display (3);
-              }
-            }
+              read_dir (name, files, progress);
+            else
+              files.push_back (name);
             ++progress;
           }
         }
@@ -85,24 +310,24 @@ namespace MR {
 
       void Tree::read_file (const std::string& filename)
       {
-        QuickScan reader;
-        if (reader.read (filename)) {
-          INFO ("error reading file \"" + filename + "\" - ignored");
-          return;
-        }
+        IndexEntry entry (filename);
+        entry.scan();
+        if (entry.has_image)
+          add (entry.reader);
+      }
+
+
 
-        if (! (reader.dim[0] && reader.dim[1] && reader.bits_alloc && reader.data)) {
-          INFO ("DICOM file \"" + filename + "\" does not seem to contain image data - ignored");
-          return;
-        }
 
+      void Tree::add (const QuickScan& reader)
+      {
         std::shared_ptr<Patient> patient = find (reader.patient, reader.patient_ID, reader.patient_DOB);
         std::shared_ptr<Study> study = patient->find (reader.study, reader.study_ID, reader.study_date, reader.study_time);
         for (const auto& image_type : reader.image_type) {
           std::shared_ptr<Series> series = study->find (reader.series, reader.series_number, image_type.first, reader.modality, reader.series_date, reader.series_time);
 
           std::shared_ptr<Image> image (new Image);
-          image->filename = filename;
+          image->filename = reader.filename;
           image->series = series.get();
           image->sequence_name = reader.sequence;
           image->image_type = image_type.first;
@@ -117,9 +342,59 @@ namespace MR {
 
       void Tree::read (const std::string& filename)
       {
-        ProgressBar progress ("scanning DICOM folder \"" + shorten (filename) + "\"", 0);
-        if (Path::is_dir (filename))
-          read_dir (filename, progress);
+        if (Path::is_dir (filename)) {
+          vector<std::string> files;
+          {
+            ProgressBar progress ("scanning DICOM folder \"" + shorten (filename) + "\"", 0);
+            read_dir (filename, files, progress);
+          }
+
+          // reuse any entries from the index cache whose size and
+          // modification time are unchanged:
+          const std::string cache_file = index_cache_file (filename);
+          auto index = load_index_cache (cache_file);
+          vector<IndexEntry> entries;
+          entries.reserve (files.size());
+          vector<IndexEntry*> to_scan;
+          for (const auto& name : files) {
+            IndexEntry entry (name);
+            entry.stat();
+            auto cached = index.find (name);
+            if (cached != index.end() && cached->second.size == entry.size && cached->second.mtime == entry.mtime)
+              entry = std::move (cached->second);
+            else
+              entry.scanned = true;
+            entries.push_back (std::move (entry));
+          }
+          for (auto& entry : entries)
+            if (entry.scanned)
+              to_scan.push_back (&entry);
+          if (cache_file.size())
+            INFO ("DICOM index cache: " + str(entries.size() - to_scan.size()) + " of " + str(entries.size()) + " files found unchanged");
+
+          // parse the headers of all remaining files in parallel:
+          if (to_scan.size()) {
+            ProgressBar progress ("reading DICOM headers", to_scan.size());
+            size_t next = 0;
+            Thread::run_queue (
+                [&] (IndexEntry*& item) { if (next >= to_scan.size()) return false; item = to_scan[next++]; return true; },
+                Thread::batch (static_cast<IndexEntry*> (nullptr), 16),
+                Thread::multi ([] (IndexEntry*& item_in, IndexEntry*& item_out) { item_in->scan(); item_out = item_in; return true; }),
+                static_cast<IndexEntry*> (nullptr),
+                [&] (IndexEntry*&) { ++progress; return true; });
+
+            if (cache_file.size())
+              save_index_cache (cache_file, entries);
+          }
+          else if (cache_file.size() && index.size() != entries.size())
+            save_index_cache (cache_file, entries);
+
+          // add to the tree in the order the files were found, so that the
+          // resulting list of series is the same as for a serial scan:
+          for (const auto& entry : entries)
+            if (entry.has_image)
+              add (entry.reader);
+        }
         else {
           try {
             read_file (filename);
@@ -26,6 +26,24 @@ namespace MR
   namespace Filter
   {
 
+    //! copy all volumes along axis 3 of the current voxel in a single call
+    /*! For use with interpolating adapters providing a row (axis, values)
+     * method, such as Adapter::Reslice and Adapter::Warp, so that the
+     * interpolation weights are computed once per voxel rather than once
+     * per volume. */
+    template <typename ValueType>
+      class CopyKernel4D { MEMALIGN(CopyKernel4D<ValueType>)
+        public:
+          template <class InputImageType, class OutputImageType>
+            FORCE_INLINE void operator() (InputImageType& in, OutputImageType& out) {
+              in.row (3, values);
+              out.row (3) = values;
+            }
+        private:
+          Eigen::Matrix<ValueType, Eigen::Dynamic, 1> values;
+      };
+
+
     //! convenience function to regrid one Image onto another
     /*! This function resamples (regrids) the Image \a source onto the
      * Image& \a destination, using the templated interpolator class.
@@ -53,7 +71,16 @@ namespace MR
           const typename ImageTypeDestination::value_type value_when_out_of_bounds = Interp::Base<ImageTypeDestination>::default_out_of_bounds_value())
       {
         Adapter::Reslice<Interpolator, ImageTypeSource> interp (source, destination, transform, oversampling, value_when_out_of_bounds);
-        threaded_copy_with_progress_message ("reslicing \"" + source.name() + "\"", interp, destination, 0, source.ndim(), 2);
+        if (source.ndim() == 4) {
+          ThreadedLoop ("reslicing \"" + source.name() + "\"", interp, 0, 3, 2)
+            .with_work_stealing()
+            .run (CopyKernel4D<typename ImageTypeSource::value_type>(), interp, destination);
+        }
+        else {
+          ThreadedLoop ("reslicing \"" + source.name() + "\"", interp, 0, source.ndim(), 2)
+            .with_work_stealing()
+            .run (__copy_func(), interp, destination);
+        }
       }
 
 
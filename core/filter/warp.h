@@ -31,17 +31,6 @@ namespace MR
   {
 
 
-  // TODO if there is a use for this elsewhere then we should have threaded_copy4D convenience functions
-  class CopyKernel4D { NOMEMALIGN
-    public:
-      template <class InputImageType, class OutputImageType>
-        FORCE_INLINE void operator() (InputImageType& in, OutputImageType& out) const {
-          out.row(3) = in.row(3);
-        }
-  };
-
-
-
     //! convenience function to warp one image onto another
     /*! This function resamples (regrids) the Image \a source onto the
      * Image& \a destination, using the templated interpolator class and a supplied deformation field.
@@ -86,7 +75,7 @@ namespace MR
            Adapter::Warp<Interpolator, ImageTypeSource, Image<typename WarpType::value_type> > interp (source, warp_resliced, value_when_out_of_bounds, jacobian_modulate);
 
            if (destination.ndim() == 4)
-             ThreadedLoop ("warping \"" + source.name() + "\"" + (jacobian_modulate? " with Jacobian intensity modulation" : ""), interp, 0, 3, 1).run (CopyKernel4D(), interp, destination);
+             ThreadedLoop ("warping \"" + source.name() + "\"" + (jacobian_modulate? " with Jacobian intensity modulation" : ""), interp, 0, 3, 1).run (CopyKernel4D<typename ImageTypeSource::value_type>(), interp, destination);
            else
              threaded_copy_with_progress_message ("warping \"" + source.name() + "\"" + (jacobian_modulate? " with Jacobian intensity modulation" : ""), interp, destination);
 
@@ -94,7 +83,7 @@ namespace MR
         } else {
            Adapter::Warp<Interpolator, ImageTypeSource, Image<typename WarpType::value_type> > interp (source, warp, value_when_out_of_bounds, jacobian_modulate);
            if (destination.ndim() == 4 && destination.is_direct_io())
-             ThreadedLoop ("warping \"" + source.name() + "\"" + (jacobian_modulate? " with Jacobian intensity modulation" : ""), interp, 0, 3, 1).run (CopyKernel4D(), interp, destination);
+             ThreadedLoop ("warping \"" + source.name() + "\"" + (jacobian_modulate? " with Jacobian intensity modulation" : ""), interp, 0, 3, 1).run (CopyKernel4D<typename ImageTypeSource::value_type>(), interp, destination);
            else
              threaded_copy_with_progress_message ("warping \"" + source.name() + "\"" + (jacobian_modulate? " with Jacobian intensity modulation" : ""), interp, destination, 0, destination.ndim(), 2);
         }
@@ -115,6 +115,34 @@ namespace MR
     }
 
 
+    bool next_keyvalue (std::istream& in, std::string& key, std::string& value)
+    {
+      key.clear(); value.clear();
+      std::string line;
+      if (!getline (in, line))
+        return false;
+      line = strip (line.substr (0, line.find_first_of ('#')));
+      if (line == "END")
+        return false;
+
+      if (line.size()) {
+        size_t colon = line.find_first_of (':');
+        if (colon == std::string::npos) {
+          INFO ("malformed key/value entry (\"" + line + "\") in image header stream - ignored");
+        } else {
+          key   = strip (line.substr (0, colon));
+          value = strip (line.substr (colon+1));
+          if (key.empty() || value.empty()) {
+            INFO ("malformed key/value entry (\"" + line + "\") in image header stream - ignored");
+            key.clear();
+            value.clear();
+          }
+        }
+      }
+      return true;
+    }
+
+
 
 
 
@@ -39,9 +39,11 @@ namespace MR
       void read_mrtrix_header (Header&, SourceType&);
 
     // These are helper functiosn for reading key/value pairs from either a File::KeyValue construct,
-    //   or from a GZipped file (where the getline() function must be used explicitly)
+    //   from a GZipped file (where the getline() function must be used explicitly), or from a
+    //   generic input stream (as used for images streamed through a pipe)
     bool next_keyvalue (File::KeyValue&, std::string&, std::string&);
     bool next_keyvalue (File::GZ&,       std::string&, std::string&);
+    bool next_keyvalue (std::istream&,   std::string&, std::string&);
 
     // Get the path to a file - use same function for image data and sparse data
     // Note that the 'file' and 'sparse_file' fields are read in as entries in the map<string, string>
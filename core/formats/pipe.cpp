@@ -14,23 +14,84 @@
  * For more details, see http://www.mrtrix.org/.
  */
 
+#include <unistd.h>
+
 #include "signal_handler.h"
+#include "file/config.h"
 #include "file/utils.h"
 #include "file/path.h"
 #include "header.h"
 #include "image_io/pipe.h"
 #include "formats/list.h"
+#include "formats/mrtrix_utils.h"
 
 namespace MR
 {
   namespace Formats
   {
 
+    namespace
+    {
+
+      //CONF option: PipeStreaming
+      //CONF default: 0 (false)
+      //CONF When piping images between MRtrix3 commands, stream the image
+      //CONF header and data through the pipe itself, rather than writing
+      //CONF them to a temporary file (see :option:`TmpFileDir`) and passing
+      //CONF its filename. No temporary file is then required, and the
+      //CONF downstream command can proceed as soon as the upstream command
+      //CONF has created its output image, only waiting for the image data
+      //CONF once it needs to access them. The downstream command detects
+      //CONF which mode is in use automatically, but versions of MRtrix3
+      //CONF predating this option cannot read streamed images.
+      bool stream_pipes ()
+      {
+        static const bool stream = File::Config::get_bool ("PipeStreaming", false) && !isatty (STDOUT_FILENO);
+        return stream;
+      }
+
+
+      // read the remainder of a streamed MRtrix image header from standard
+      // input, up to the start of the image data
+      std::unique_ptr<ImageIO::Base> read_stream (Header& H)
+      {
+        std::stringstream header;
+        size_t consumed = std::string ("mrtrix image\n").size();
+        std::string line;
+        while (getline (std::cin, line)) {
+          consumed += line.size() + 1;
+          header << line << "\n";
+          if (strip (line.substr (0, line.find_first_of ('#'))) == "END")
+            break;
+        }
+        if (!std::cin)
+          throw Exception ("unexpected end of piped image header on standard input (broken pipe?)");
+
+        read_mrtrix_header (H, header);
+
+        std::string fname;
+        size_t offset;
+        get_mrtrix_file_path (H, "file", fname, offset);
+        if (fname != H.name())
+          throw Exception ("image data must be embedded in piped image stream");
+        if (offset < consumed)
+          throw Exception ("invalid data offset in piped image stream");
+        std::cin.ignore (offset - consumed);
+
+        return std::unique_ptr<ImageIO::Base> (new ImageIO::PipeStream (H));
+      }
+
+    }
+
+
+
     std::unique_ptr<ImageIO::Base> Pipe::read (Header& H) const
     {
       if (H.name() == "-") {
         std::string name;
         getline (std::cin, name);
+        if (name == "mrtrix image")
+          return read_stream (H);
         H.name() = name;
       }
       else {
@@ -60,6 +121,14 @@ namespace MR
       if (H.name() != "-")
         return false;
 
+      if (stream_pipes()) {
+        H.ndim() = num_axes;
+        for (size_t i = 0; i < H.ndim(); i++)
+          if (H.size (i) < 1)
+            H.size(i) = 1;
+        return true;
+      }
+
       H.name() = File::create_tempfile (0, "mif");
 
       SignalHandler::mark_file_for_deletion (H.name());
@@ -72,6 +141,26 @@ namespace MR
 
     std::unique_ptr<ImageIO::Base> Pipe::create (Header& H) const
     {
+      if (H.name() == "-") {
+        // streamed image: send the header immediately, so that the
+        // downstream command can proceed while this one is running
+        std::stringstream header;
+        header << "mrtrix image\n";
+        write_mrtrix_header (H, header);
+
+        int64_t offset = header.tellp() + int64_t(24);
+        offset += ((4 - (offset % 4)) % 4);
+        header << "file: . " << offset << "\nEND\n";
+        while (header.tellp() < offset)
+          header << '\0';
+
+        std::cout.write (header.str().c_str(), offset);
+        std::cout.flush();
+        if (!std::cout.good())
+          throw Exception ("error writing header for piped image to standard output (broken pipe?)");
+        return std::unique_ptr<ImageIO::Base> (new ImageIO::PipeStream (H));
+      }
+
       std::unique_ptr<ImageIO::Base> original_handler (mrtrix_handler.create (H));
       std::unique_ptr<ImageIO::Pipe> io_handler (new ImageIO::Pipe (std::move (*original_handler)));
       return std::move (io_handler);
@@ -94,6 +94,28 @@ namespace MR
           else buffer->set_value (data_offset, val);
         }
 
+        //! get \a n voxel values along \a axis, starting at the current location
+        /*! This is equivalent to reading each value in turn while
+         * incrementing the index along \a axis, but for images using indirect
+         * IO, the data type conversion and intensity scaling are applied to
+         * the whole span at once. The current location is left unchanged. */
+        FORCE_INLINE void get_values (size_t axis, ValueType* values, ssize_t n) const {
+          if (data_pointer) {
+            for (ssize_t i = 0; i < n; ++i)
+              values[i] = Raw::fetch_native<ValueType> (data_pointer, data_offset + i*stride(axis));
+          }
+          else buffer->get_values (data_offset, stride(axis), values, n);
+        }
+        //! set \a n voxel values along \a axis, starting at the current location
+        /*! \sa get_values() */
+        FORCE_INLINE void set_values (size_t axis, const ValueType* values, ssize_t n) {
+          if (data_pointer) {
+            for (ssize_t i = 0; i < n; ++i)
+              Raw::store_native<ValueType> (values[i], data_pointer, data_offset + i*stride(axis));
+          }
+          else buffer->set_values (data_offset, stride(axis), values, n);
+        }
+
         //! use for debugging
         friend std::ostream& operator<< (std::ostream& stream, const Image& V) {
           stream << "\"" << V.name() << "\", datatype " << DataType::from<Image::value_type>().specifier() << ", index [ ";
@@ -226,7 +248,8 @@ namespace MR
         Buffer& operator= (const Buffer&) = delete;
         Buffer& operator= (Buffer&&) = default;
         Buffer (const Buffer& b) :
-          Header (b), fetch_func (b.fetch_func), store_func (b.store_func) { }
+          Header (b), fetch_func (b.fetch_func), store_func (b.store_func),
+          fetch_span_func (b.fetch_span_func), store_span_func (b.store_span_func) { }
 
 
         FORCE_INLINE ValueType get_value (size_t offset) const {
@@ -239,6 +262,28 @@ namespace MR
           store_func (val, io->segment (nseg), offset - nseg*io->segment_size(), intensity_offset(), intensity_scale());
         }
 
+        // the span versions can only be used if the whole span lies within
+        // the same segment (i.e. file), otherwise revert to per-voxel access:
+        FORCE_INLINE void get_values (size_t offset, ssize_t stride, ValueType* values, ssize_t n) const {
+          if (n <= 0) return;
+          const size_t nseg = offset / io->segment_size();
+          if ((offset + (n-1)*stride) / io->segment_size() == nseg)
+            fetch_span_func (values, n, io->segment (nseg), offset - nseg*io->segment_size(), stride, intensity_offset(), intensity_scale());
+          else
+            for (ssize_t i = 0; i < n; ++i)
+              values[i] = get_value (offset + i*stride);
+        }
+
+        FORCE_INLINE void set_values (size_t offset, ssize_t stride, const ValueType* values, ssize_t n) const {
+          if (n <= 0) return;
+          const size_t nseg = offset / io->segment_size();
+          if ((offset + (n-1)*stride) / io->segment_size() == nseg)
+            store_span_func (values, n, io->segment (nseg), offset - nseg*io->segment_size(), stride, intensity_offset(), intensity_scale());
+          else
+            for (ssize_t i = 0; i < n; ++i)
+              set_value (offset + i*stride, values[i]);
+        }
+
         std::unique_ptr<uint8_t[]> data_buffer;
         void* get_data_pointer ();
 
@@ -247,9 +292,12 @@ namespace MR
       protected:
         std::function<ValueType(const void*,size_t,default_type,default_type)> fetch_func;
         std::function<void(ValueType,void*,size_t,default_type,default_type)> store_func;
+        __fetch_span_func_type<ValueType> fetch_span_func;
+        __store_span_func_type<ValueType> store_span_func;
 
         void set_fetch_store_functions () {
           __set_fetch_store_functions (fetch_func, store_func, datatype());
+          __set_fetch_store_span_functions (fetch_span_func, store_span_func, datatype());
         }
     };
 
@@ -299,6 +347,14 @@ namespace MR
 
       FORCE_INLINE value_type get_value () const { return Raw::fetch_native<ValueType> (data, offset); }
         FORCE_INLINE void set_value (ValueType val) { Raw::store_native<ValueType> (val, data, offset); }
+        FORCE_INLINE void get_values (size_t axis, ValueType* values, ssize_t n) const {
+          for (ssize_t i = 0; i < n; ++i)
+            values[i] = Raw::fetch_native<ValueType> (data, offset + i*stride(axis));
+        }
+        FORCE_INLINE void set_values (size_t axis, const ValueType* values, ssize_t n) {
+          for (ssize_t i = 0; i < n; ++i)
+            Raw::store_native<ValueType> (values[i], data, offset + i*stride(axis));
+        }
       };
 
     CHECK_MEM_ALIGN (TmpImage<float>);
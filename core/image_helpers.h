@@ -503,12 +503,60 @@ namespace MR
     };
 
 
+    // invoke func (n, value) for each voxel along axis, or assign func (n)
+    // to each voxel along axis. For images using indirect IO that support
+    // it, the whole row is read / written in a single call, so that the data
+    // type conversion and scaling is applied to the whole span at once.
+    template <class ImageType, class Functor>
+      FORCE_INLINE void __for_each_in_row (ImageType& image, size_t axis, Functor&& func, long) {
+        for (image.index(axis) = 0; image.index(axis) < image.size(axis); ++image.index(axis))
+          func (image.index(axis), typename ImageType::value_type (image.value()));
+      }
+
+    template <class ImageType, class Functor>
+      FORCE_INLINE auto __for_each_in_row (ImageType& image, size_t axis, Functor&& func, int)
+      -> decltype (image.get_values (axis, nullptr, 0), image.is_direct_io(), void())
+      {
+        if (image.is_direct_io())
+          return __for_each_in_row (image, axis, func, 0L);
+        Eigen::Array<typename ImageType::value_type, Eigen::Dynamic, 1> values (image.size (axis));
+        image.index(axis) = 0;
+        image.get_values (axis, values.data(), values.size());
+        for (ssize_t n = 0; n < values.size(); ++n)
+          func (n, values[n]);
+        image.index(axis) = image.size(axis);
+      }
+
+    template <class ImageType, class Functor>
+      FORCE_INLINE void __assign_row (ImageType& image, size_t axis, Functor&& func, long) {
+        for (image.index(axis) = 0; image.index(axis) < image.size(axis); ++image.index(axis))
+          image.value() = func (image.index(axis));
+      }
+
+    template <class ImageType, class Functor>
+      FORCE_INLINE auto __assign_row (ImageType& image, size_t axis, Functor&& func, int)
+      -> decltype (image.set_values (axis, nullptr, 0), image.is_direct_io(), void())
+      {
+        if (image.is_direct_io())
+          return __assign_row (image, axis, func, 0L);
+        Eigen::Array<typename ImageType::value_type, Eigen::Dynamic, 1> values (image.size (axis));
+        for (ssize_t n = 0; n < values.size(); ++n)
+          values[n] = func (n);
+        image.index(axis) = 0;
+        image.set_values (axis, values.data(), values.size());
+        image.index(axis) = image.size(axis);
+      }
+
+
     template <class ImageType>
       class ConstRow { NOMEMALIGN
         public:
           ConstRow (ImageType& image, size_t axis) : axis (axis), image (image) { assert (axis >= 0 && axis < image.ndim()); }
           ssize_t size () const { return image.size (axis); }
           typename ImageType::value_type operator[] (ssize_t n) const { image.index (axis) = n; return image.value(); }
+          //! invoke func (n, value) with the value at each position n along the row
+          template <class Functor>
+            FORCE_INLINE void for_each (Functor&& func) const { __for_each_in_row (image, axis, func, 0); }
           const size_t axis;
         protected:
           ImageType& image;
@@ -540,6 +588,13 @@ namespace MR
         using ConstRow<ImageType>::image;
         using ConstRow<ImageType>::axis;
 
+        template <class Derived>
+          FORCE_INLINE void operator= (const Eigen::MatrixBase<Derived>& vec) {
+            assert (vec.rows() == image.size(axis));
+            assert (vec.cols() == 1);
+            __assign_row (image, axis, [&vec] (ssize_t n) { return value_type (vec[n]); }, 0);
+          }
+
 #define MRTRIX_OP(ARG) \
         template <class Derived> \
           FORCE_INLINE void operator ARG (const Eigen::MatrixBase<Derived>& vec) { \
@@ -548,7 +603,6 @@ namespace MR
             for (image.index(axis) = 0; image.index(axis) < image.size(axis); ++image.index(axis))  \
               image.value() ARG vec[image.index(axis)]; \
           }
-        MRTRIX_OP(=);
         MRTRIX_OP(+=);
         MRTRIX_OP(-=);
 #undef MRTRIX_OP
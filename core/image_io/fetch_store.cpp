@@ -40,10 +40,14 @@ namespace MR
       }
 
     // floating-point -> integer
+    // (narrow types go via a 64-bit integer, so that out-of-range values
+    // wrap around consistently rather than invoking undefined behaviour,
+    // which would otherwise differ between the per-voxel and span versions)
     template <typename TypeOUT, typename TypeIN>
       inline typename std::enable_if<std::is_integral<TypeOUT>::value, TypeOUT>::type 
       round_func (TypeIN in, typename std::enable_if<std::is_floating_point<TypeIN>::value>::type* = nullptr) {
-        return std::isfinite (in) ? std::round (in) : TypeOUT (0);
+        using IntermediateType = typename std::conditional<(sizeof(TypeOUT) < sizeof(int64_t)), int64_t, TypeOUT>::type;
+        return std::isfinite (in) ? TypeOUT (IntermediateType (std::round (in))) : TypeOUT (0);
       }
 
     // complex -> complex
@@ -135,6 +139,35 @@ namespace MR
       }
 
 
+    // span versions, inlining the per-value functions above into a single
+    // loop (the contiguous case is handled separately to allow the compiler
+    // to vectorise the conversion where possible):
+
+    template <typename RAMType, RAMType (*fetch) (const void*, size_t, default_type, default_type)>
+      void __fetch_span (RAMType* values, size_t n, const void* data, size_t i, ssize_t stride, default_type offset, default_type scale) {
+        if (stride == 1) {
+          for (size_t k = 0; k < n; ++k)
+            values[k] = fetch (data, i+k, offset, scale);
+        }
+        else {
+          for (size_t k = 0; k < n; ++k, i += stride)
+            values[k] = fetch (data, i, offset, scale);
+        }
+      }
+
+    template <typename RAMType, void (*store) (RAMType, void*, size_t, default_type, default_type)>
+      void __store_span (const RAMType* values, size_t n, void* data, size_t i, ssize_t stride, default_type offset, default_type scale) {
+        if (stride == 1) {
+          for (size_t k = 0; k < n; ++k)
+            store (values[k], data, i+k, offset, scale);
+        }
+        else {
+          for (size_t k = 0; k < n; ++k, i += stride)
+            store (values[k], data, i, offset, scale);
+        }
+      }
+
+
   }
 
 
@@ -245,6 +278,110 @@ namespace MR
       }
     }
 
+  template <typename ValueType>
+    typename std::enable_if<is_data_type<ValueType>::value, void>::type __set_fetch_store_span_functions (
+        __fetch_span_func_type<ValueType>& fetch_span_func,
+        __store_span_func_type<ValueType>& store_span_func,
+        DataType datatype) {
+
+      switch (datatype()) {
+        case DataType::Bit:
+          fetch_span_func = __fetch_span<ValueType,__fetch<ValueType,bool>>;
+          store_span_func = __store_span<ValueType,__store<ValueType,bool>>;
+          return;
+        case DataType::Int8:
+          fetch_span_func = __fetch_span<ValueType,__fetch<ValueType,int8_t>>;
+          store_span_func = __store_span<ValueType,__store<ValueType,int8_t>>;
+          return;
+        case DataType::UInt8:
+          fetch_span_func = __fetch_span<ValueType,__fetch<ValueType,uint8_t>>;
+          store_span_func = __store_span<ValueType,__store<ValueType,uint8_t>>;
+          return;
+        case DataType::Int16LE:
+          fetch_span_func = __fetch_span<ValueType,__fetch_LE<ValueType,int16_t>>;
+          store_span_func = __store_span<ValueType,__store_LE<ValueType,int16_t>>;
+          return;
+        case DataType::UInt16LE:
+          fetch_span_func = __fetch_span<ValueType,__fetch_LE<ValueType,uint16_t>>;
+          store_span_func = __store_span<ValueType,__store_LE<ValueType,uint16_t>>;
+          return;
+        case DataType::Int16BE:
+          fetch_span_func = __fetch_span<ValueType,__fetch_BE<ValueType,int16_t>>;
+          store_span_func = __store_span<ValueType,__store_BE<ValueType,int16_t>>;
+          return;
+        case DataType::UInt16BE:
+          fetch_span_func = __fetch_span<ValueType,__fetch_BE<ValueType,uint16_t>>;
+          store_span_func = __store_span<ValueType,__store_BE<ValueType,uint16_t>>;
+          return;
+        case DataType::Int32LE:
+          fetch_span_func = __fetch_span<ValueType,__fetch_LE<ValueType,int32_t>>;
+          store_span_func = __store_span<ValueType,__store_LE<ValueType,int32_t>>;
+          return;
+        case DataType::UInt32LE:
+          fetch_span_func = __fetch_span<ValueType,__fetch_LE<ValueType,uint32_t>>;
+          store_span_func = __store_span<ValueType,__store_LE<ValueType,uint32_t>>;
+          return;
+        case DataType::Int32BE:
+          fetch_span_func = __fetch_span<ValueType,__fetch_BE<ValueType,int32_t>>;
+          store_span_func = __store_span<ValueType,__store_BE<ValueType,int32_t>>;
+          return;
+        case DataType::UInt32BE:
+          fetch_span_func = __fetch_span<ValueType,__fetch_BE<ValueType,uint32_t>>;
+          store_span_func = __store_span<ValueType,__store_BE<ValueType,uint32_t>>;
+          return;
+        case DataType::Int64LE:
+          fetch_span_func = __fetch_span<ValueType,__fetch_LE<ValueType,int64_t>>;
+          store_span_func = __store_span<ValueType,__store_LE<ValueType,int64_t>>;
+          return;
+        case DataType::UInt64LE:
+          fetch_span_func = __fetch_span<ValueType,__fetch_LE<ValueType,uint64_t>>;
+          store_span_func = __store_span<ValueType,__store_LE<ValueType,uint64_t>>;
+          return;
+        case DataType::Int64BE:
+          fetch_span_func = __fetch_span<ValueType,__fetch_BE<ValueType,int64_t>>;
+          store_span_func = __store_span<ValueType,__store_BE<ValueType,int64_t>>;
+          return;
+        case DataType::UInt64BE:
+          fetch_span_func = __fetch_span<ValueType,__fetch_BE<ValueType,uint64_t>>;
+          store_span_func = __store_span<ValueType,__store_BE<ValueType,uint64_t>>;
+          return;
+        case DataType::Float32LE:
+          fetch_span_func = __fetch_span<ValueType,__fetch_LE<ValueType,float>>;
+          store_span_func = __store_span<ValueType,__store_LE<ValueType,float>>;
+          return;
+        case DataType::Float32BE:
+          fetch_span_func = __fetch_span<ValueType,__fetch_BE<ValueType,float>>;
+          store_span_func = __store_span<ValueType,__store_BE<ValueType,float>>;
+          return;
+        case DataType::Float64LE:
+          fetch_span_func = __fetch_span<ValueType,__fetch_LE<ValueType,double>>;
+          store_span_func = __store_span<ValueType,__store_LE<ValueType,double>>;
+          return;
+        case DataType::Float64BE:
+          fetch_span_func = __fetch_span<ValueType,__fetch_BE<ValueType,double>>;
+          store_span_func = __store_span<ValueType,__store_BE<ValueType,double>>;
+          return;
+        case DataType::CFloat32LE:
+          fetch_span_func = __fetch_span<ValueType,__fetch_LE<ValueType,cfloat>>;
+          store_span_func = __store_span<ValueType,__store_LE<ValueType,cfloat>>;
+          return;
+        case DataType::CFloat32BE:
+          fetch_span_func = __fetch_span<ValueType,__fetch_BE<ValueType,cfloat>>;
+          store_span_func = __store_span<ValueType,__store_BE<ValueType,cfloat>>;
+          return;
+        case DataType::CFloat64LE:
+          fetch_span_func = __fetch_span<ValueType,__fetch_LE<ValueType,cdouble>>;
+          store_span_func = __store_span<ValueType,__store_LE<ValueType,cdouble>>;
+          return;
+        case DataType::CFloat64BE:
+          fetch_span_func = __fetch_span<ValueType,__fetch_BE<ValueType,cdouble>>;
+          store_span_func = __store_span<ValueType,__store_BE<ValueType,cdouble>>;
+          return;
+        default:
+          throw Exception ("invalid data type in image header");
+      }
+    }
+
 #undef MRTRIX_EXTERN
 #define MRTRIX_EXTERN
   __DEFINE_FETCH_STORE_FUNCTIONS;
@@ -39,13 +39,38 @@ namespace MR
         DataType datatype);
 
 
+
+  // span versions of the fetch/store functions: these convert n values at
+  // a time, located at positions i, i+stride, i+2*stride, etc.
+  template <typename ValueType>
+    using __fetch_span_func_type = std::function<void(ValueType*,size_t,const void*,size_t,ssize_t,default_type,default_type)>;
+  template <typename ValueType>
+    using __store_span_func_type = std::function<void(const ValueType*,size_t,void*,size_t,ssize_t,default_type,default_type)>;
+
+  template <typename ValueType>
+    typename std::enable_if<!is_data_type<ValueType>::value, void>::type __set_fetch_store_span_functions (
+        __fetch_span_func_type<ValueType>& /*fetch_span_func*/,
+        __store_span_func_type<ValueType>& /*store_span_func*/,
+        DataType /*datatype*/) { }
+
+  template <typename ValueType>
+    typename std::enable_if<is_data_type<ValueType>::value, void>::type __set_fetch_store_span_functions (
+        __fetch_span_func_type<ValueType>& fetch_span_func,
+        __store_span_func_type<ValueType>& store_span_func,
+        DataType datatype);
+
+
   // define fetch/store methods for all types using C++11 extern templates, 
   // to avoid massive recompile times...
 #define __DEFINE_FETCH_STORE_FUNCTION_FOR_TYPE(ValueType) \
   MRTRIX_EXTERN template void __set_fetch_store_functions<ValueType> ( \
       std::function<ValueType(const void*,size_t,default_type,default_type)>& fetch_func, \
         std::function<void(ValueType,void*,size_t,default_type,default_type)>& store_func, \
-        DataType datatype) 
+        DataType datatype); \
+  MRTRIX_EXTERN template void __set_fetch_store_span_functions<ValueType> ( \
+        __fetch_span_func_type<ValueType>& fetch_span_func, \
+        __store_span_func_type<ValueType>& store_span_func, \
+        DataType datatype)
 
 #define __DEFINE_FETCH_STORE_FUNCTIONS \
   __DEFINE_FETCH_STORE_FUNCTION_FOR_TYPE(bool); \
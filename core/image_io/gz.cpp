@@ -14,21 +14,237 @@
  * For more details, see http://www.mrtrix.org/.
  */
 
+#include <atomic>
+#include <fstream>
 #include <limits>
+#include <zlib.h>
 
 #include "app.h"
 #include "progressbar.h"
 #include "header.h"
+#include "thread.h"
 #include "image_io/gz.h"
 #include "file/gz.h"
 
 #define BYTES_PER_ZCALL 524288
 
+// Block-compressed GZip (BGZF): a concatenation of independent gzip members,
+// each holding at most BGZF_BLOCK_SIZE bytes of uncompressed data, with the
+// compressed size of each member stored in a 'BC' extra field of its header.
+// Any gzip reader can read such a stream, but its members can also be located
+// without uncompressing the data, and (de)compressed in parallel.
+#define BGZF_BLOCK_SIZE 65280
+#define BGZF_MAX_MEMBER_SIZE 65536
+#define BGZF_HEADER_SIZE 18
+#define BGZF_FOOTER_SIZE 8
+#define BGZF_BLOCKS_PER_THREAD 64
+
 namespace MR
 {
   namespace ImageIO
   {
 
+    namespace
+    {
+
+      // empty member marking the end of a BGZF stream:
+      const uint8_t bgzf_eof[] = {
+        0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43,
+        0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+      };
+
+      inline uint32_t get_le16 (const uint8_t* p) { return p[0] | (uint32_t (p[1]) << 8); }
+      inline uint32_t get_le32 (const uint8_t* p) { return get_le16 (p) | (get_le16 (p+2) << 16); }
+      inline void put_le16 (uint8_t* p, uint32_t v) { p[0] = v & 0xff; p[1] = (v >> 8) & 0xff; }
+      inline void put_le32 (uint8_t* p, uint32_t v) { put_le16 (p, v & 0xffff); put_le16 (p+2, v >> 16); }
+
+      inline bool is_bgzf_header (const uint8_t* h)
+      {
+        return h[0] == 0x1f && h[1] == 0x8b && h[2] == 8 && h[3] == 4 &&
+          get_le16 (h+10) == 6 && h[12] == 'B' && h[13] == 'C' && get_le16 (h+14) == 2;
+      }
+
+
+
+      class BGZFMember { NOMEMALIGN
+        public:
+          int64_t offset, uoffset;
+          uint32_t size, usize;
+      };
+
+      // Locate all members of a BGZF file; returns an empty index if the
+      // file is not (entirely) in BGZF format
+      inline bool read_at (std::ifstream& in, uint8_t* dest, int64_t size, int64_t offset)
+      {
+        in.seekg (offset);
+        in.read (reinterpret_cast<char*> (dest), size);
+        return in.good();
+      }
+
+      vector<BGZFMember> bgzf_index (const std::string& filename)
+      {
+        std::ifstream in (filename, std::ios::in | std::ios::binary);
+        if (!in)
+          throw Exception ("error opening file \"" + filename + "\": " + strerror (errno));
+        vector<BGZFMember> index;
+        in.seekg (0, std::ios::end);
+        const int64_t file_size = in.tellg();
+        int64_t offset = 0, uoffset = 0;
+        uint8_t buf[BGZF_HEADER_SIZE];
+        while (offset < file_size) {
+          if (!read_at (in, buf, BGZF_HEADER_SIZE, offset) || !is_bgzf_header (buf))
+            return vector<BGZFMember>();
+          const uint32_t size = get_le16 (buf+16) + 1;
+          if (size < BGZF_HEADER_SIZE + BGZF_FOOTER_SIZE || offset + size > file_size)
+            return vector<BGZFMember>();
+          if (!read_at (in, buf, 4, offset + size - 4))
+            throw Exception ("error reading GZ file \"" + filename + "\": " + strerror (errno));
+          const uint32_t usize = get_le32 (buf);
+          if (usize > BGZF_MAX_MEMBER_SIZE)
+            return vector<BGZFMember>();
+          index.push_back ({ offset, uoffset, size, usize });
+          offset += size;
+          uoffset += usize;
+        }
+        return index;
+      }
+
+
+
+      // uncompress BGZF members into the range [start, start+size) of the
+      // uncompressed stream, held at dest
+      class BGZFReader { NOMEMALIGN
+        public:
+          BGZFReader (const std::string& filename, const vector<BGZFMember>& index,
+              int64_t start, int64_t size, uint8_t* dest, std::atomic<size_t>& next, size_t last) :
+            filename (filename), index (index), start (start), size (size), dest (dest), next (next), last (last) { }
+
+          void execute ()
+          {
+            // each thread reads through its own stream:
+            std::ifstream file (filename, std::ios::in | std::ios::binary);
+            if (!file)
+              throw Exception ("error opening file \"" + filename + "\": " + strerror (errno));
+            vector<uint8_t> in (BGZF_MAX_MEMBER_SIZE), out (BGZF_MAX_MEMBER_SIZE);
+            z_stream zs;
+            zs.zalloc = Z_NULL;
+            zs.zfree = Z_NULL;
+            zs.opaque = Z_NULL;
+            if (inflateInit2 (&zs, -15) != Z_OK)
+              throw Exception ("error initialising zlib for GZ file \"" + filename + "\"");
+
+            size_t n;
+            while ((n = next++) < last) {
+              const BGZFMember& member (index[n]);
+              if (!read_at (file, in.data(), member.size, member.offset)) {
+                inflateEnd (&zs);
+                throw Exception ("error reading GZ file \"" + filename + "\": " + strerror (errno));
+              }
+              // uncompress directly into the destination if the member lies entirely within it:
+              const bool direct = member.uoffset >= start && member.uoffset + member.usize <= start + size;
+              uint8_t* target = direct ? dest + (member.uoffset - start) : out.data();
+              inflateReset (&zs);
+              zs.next_in = in.data() + BGZF_HEADER_SIZE;
+              zs.avail_in = member.size - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE;
+              zs.next_out = target;
+              zs.avail_out = member.usize;
+              const int status = inflate (&zs, Z_FINISH);
+              if ((status != Z_STREAM_END && (status != Z_BUF_ERROR || member.usize)) || zs.avail_out ||
+                  crc32 (crc32 (0, Z_NULL, 0), target, member.usize) != get_le32 (in.data() + member.size - BGZF_FOOTER_SIZE)) {
+                inflateEnd (&zs);
+                throw Exception ("error uncompressing GZ file \"" + filename + "\": corrupted data");
+              }
+              if (!direct) {
+                const int64_t from = std::max (start, member.uoffset);
+                const int64_t to = std::min (start + size, member.uoffset + member.usize);
+                memcpy (dest + (from - start), target + (from - member.uoffset), to - from);
+              }
+            }
+            inflateEnd (&zs);
+          }
+
+        private:
+          const std::string& filename;
+          const vector<BGZFMember>& index;
+          const int64_t start, size;
+          uint8_t* const dest;
+          std::atomic<size_t>& next;
+          const size_t last;
+      };
+
+
+
+      // compress blocks of the uncompressed stream formed by concatenating
+      // the segments provided into BGZF members
+      class BGZFWriter { NOMEMALIGN
+        public:
+          using Segment = std::pair<const uint8_t*, int64_t>;
+
+          BGZFWriter (const vector<Segment>& segments, int64_t total, vector<vector<uint8_t>>& members,
+              size_t first, std::atomic<size_t>& next) :
+            segments (segments), total (total), members (members), first (first), next (next) { }
+
+          void execute ()
+          {
+            vector<uint8_t> in (BGZF_BLOCK_SIZE);
+            z_stream zs;
+            zs.zalloc = Z_NULL;
+            zs.zfree = Z_NULL;
+            zs.opaque = Z_NULL;
+            if (deflateInit2 (&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+              throw Exception ("error initialising zlib compression");
+
+            size_t n;
+            while ((n = next++) < first + members.size()) {
+              // gather the uncompressed data for this block:
+              const int64_t block_start = int64_t(n) * BGZF_BLOCK_SIZE;
+              const int64_t block_size = std::min (int64_t (BGZF_BLOCK_SIZE), total - block_start);
+              int64_t seg_start = 0, filled = 0;
+              for (const auto& segment : segments) {
+                const int64_t from = std::max (block_start + filled, seg_start);
+                const int64_t to = std::min (block_start + block_size, seg_start + segment.second);
+                if (to > from) {
+                  memcpy (in.data() + filled, segment.first + (from - seg_start), to - from);
+                  filled += to - from;
+                }
+                seg_start += segment.second;
+              }
+              assert (filled == block_size);
+
+              vector<uint8_t>& member (members[n - first]);
+              member.resize (BGZF_MAX_MEMBER_SIZE);
+              deflateReset (&zs);
+              zs.next_in = in.data();
+              zs.avail_in = block_size;
+              zs.next_out = member.data() + BGZF_HEADER_SIZE;
+              zs.avail_out = BGZF_MAX_MEMBER_SIZE - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE;
+              if (deflate (&zs, Z_FINISH) != Z_STREAM_END) {
+                deflateEnd (&zs);
+                throw Exception ("error compressing data: block too large for BGZF member");
+              }
+              const uint32_t size = BGZF_MAX_MEMBER_SIZE - zs.avail_out;
+              memcpy (member.data(), bgzf_eof, BGZF_HEADER_SIZE);
+              put_le16 (member.data() + 16, size - 1);
+              put_le32 (member.data() + size - BGZF_FOOTER_SIZE, crc32 (crc32 (0, Z_NULL, 0), in.data(), block_size));
+              put_le32 (member.data() + size - 4, block_size);
+              member.resize (size);
+            }
+            deflateEnd (&zs);
+          }
+
+        private:
+          const vector<Segment>& segments;
+          const int64_t total;
+          vector<vector<uint8_t>>& members;
+          const size_t first;
+          std::atomic<size_t>& next;
+      };
+
+    }
+
+
+
+
     void GZ::load (const Header& header, size_t)
     {
       if (files.empty())
@@ -51,9 +267,36 @@ namespace MR
         ProgressBar progress ("uncompressing image \"" + header.name() + "\"",
             files.size() * bytes_per_segment / BYTES_PER_ZCALL);
         for (size_t n = 0; n < files.size(); n++) {
+          uint8_t* address = addresses[0].get() + n*bytes_per_segment;
+
+          const auto index = bgzf_index (files[n].name);
+          if (index.size()) {
+            // block-compressed: uncompress all members overlapping the image data in parallel,
+            // in batches so that progress can be reported
+            const int64_t start = files[n].start;
+            size_t first = 0, last = index.size();
+            while (first < last && index[first].uoffset + index[first].usize <= start)
+              ++first;
+            while (last > first && index[last-1].uoffset >= start + bytes_per_segment)
+              --last;
+            if (last == first || index[first].uoffset > start || index[last-1].uoffset + index[last-1].usize < start + bytes_per_segment)
+              throw Exception ("unexpected end of file while uncompressing \"" + files[n].name + "\"");
+            const size_t batch_size = BGZF_BLOCKS_PER_THREAD * std::max<size_t> (1, Thread::threads_to_execute());
+            int64_t done = 0;
+            for (size_t batch = first; batch < last; batch += batch_size) {
+              const size_t batch_end = std::min (last, batch + batch_size);
+              std::atomic<size_t> next (batch);
+              BGZFReader reader (files[n].name, index, start, bytes_per_segment, address, next, batch_end);
+              Thread::run (Thread::multi (reader), "BGZF uncompression threads").wait();
+              const int64_t uncompressed = std::min (int64_t (bytes_per_segment), index[batch_end-1].uoffset + index[batch_end-1].usize - start);
+              for (; done + BYTES_PER_ZCALL <= uncompressed; done += BYTES_PER_ZCALL)
+                ++progress;
+            }
+            continue;
+          }
+
           File::GZ zf (files[n].name, "rb");
           zf.seek (files[n].start);
-          uint8_t* address = addresses[0].get() + n*bytes_per_segment;
           uint8_t* last = address + bytes_per_segment - BYTES_PER_ZCALL;
           while (address < last) {
             zf.read (reinterpret_cast<char*> (address), BYTES_PER_ZCALL);
@@ -81,24 +324,35 @@ namespace MR
         assert (addresses[0]);
 
         if (writable) {
+          // files are written in BGZF format, with members compressed in parallel
+          const size_t batch_size = BGZF_BLOCKS_PER_THREAD * std::max<size_t> (1, Thread::threads_to_execute());
+          const int64_t total = lead_in_size + bytes_per_segment + lead_out_size;
+          const size_t num_blocks = (total + BGZF_BLOCK_SIZE - 1) / BGZF_BLOCK_SIZE;
           ProgressBar progress ("compressing image \"" + header.name() + "\"",
-              files.size() * bytes_per_segment / BYTES_PER_ZCALL);
+              files.size() * ((num_blocks + batch_size - 1) / batch_size));
           for (size_t n = 0; n < files.size(); n++) {
             assert (files[n].start == int64_t (lead_in_size));
-            File::GZ zf (files[n].name, "wb");
-            if (lead_in)
-              zf.write (reinterpret_cast<const char*> (lead_in.get()), lead_in_size);
-            uint8_t* address = addresses[0].get() + n*bytes_per_segment;
-            uint8_t* last = address + bytes_per_segment - BYTES_PER_ZCALL;
-            while (address < last) {
-              zf.write (reinterpret_cast<const char*> (address), BYTES_PER_ZCALL);
-              address += BYTES_PER_ZCALL;
+            std::ofstream out (files[n].name, std::ios::out | std::ios::binary | std::ios::trunc);
+            if (!out)
+              throw Exception ("error opening GZ file \"" + files[n].name + "\" for writing: " + strerror (errno));
+
+            const vector<BGZFWriter::Segment> segments = {
+              { lead_in.get(), int64_t (lead_in_size) },
+              { addresses[0].get() + n*bytes_per_segment, bytes_per_segment },
+              { lead_out.get(), int64_t (lead_out_size) } };
+            vector<vector<uint8_t>> members;
+            for (size_t first = 0; first < num_blocks; first += batch_size) {
+              members.resize (std::min (batch_size, num_blocks - first));
+              std::atomic<size_t> next (first);
+              BGZFWriter writer (segments, total, members, first, next);
+              Thread::run (Thread::multi (writer), "BGZF compression threads").wait();
+              for (const auto& member : members)
+                out.write (reinterpret_cast<const char*> (member.data()), member.size());
               ++progress;
             }
-            last += BYTES_PER_ZCALL;
-            zf.write (reinterpret_cast<const char*> (address), last - address);
-            if (lead_out)
-              zf.write (reinterpret_cast<const char*> (lead_out.get()), lead_out_size);
+            out.write (reinterpret_cast<const char*> (bgzf_eof), sizeof (bgzf_eof));
+            if (!out.good())
+              throw Exception ("error writing to GZ file \"" + files[n].name + "\": " + strerror (errno));
           }
         }
 
@@ -110,5 +364,3 @@ namespace MR
 
   }
 }
-
-
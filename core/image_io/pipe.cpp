@@ -14,6 +14,8 @@
  * For more details, see http://www.mrtrix.org/.
  */
 
+#include <cstring>
+#include <iostream>
 #include <limits>
 #include <unistd.h>
 
@@ -61,6 +63,44 @@ namespace MR
 
     }
 
+
+
+
+    void PipeStream::load (const Header& header, size_t)
+    {
+      bytes_per_segment = (header.datatype().bits() * segsize + 7) / 8;
+      if (double (bytes_per_segment) >= double (std::numeric_limits<size_t>::max()))
+        throw Exception ("image \"" + header.name() + "\" is larger than maximum accessible memory");
+
+      addresses.resize (1);
+      addresses[0].reset (new uint8_t [bytes_per_segment]);
+      if (!addresses[0])
+        throw Exception ("failed to allocate memory for image \"" + header.name() + "\"");
+
+      if (is_new)
+        memset (addresses[0].get(), 0, bytes_per_segment);
+      else {
+        DEBUG ("reading piped image data from standard input...");
+        std::cin.read (reinterpret_cast<char*> (addresses[0].get()), bytes_per_segment);
+        if (std::cin.gcount() != bytes_per_segment)
+          throw Exception ("unexpected end of data for piped image on standard input (broken pipe?)");
+      }
+
+      segsize = std::numeric_limits<size_t>::max();
+    }
+
+
+    void PipeStream::unload (const Header& header)
+    {
+      if (addresses.size() && writable) {
+        DEBUG ("writing piped image data to standard output...");
+        std::cout.write (reinterpret_cast<const char*> (addresses[0].get()), bytes_per_segment);
+        std::cout.flush();
+        if (!std::cout.good())
+          throw Exception ("error writing data for piped image \"" + header.name() + "\" to standard output (broken pipe?)");
+      }
+    }
+
   }
 }
 
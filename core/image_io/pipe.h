@@ -38,6 +38,25 @@ namespace MR
         virtual void unload (const Header&);
     };
 
+
+
+    //! image data streamed directly through standard input / output
+    /*! The image header is exchanged by Formats::Pipe when the image is
+     * opened or created; this class handles the data that follow it, which
+     * are held in RAM and read in full from standard input on load(), or
+     * written in full to standard output on unload(). */
+    class PipeStream : public Base
+    { NOMEMALIGN
+      public:
+        PipeStream (const Header& header) : Base (header), bytes_per_segment (0) { }
+
+      protected:
+        int64_t bytes_per_segment;
+
+        virtual void load (const Header&, size_t);
+        virtual void unload (const Header&);
+    };
+
   }
 }
 
@@ -218,6 +218,32 @@ namespace MR
 
 
 
+    namespace {
+      template <class InterpType, class VectorType>
+        inline auto __row (InterpType& interp, size_t axis, VectorType& values, int)
+        -> decltype (interp.row (axis, values), interp.is_direct_io(), void())
+        {
+          interp.row (axis, values);
+        }
+
+      template <class InterpType, class VectorType>
+        inline void __row (InterpType& interp, size_t axis, VectorType& values, long)
+        {
+          values = interp.row (axis);
+        }
+    }
+
+    //! read the interpolated values along \a axis (>= 3) into \a values
+    /*! This uses the interpolator's in-place row (axis, values) method where
+     * available, and row (axis) otherwise. */
+    template <class InterpType, class VectorType>
+      inline void row (InterpType& interp, size_t axis, VectorType& values)
+      {
+        __row (interp, axis, values, 0);
+      }
+
+
+
     //! @}
 
   }
@@ -208,6 +208,39 @@ namespace MR
           return coeff_matrix * weights_vec;
         }
 
+        //! Read interpolated values from volumes along axis >= 3 into \a values
+        /*! This is equivalent to row(axis). However if the image data are
+         * held in RAM with \a axis contiguous (e.g. following
+         * Image::with_direct_io (axis)), the rows of the 64 neighbouring
+         * voxels are accessed in-place and combined as a single weighted sum,
+         * rather than being fetched one element at a time. Results may
+         * differ from those of row(axis) by floating-point rounding. */
+        template <class VectorType>
+        void row (size_t axis, VectorType& values) {
+          if (Base<ImageType>::out_of_bounds || !ImageType::is_direct_io() || ImageType::stride (axis) != 1) {
+            values = row (axis);
+            return;
+          }
+
+          ssize_t c[] = { ssize_t (std::floor (P[0])-1), ssize_t (std::floor (P[1])-1), ssize_t (std::floor (P[2])-1) };
+
+          const ssize_t current_index = ImageType::index (axis);
+          ImageType::index (axis) = 0;
+          values.setZero (ImageType::size (axis));
+          size_t i(0);
+          for (ssize_t z = 0; z < 4; ++z) {
+            ImageType::index(2) = clamp (c[2] + z, ImageType::size (2));
+            for (ssize_t y = 0; y < 4; ++y) {
+              ImageType::index(1) = clamp (c[1] + y, ImageType::size (1));
+              for (ssize_t x = 0; x < 4; ++x) {
+                ImageType::index(0) = clamp (c[0] + x, ImageType::size (0));
+                values += weights_vec[i++] * Eigen::Map<const Eigen::Matrix<value_type, Eigen::Dynamic, 1>> (ImageType::address(), ImageType::size (axis));
+              }
+            }
+          }
+          ImageType::index (axis) = current_index;
+        }
+
       protected:
         Eigen::Matrix<value_type, 64, 1> weights_vec;
     };
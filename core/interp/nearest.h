@@ -125,6 +125,22 @@ namespace MR
           return ImageType::row(axis);
         }
 
+        //! Read interpolated values from volumes along axis >= 3 into \a values
+        /*! Equivalent to row(axis); provided for interface compatibility
+         * with Interp::Linear. If the image data are held in RAM with \a
+         * axis contiguous, the row is copied directly from memory. */
+        template <class VectorType>
+        void row (size_t axis, VectorType& values) {
+          if (out_of_bounds || !ImageType::is_direct_io() || ImageType::stride (axis) != 1) {
+            values = row (axis);
+            return;
+          }
+          const ssize_t current_index = ImageType::index (axis);
+          ImageType::index (axis) = 0;
+          values = Eigen::Map<const Eigen::Matrix<value_type, Eigen::Dynamic, 1>> (ImageType::address(), ImageType::size (axis));
+          ImageType::index (axis) = current_index;
+        }
+
     };
 
 
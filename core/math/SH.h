@@ -268,6 +268,84 @@ namespace MR
 
 
 
+      //! compute SH deltas with the Legendre recursion coefficients precomputed
+      /*! This is equivalent to delta(), but all factors of the associated
+       * Legendre recursion that do not depend on the direction are computed
+       * once for the given \a lmax, such that each evaluation requires only
+       * a single square root; this is useful where deltas must be computed
+       * along a large number of arbitrary directions. */
+      template <typename ValueType> class PrecomputedDelta
+      { NOMEMALIGN
+        public:
+          using value_type = ValueType;
+
+          PrecomputedDelta (int lmax) :
+              lmax (lmax),
+              Pmm (lmax+1),
+              F ((lmax+1)*(lmax+1), 0.0),
+              invF ((lmax+1)*(lmax+1), 0.0)
+          {
+            value_type prod (1.0);
+            for (int m = 0; m <= lmax; ++m) {
+              if (m)
+                prod *= value_type (2*m-1) / value_type (2*m);
+              Pmm[m] = 0.282094791773878 * std::sqrt (value_type (2*m+1) * prod);
+              if (m & 1)
+                Pmm[m] = -Pmm[m];
+              for (int n = m+1; n <= lmax; ++n) {
+                value_type& f (F[m*(lmax+1) + n]);
+                f = (n == m+1) ?
+                    std::sqrt (value_type (2*m+3)) :
+                    std::sqrt (value_type (4*pow2 (n)-1) / value_type (pow2 (n)-pow2 (m)));
+                invF[m*(lmax+1) + n] = 1.0 / f;
+              }
+            }
+          }
+
+          template <class VectorType, class UnitVectorType>
+            VectorType& operator() (VectorType& delta_vec, const UnitVectorType& unit_dir) const
+            {
+              delta_vec.resize (NforL (lmax));
+              const value_type x = unit_dir[2];
+              const value_type sin_el = std::sqrt (std::max (value_type (1.0) - pow2 (x), value_type (0.0)));
+              value_type rxy = std::sqrt ( pow2(unit_dir[1]) + pow2(unit_dir[0]) );
+              value_type cp = (rxy) ? unit_dir[0]/rxy : 1.0;
+              value_type sp = (rxy) ? unit_dir[1]/rxy : 0.0;
+              Eigen::Matrix<value_type,Eigen::Dynamic,1,0,64> AL (lmax+1);
+              value_type c0 (1.0), s0 (0.0), sin_el_m (1.0);
+              for (int m = 0; m <= lmax; m++) {
+                const value_type* f = &F[m*(lmax+1)];
+                const value_type* invf = &invF[m*(lmax+1)];
+                AL[m] = Pmm[m] * sin_el_m;
+                if (m < lmax)
+                  AL[m+1] = x * f[m+1] * AL[m];
+                for (int n = m+2; n <= lmax; n++)
+                  AL[n] = (x*AL[n-1] - AL[n-2]*invf[n-1]) * f[n];
+                if (m) {
+                  value_type c = c0 * cp - s0 * sp;
+                  value_type s = s0 * cp + c0 * sp;
+                  for (int l = ( (m&1) ? m+1 : m); l <= lmax; l+=2) {
+                    delta_vec[index (l,m)]  = AL[l] * Math::sqrt2 * c;
+                    delta_vec[index (l,-m)] = AL[l] * Math::sqrt2 * s;
+                  }
+                  c0 = c;
+                  s0 = s;
+                } else {
+                  for (int l = 0; l <= lmax; l+=2)
+                    delta_vec[index (l,0)] = AL[l];
+                }
+                sin_el_m *= sin_el;
+              }
+              return delta_vec;
+            }
+
+        protected:
+          const int lmax;
+          vector<value_type> Pmm, F, invF;
+      };
+
+
+
       template <class VectorType1, class VectorType2>
         inline VectorType1& SH2RH (VectorType1& RH, const VectorType2& sh)
         {
@@ -441,6 +519,30 @@ namespace MR
               return v;
             }
 
+          //! compute the SH basis along \a unit_dir, such that delta_vec.dot (val) == value (val, unit_dir)
+          template <class VectorType, class UnitVectorType>
+            void delta (VectorType&& delta_vec, const UnitVectorType& unit_dir) const {
+              PrecomputedFraction<ValueType> f;
+              set (f, std::acos (unit_dir[2]));
+              ValueType rxy = std::sqrt ( pow2(unit_dir[1]) + pow2(unit_dir[0]) );
+              ValueType cp = (rxy) ? unit_dir[0]/rxy : 1.0;
+              ValueType sp = (rxy) ? unit_dir[1]/rxy : 0.0;
+              for (int l = 0; l <= lmax; l+=2)
+                delta_vec[index (l,0)] = get (f,l,0);
+              ValueType c0 (1.0), s0 (0.0);
+              for (int m = 1; m <= lmax; m++) {
+                ValueType c = c0 * cp - s0 * sp;
+                ValueType s = s0 * cp + c0 * sp;
+                for (int l = ( (m&1) ? m+1 : m); l <= lmax; l+=2) {
+                  const ValueType al = get (f,l,m);
+                  delta_vec[index (l,m)]  = al * c;
+                  delta_vec[index (l,-m)] = al * s;
+                }
+                c0 = c;
+                s0 = s;
+              }
+            }
+
         protected:
           int lmax, ndir, nAL;
           ValueType inc;
@@ -450,6 +552,74 @@ namespace MR
 
 
 
+      //! Evaluate SH series at a block of directions
+      /*! The SH->amplitudes matrix for a block of (unit vector) directions is
+       * held in a buffer that is retained between calls; the amplitudes of
+       * an SH series along all directions are then computed as a single
+       * matrix-vector product, or along any one direction as a dot
+       * product. Rows can be set individually via set_direction(), such that
+       * callers that may terminate early need only form the rows they use.
+       *
+       * If a PrecomputedAL object is provided, it is used to form the
+       * matrix; this must remain valid for the lifetime of this object. */
+      template <typename ValueType>
+      class BlockValue { MEMALIGN(BlockValue<ValueType>)
+        public:
+          using value_type = ValueType;
+          using matrix_type = Eigen::Matrix<ValueType,Eigen::Dynamic,Eigen::Dynamic,Eigen::RowMajor>;
+
+          BlockValue (int lmax, const PrecomputedAL<ValueType>* precomputer = nullptr) :
+              lmax (lmax),
+              precomputer (precomputer && *precomputer ? precomputer : nullptr) { }
+
+          void resize (size_t num_directions) {
+            SHT.resize (num_directions, NforL (lmax));
+          }
+
+          template <class UnitVectorType>
+            void set_direction (size_t row, const UnitVectorType& unit_dir) {
+              assert (row < size_t(SHT.rows()));
+              if (precomputer) {
+                precomputer->delta (SHT.row (row), unit_dir);
+              } else {
+                delta (buffer, unit_dir, lmax);
+                SHT.row (row) = buffer.transpose();
+              }
+            }
+
+          //! set the block of directions; \a dirs can be any container of unit vectors
+          template <class DirectionSetType>
+            void set_directions (const DirectionSetType& dirs) {
+              resize (dirs.size());
+              for (size_t n = 0; n != size_t(dirs.size()); ++n)
+                set_direction (n, dirs[n]);
+            }
+
+          //! compute the amplitudes of \a coefs along all directions
+          template <class VectorType1, class VectorType2>
+            void operator() (VectorType1& amplitudes, const VectorType2& coefs) const {
+              amplitudes.noalias() = SHT * coefs;
+            }
+
+          //! compute the amplitude of \a coefs along the direction in \a row
+          template <class VectorType>
+            ValueType value (size_t row, const VectorType& coefs) const {
+              return SHT.row (row).dot (coefs);
+            }
+
+          size_t size () const { return SHT.rows(); }
+          const matrix_type& matrix () const { return SHT; }
+
+        protected:
+          const int lmax;
+          const PrecomputedAL<ValueType>* precomputer;
+          matrix_type SHT;
+          Eigen::Matrix<ValueType,Eigen::Dynamic,1> buffer;
+      };
+
+
+
+
 
 
       //! estimate direction & amplitude of SH peak
@@ -17,10 +17,12 @@
 #ifndef __math_constrained_least_squares_h__
 #define __math_constrained_least_squares_h__
 
+#include <algorithm>
 #include <set>
 #include "math/math.h"
 
 #include <Eigen/Cholesky>
+#include <Eigen/Jacobi>
 
 
 //#define DEBUG_ICLS
@@ -127,13 +129,20 @@ namespace MR
                 B.noalias() = chol_HtH.template triangularView<Eigen::Lower>().transpose().template solve<Eigen::OnTheRight> (constraint_matrix);
                 for (ssize_t n = 0; n < B.rows(); ++n)
                   B.row(n).normalize();
+
+                // form the Gram matrix of the constraints, from which the
+                // matrix for any active subset can be extracted by the
+                // solver without recomputing the products (lower triangular
+                // part only):
+                BBt.setZero (B.rows(), B.rows());
+                BBt.template selfadjointView<Eigen::Lower>().rankUpdate (B);
               }
 
             size_t num_parameters () const { return H.cols(); }
             size_t num_measurements () const { return H.rows(); }
             size_t num_constraints () const { return B.rows(); }
 
-            matrix_type H, chol_HtH, B, b2d;
+            matrix_type H, chol_HtH, B, b2d, BBt;
             value_type lambda_min_norm, tol;
             size_t max_niter;
         };
@@ -151,104 +160,138 @@ namespace MR
 
             Solver (const Problem<value_type>& problem) :
               P (problem),
-              BtB (P.chol_HtH.rows(), P.chol_HtH.cols()),
-              B (P.B.rows(), P.B.cols()),
-              y_u (BtB.rows()),
+              L (matrix_type::Zero (P.B.rows(), P.B.rows())),
+              y_u (P.chol_HtH.rows()),
               c (P.B.rows()),
               c_u (P.B.rows()),
               lambda (c.size()),
               lambda_prev (c.size()),
               l (lambda.size()),
-              active (lambda.size(), false) { }
+              active (lambda.size(), false),
+              index (lambda.size()),
+              num_active (0) { }
 
+            //! solve for \e x given \e b, starting from an empty active set
             size_t operator() (vector_type& x, const vector_type& b)
             {
-#ifdef MRTRIX_ICLS_DEBUG
-              std::ofstream l_stream ("l.txt");
-              std::ofstream n_stream ("n.txt");
-#endif
+              std::fill (active.begin(), active.end(), false);
+              return solve (x, b);
+            }
+
+            //! solve for \e x given \e b, starting from the active set provided
+            /*! If the solution is expected to be similar to that of a previous
+             * problem (e.g. a neighbouring voxel), supplying the active set
+             * obtained for that problem (as returned by active_set()) will
+             * typically reduce the number of iterations required. The
+             * solution itself is not affected. */
+            size_t operator() (vector_type& x, const vector_type& b, const vector<bool>& initial_active_set)
+            {
+              assert (initial_active_set.size() == active.size());
+              active = initial_active_set;
+              return solve (x, b);
+            }
+
+            //! solve for each column of \e x given the corresponding column of \e b
+            /*! The unconstrained solutions and the corresponding constraint
+             * values are computed for all columns at once using matrix-matrix
+             * products, as is the final projection back onto the
+             * unconditioned domain. The active set iterations are then
+             * performed for each column in turn. If \a warm_start is set,
+             * each column is initialised from the active set of the previous
+             * column (or from the active set of the previous invocation of
+             * the solver for the first column); otherwise each column starts
+             * from an empty active set, such that the result for each column
+             * is independent of any previous problem. The number of
+             * iterations for each column is returned in \a niter. */
+            void operator() (matrix_type& x, const matrix_type& b, vector<size_t>& niter, const bool warm_start = false)
+            {
+              Y_u.noalias() = P.b2d.transpose() * b;
+              C_u.noalias() = P.B * Y_u;
+              x.resize (Y_u.rows(), Y_u.cols());
+              niter.resize (b.cols());
+              for (ssize_t n = 0; n < b.cols(); ++n) {
+                y_u = Y_u.col (n);
+                c_u = C_u.col (n);
+                if (!warm_start)
+                  std::fill (active.begin(), active.end(), false);
+                niter[n] = iterate (x_col);
+                x.col (n) = x_col;
+              }
+              P.chol_HtH.template triangularView<Eigen::Lower>().transpose().solveInPlace (x);
+            }
+
+            //! the active set of constraints at the last solution
+            const vector<bool>& active_set () const { return active; }
+
+            const Problem<value_type>& problem () const { return P; }
+
+          protected:
+            const Problem<value_type>& P;
+            matrix_type L, Y_u, C_u;
+            vector_type y_u, c, c_u, lambda, lambda_prev, l, x_col;
+            vector<bool> active;
+            vector<size_t> index;
+            size_t num_active;
+
+
+            size_t solve (vector_type& x, const vector_type& b)
+            {
               // compute unconstrained solution:
               y_u = P.b2d.transpose() * b;
               // compute constraint violations for unconstrained solution:
               c_u = P.B * y_u;
 
+              const size_t niter = iterate (x);
+
+              // project back to unconditioned domain:
+              P.chol_HtH.template triangularView<Eigen::Lower>().transpose().solveInPlace (x);
+              return niter;
+            }
+
+
+            // run the active set iterations given y_u & c_u, starting from
+            // the current contents of the active set:
+            size_t iterate (vector_type& x)
+            {
+#ifdef MRTRIX_ICLS_DEBUG
+              std::ofstream l_stream ("l.txt");
+              std::ofstream n_stream ("n.txt");
+#endif
               // set all Lagrangian multipliers to zero:
               lambda.setZero();
               lambda_prev.setZero();
-              // set active set empty:
-              std::fill (active.begin(), active.end(), false);
 
               // initial estimate of constraint values:
               c = c_u;
               // initial estimate of solution:
               x = y_u;
 
+              // if initialised with a non-empty active set, obtain the
+              // corresponding feasible solution as the starting point:
+              num_active = 0;
+              for (size_t n = 0; n < active.size(); ++n)
+                if (active[n])
+                  index[num_active++] = n;
+              if (num_active) {
+                factorise();
+                update_active_set (x);
+                lambda_prev = lambda;
+                c = P.B * x;
+              }
+
               size_t min_c_index;
               size_t niter = 0;
 
               while (c.minCoeff (&min_c_index) < -P.tol) {
                 bool active_set_changed = !active[min_c_index];
-                active[min_c_index] = true;
-
-                while (1) {
-                  // form submatrix of active constraints:
-                  size_t num_active = 0;
-                  for (size_t n = 0; n < active.size(); ++n) {
-                    if (active[n]) {
-                      B.row (num_active) = P.B.row (n);
-                      l[num_active] = -c_u[n];
-                      ++num_active;
-                    }
-                  }
-                  auto B_active = B.topRows (num_active);
-                  auto l_active = l.head (num_active);
-
-                  BtB.resize (num_active, num_active);
-                  // solve for l in B*B'l = -c_u by Cholesky decomposition:
-                  BtB = B_active * B_active.transpose();
-                  BtB.diagonal().array() += P.lambda_min_norm;
-                  BtB.template selfadjointView<Eigen::Lower>().llt().solveInPlace (l_active);
-
-                  // update lambda values in full vector
-                  // and identify worst offender if any lambda < 0
-                  // by projection from previous onto feasible
-                  // subset (i.e. l>=0):
-                  value_type s_min = std::numeric_limits<value_type>::infinity();
-                  size_t s_min_index = 0;
-                  size_t a = 0;
-                  for (size_t n = 0; n < active.size(); ++n) {
-                    if (active[n]) {
-                      if (l_active[a] < 0.0) {
-                        value_type s = lambda_prev[n] / (lambda_prev[n] - l_active[a]);
-                        if (s < s_min) {
-                          s_min = s;
-                          s_min_index = n;
-                        }
-                      }
-                      lambda[n] = l_active[a];
-                      ++a;
-                    }
-                    else
-                      lambda[n] = 0.0;
-                  }
-
-                  // if no lambda < 0, proceed:
-                  if (!std::isfinite (s_min)) {
-                    // update solution vector:
-                    x = y_u + B_active.transpose() * l_active;
-                    break;
-                  }
-#ifdef MRTRIX_ICLS_DEBUG
-                l_stream << lambda << "\n";
-#endif
-
-                  // remove worst offending lambda from active set,
-                  // and re-estimate remaining lambdas:
-                  if (active[s_min_index])
-                    active_set_changed = true;
-                  active[s_min_index] = false;
+                if (active_set_changed) {
+                  active[min_c_index] = true;
+                  add_constraint (min_c_index);
                 }
 
+                if (update_active_set (x))
+                  active_set_changed = true;
+
                 // store feasible subset of lambdas:
                 lambda_prev = lambda;
 
@@ -268,18 +311,124 @@ namespace MR
                 c = P.B * x;
               }
 
-              // project back to unconditioned domain:
-              P.chol_HtH.template triangularView<Eigen::Lower>().transpose().solveInPlace (x);
               return niter;
             }
 
-            const Problem<value_type>& problem () const { return P; }
 
-          protected:
-            const Problem<value_type>& P;
-            matrix_type BtB, B;
-            vector_type y_u, c, c_u, lambda, lambda_prev, l;
-            vector<bool> active;
+            // estimate the Lagrangian multipliers for the current active set,
+            // removing constraints from the active set until all are
+            // non-negative, and update the solution accordingly. Returns
+            // true if any constraints were removed from the active set.
+            bool update_active_set (vector_type& x)
+            {
+              bool removed = false;
+              while (1) {
+                // solve for l in B*B'l = -c_u using the Cholesky
+                // decomposition of the active subset:
+                auto l_active = l.head (num_active);
+                for (size_t a = 0; a < num_active; ++a)
+                  l_active[a] = -c_u[index[a]];
+                auto L_active = L.topLeftCorner (num_active, num_active).template triangularView<Eigen::Lower>();
+                L_active.solveInPlace (l_active);
+                L_active.transpose().solveInPlace (l_active);
+
+                // update lambda values in full vector
+                // and identify worst offender if any lambda < 0
+                // by projection from previous onto feasible
+                // subset (i.e. l>=0):
+                value_type s_min = std::numeric_limits<value_type>::infinity();
+                size_t s_min_index = 0, s_min_pos = 0;
+                lambda.setZero();
+                for (size_t a = 0; a < num_active; ++a) {
+                  const size_t n = index[a];
+                  if (l_active[a] < 0.0) {
+                    value_type s = lambda_prev[n] / (lambda_prev[n] - l_active[a]);
+                    // on ties, select the lowest constraint index, as would
+                    // be the case for a scan through the full constraint set:
+                    if (s < s_min || (s == s_min && n < s_min_index)) {
+                      s_min = s;
+                      s_min_index = n;
+                      s_min_pos = a;
+                    }
+                  }
+                  lambda[n] = l_active[a];
+                }
+
+                // if no lambda < 0, proceed:
+                if (!std::isfinite (s_min)) {
+                  // update solution vector:
+                  x = y_u;
+                  for (size_t a = 0; a < num_active; ++a)
+                    x += l_active[a] * P.B.row (index[a]).transpose();
+                  return removed;
+                }
+
+                // remove worst offending lambda from active set,
+                // and re-estimate remaining lambdas:
+                active[s_min_index] = false;
+                remove_constraint (s_min_pos);
+                removed = true;
+              }
+            }
+
+
+            // compute Cholesky decomposition of B*B' for the active subset
+            // listed in index from scratch:
+            void factorise ()
+            {
+              for (size_t j = 0; j < num_active; ++j)
+                for (size_t i = j; i < num_active; ++i)
+                  L(i,j) = P.BBt (index[i], index[j]);
+              L.diagonal().head (num_active).array() += P.lambda_min_norm;
+              // decompose in place:
+              Eigen::Ref<matrix_type> L_active (L.topLeftCorner (num_active, num_active));
+              Eigen::LLT<Eigen::Ref<matrix_type>> llt (L_active);
+              if (llt.info() != Eigen::Success) {
+                // fall back to building up the decomposition one constraint
+                // at a time, which guards against round-off errors:
+                const size_t n = num_active;
+                num_active = 0;
+                for (size_t a = 0; a < n; ++a)
+                  add_constraint (index[a]);
+              }
+            }
+
+
+            // append a constraint to the active subset, updating its Cholesky
+            // decomposition by computing the additional row:
+            void add_constraint (size_t n)
+            {
+              const size_t k = num_active;
+              for (size_t a = 0; a < k; ++a)
+                L(k,a) = index[a] > n ? P.BBt (index[a], n) : P.BBt (n, index[a]);
+              auto row = L.row (k).head (k).transpose();
+              L.topLeftCorner (k, k).template triangularView<Eigen::Lower>().solveInPlace (row);
+              // the Schur complement cannot be less than the regularisation
+              // term in exact arithmetic; clamp to avoid round-off errors:
+              const value_type d = P.BBt (n,n) + P.lambda_min_norm - row.squaredNorm();
+              L(k,k) = std::sqrt (std::max (d, P.lambda_min_norm));
+              index[k] = n;
+              ++num_active;
+            }
+
+
+            // remove the constraint at position pos within the active subset,
+            // restoring the triangular form of the Cholesky factor with
+            // Givens rotations once the corresponding row has been deleted:
+            void remove_constraint (size_t pos)
+            {
+              const size_t k = num_active;
+              for (size_t r = pos; r+1 < k; ++r) {
+                L.row (r).head (k) = L.row (r+1).head (k);
+                index[r] = index[r+1];
+              }
+              for (size_t r = pos; r+1 < k; ++r) {
+                Eigen::JacobiRotation<value_type> G;
+                G.makeGivens (L(r,r), L(r,r+1));
+                L.block (r, 0, k-1-r, k).applyOnTheRight (r, r+1, G);
+              }
+              --num_active;
+            }
         };
 
 
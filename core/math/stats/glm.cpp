@@ -105,32 +105,55 @@ namespace MR
           scaled_contrasts (GLM::scale_contrasts (contrast, X, X.rows()-rank(X)).transpose())
       {
         pinvX = Math::pinv (X);
+        y_squared_norms = y.rowwise().squaredNorm().array();
       }
 
 
 
       void GLMTTest::operator() (const vector<size_t>& perm_labelling, vector_type& stats) const
       {
-        stats = vector_type::Zero (y.rows());
-        matrix_type tvalues, betas, residuals, SX, pinvSX;
-
-        SX.resize (X.rows(), X.cols());
-        pinvSX.resize (pinvX.rows(), pinvX.cols());
-        for (ssize_t i = 0; i < X.rows(); ++i) {
-          SX.row(i) = X.row (perm_labelling[i]);
-          pinvSX.col(i) = pinvX.col (perm_labelling[i]);
+        matrix_type stats_batch;
+        (*this) (vector<vector<size_t>> (1, perm_labelling), stats_batch);
+        stats = stats_batch.col (0);
+      }
+
+
+
+      void GLMTTest::operator() (const vector<vector<size_t>>& perm_labellings, matrix_type& stats) const
+      {
+        const ssize_t num_perms = perm_labellings.size();
+        const ssize_t num_factors = X.cols();
+        stats.resize (y.rows(), num_perms);
+
+        // For each permutation, stack the transposed pseudo-inverse of the shuffled
+        //   design matrix (yielding the betas) alongside the shuffled design matrix
+        //   itself (yielding X^T y), such that a single product with the measurements
+        //   provides everything required for all permutations
+        matrix_type stacked_designs (X.rows(), 2 * num_factors * num_perms);
+        for (ssize_t p = 0; p < num_perms; ++p) {
+          const vector<size_t>& perm_labelling (perm_labellings[p]);
+          for (ssize_t i = 0; i < X.rows(); ++i) {
+            stacked_designs.block (i, 2*num_factors*p, 1, num_factors) = pinvX.col (perm_labelling[i]).transpose();
+            stacked_designs.block (i, 2*num_factors*p + num_factors, 1, num_factors) = X.row (perm_labelling[i]);
+          }
         }
 
-        pinvSX.transposeInPlace();
-        SX.transposeInPlace();
+        matrix_type products;
         for (ssize_t i = 0; i < y.rows(); i += GLM_BATCH_SIZE) {
-          const matrix_type tmp = y.block (i, 0, std::min (GLM_BATCH_SIZE, (int)(y.rows()-i)), y.cols());
-          GLM::ttest (tvalues, SX, pinvSX, tmp, scaled_contrasts, betas, residuals);
-          for (ssize_t n = 0; n < tvalues.rows(); ++n) {
-            value_type val = tvalues(n,0);
-            if (!std::isfinite (val))
-              val = value_type(0);
-            stats[i+n] = val;
+          const ssize_t num_rows = std::min (GLM_BATCH_SIZE, (int)(y.rows()-i));
+          products.noalias() = y.middleRows (i, num_rows) * stacked_designs;
+          for (ssize_t p = 0; p < num_perms; ++p) {
+            const auto betas = products.middleCols (2*num_factors*p, num_factors);
+            const auto XtY = products.middleCols (2*num_factors*p + num_factors, num_factors);
+            for (ssize_t n = 0; n < num_rows; ++n) {
+              // The residual sum of squares is y^T y - y^T H y, where H = X pinv(X)
+              //   is the hat matrix; y^T H y is the dot product of X^T y with the betas
+              const value_type residual_sq_norm = y_squared_norms[i+n] - betas.row (n).dot (XtY.row (n));
+              value_type val = betas.row (n).dot (scaled_contrasts.col (0)) / std::sqrt (residual_sq_norm);
+              if (!std::isfinite (val))
+                val = value_type(0);
+              stats (i+n, p) = val;
+            }
           }
         }
       }
@@ -119,12 +119,22 @@ namespace MR
           */
           void operator() (const vector<size_t>& perm_labelling, vector_type& stats) const;
 
+          /*! Compute the t-statistics for a batch of permutations at once
+          * @param perm_labellings a set of vectors, each shuffling the rows in the design matrix
+          * @param stats the matrix containing the output t-statistics, with one column per permutation
+          *
+          * The shuffled design matrices are stacked, such that the product of the measurements
+          * with the design for all permutations in the batch is computed as a single matrix product.
+          */
+          void operator() (const vector<vector<size_t>>& perm_labellings, matrix_type& stats) const;
+
           size_t num_subjects () const { return y.cols(); }
           size_t num_elements () const { return y.rows(); }
 
         protected:
           const matrix_type& y;
           matrix_type X, pinvX, scaled_contrasts;
+          vector_type y_squared_norms;
       };
       //! @}
 
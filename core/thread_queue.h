@@ -17,6 +17,7 @@
 #ifndef __mrtrix_thread_queue_h__
 #define __mrtrix_thread_queue_h__
 
+#include <atomic>
 #include <stack>
 #include <condition_variable>
 
@@ -26,6 +27,8 @@
 
 #define MRTRIX_QUEUE_DEFAULT_CAPACITY 128
 #define MRTRIX_QUEUE_DEFAULT_BATCH_SIZE 128
+#define MRTRIX_QUEUE_SPIN_COUNT 64
+#define MRTRIX_QUEUE_CACHE_LINE_SIZE 64
 
 namespace MR
 {
@@ -227,6 +230,11 @@ namespace MR
      * been processed, reducing overheads associated with memory
      * allocation/deallocation.
      *
+     * Items are passed between threads via a lock-free ring buffer, and
+     * recycled via a second such buffer. Threads that need to wait for data
+     * or space will briefly spin before blocking, so that the mutex is only
+     * involved when the queue is genuinely starved or saturated.
+     *
      * \note It is important that all instances of Thread::Queue::Writer and
      * Thread::Queue::Reader are created \e before any of the threads are
      * launched, to avoid any race conditions at startup.
@@ -358,32 +366,19 @@ namespace MR
          * MRTRIX_QUEUE_DEFAULT_CAPACITY items.
          */
         Queue (const std::string& description = "unnamed", size_t buffer_size = MRTRIX_QUEUE_DEFAULT_CAPACITY) :
-          buffer (new T* [buffer_size]),
-          front (buffer),
-          back (buffer),
-          capacity (buffer_size),
+          buffer (buffer_size),
+          spare_items (buffer_size),
           writer_count (0),
           reader_count (0),
+          sleeping_writers (0),
+          sleeping_readers (0),
           name (description) {
-          assert (capacity > 0);
+          assert (buffer_size > 0);
         }
 
         //! needed for Thread::run_queue()
         Queue (const T& /*item_type*/, const std::string& description = "unnamed", size_t buffer_size = MRTRIX_QUEUE_DEFAULT_CAPACITY) :
-          buffer (new T* [buffer_size]),
-          front (buffer),
-          back (buffer),
-          capacity (buffer_size),
-          writer_count (0),
-          reader_count (0),
-          name (description) {
-          assert (capacity > 0);
-        }
-
-
-        ~Queue () {
-          delete [] buffer;
-        }
+          Queue (description, buffer_size) { }
 
         //! This class is used to register a writer with the queue
         /*! Items cannot be written directly onto a Thread::Queue queue. An
@@ -518,21 +513,101 @@ namespace MR
 
         //! Print out a status report for debugging purposes
         void status () {
-          std::lock_guard<std::mutex> lock (mutex);
           std::cerr << "Thread::Queue \"" + name + "\": "
                     << writer_count << " writer" << (writer_count > 1 ? "s" : "") << ", "
-                    << reader_count << " reader" << (reader_count > 1 ? "s" : "") << ", items waiting: " << size() << "\n";
+                    << reader_count << " reader" << (reader_count > 1 ? "s" : "") << ", items waiting: " << buffer.size() << "\n";
         }
 
 
       private:
+
+        // A bounded multi-producer, multi-consumer ring buffer of item
+        // pointers. Each slot carries a sequence number indicating whether
+        // it is ready to be written to or read from for the current pass
+        // through the buffer, so that producers and consumers only ever
+        // contend on the atomic increment of their respective positions.
+        class Ring { NOMEMALIGN
+          public:
+            Ring (size_t size) :
+              slots (new Slot [size]),
+              capacity (size),
+              back (0),
+              front (0) {
+                for (size_t n = 0; n < capacity; ++n)
+                  slots[n].sequence.store (n, std::memory_order_relaxed);
+              }
+
+            // returns false if the buffer is full:
+            bool push (T* item) {
+              size_t pos = back.load (std::memory_order_relaxed);
+              while (true) {
+                Slot& slot (slots[pos % capacity]);
+                const ssize_t diff = ssize_t (slot.sequence.load (std::memory_order_acquire)) - ssize_t (pos);
+                if (diff == 0) {
+                  if (back.compare_exchange_weak (pos, pos+1, std::memory_order_relaxed)) {
+                    slot.item = item;
+                    slot.sequence.store (pos+1, std::memory_order_release);
+                    return true;
+                  }
+                }
+                else if (diff < 0)
+                  return false;
+                else
+                  pos = back.load (std::memory_order_relaxed);
+              }
+            }
+
+            // returns false if the buffer is empty:
+            bool pop (T*& item) {
+              size_t pos = front.load (std::memory_order_relaxed);
+              while (true) {
+                Slot& slot (slots[pos % capacity]);
+                const ssize_t diff = ssize_t (slot.sequence.load (std::memory_order_acquire)) - ssize_t (pos+1);
+                if (diff == 0) {
+                  if (front.compare_exchange_weak (pos, pos+1, std::memory_order_relaxed)) {
+                    item = slot.item;
+                    slot.sequence.store (pos+capacity, std::memory_order_release);
+                    return true;
+                  }
+                }
+                else if (diff < 0)
+                  return false;
+                else
+                  pos = front.load (std::memory_order_relaxed);
+              }
+            }
+
+            size_t size () const {
+              const size_t f = front.load (std::memory_order_relaxed);
+              const size_t b = back.load (std::memory_order_relaxed);
+              return b > f ? b - f : 0;
+            }
+
+          private:
+            class Slot { NOMEMALIGN
+              public:
+                std::atomic<size_t> sequence;
+                T* item;
+            };
+
+            std::unique_ptr<Slot[]> slots;
+            const size_t capacity;
+            // keep producer & consumer positions on separate cache lines:
+            char padding0[MRTRIX_QUEUE_CACHE_LINE_SIZE];
+            std::atomic<size_t> back;
+            char padding1[MRTRIX_QUEUE_CACHE_LINE_SIZE];
+            std::atomic<size_t> front;
+            char padding2[MRTRIX_QUEUE_CACHE_LINE_SIZE];
+        };
+
+
+        Ring buffer, spare_items;
+        std::atomic<size_t> writer_count, reader_count;
+        std::atomic<size_t> sleeping_writers, sleeping_readers;
+        // only used to park threads once spinning has failed, and to
+        // manage allocation of new items:
         std::mutex mutex;
         std::condition_variable more_data, more_space;
-        T** buffer;
-        T** front;
-        T** back;
-        size_t capacity;
-        size_t writer_count, reader_count;
         std::stack<T*,vector<T*> > item_stack;
         vector<std::unique_ptr<T>> items;
         std::string name;
@@ -541,55 +616,60 @@ namespace MR
         Queue& operator= (const Queue&) = delete;
 
         void register_writer ()   {
-          std::lock_guard<std::mutex> lock (mutex);
           ++writer_count;
         }
         void unregister_writer () {
-          std::lock_guard<std::mutex> lock (mutex);
           assert (writer_count);
-          --writer_count;
-          if (!writer_count) {
+          if (!--writer_count) {
             DEBUG ("no writers left on queue \"" + name + "\"");
+            std::lock_guard<std::mutex> lock (mutex);
             more_data.notify_all();
           }
         }
         void register_reader ()   {
-          std::lock_guard<std::mutex> lock (mutex);
           ++reader_count;
         }
         void unregister_reader () {
-          std::lock_guard<std::mutex> lock (mutex);
           assert (reader_count);
-          --reader_count;
-          if (!reader_count) {
+          if (!--reader_count) {
             DEBUG ("no readers left on queue \"" + name + "\"");
+            std::lock_guard<std::mutex> lock (mutex);
             more_space.notify_all();
           }
         }
 
-        FORCE_INLINE bool empty () const {
-          return (front == back);
-        }
-        FORCE_INLINE bool full () const {
-          return (inc (back) == front);
-        }
-        FORCE_INLINE size_t size () const {
-          return ( (back < front ? back+capacity : back) - front);
-        }
 
-        FORCE_INLINE T* get_item () {
-          std::lock_guard<std::mutex> lock (mutex);
-          T* item (new T);
-          items.push_back (std::unique_ptr<T> (item));
-          return item;
+        // spin for a while, then park the thread on the condition variable
+        // until the condition is met. The sleeping count is incremented
+        // before the final check of the condition, and the other side
+        // checks it after its own update of the buffer, so that wake-up
+        // notifications cannot be missed:
+        template <class Condition>
+          FORCE_INLINE void wait (std::condition_variable& cond, std::atomic<size_t>& sleeping, Condition&& ready) {
+            for (size_t n = 0; n < MRTRIX_QUEUE_SPIN_COUNT; ++n) {
+              if (ready())
+                return;
+              std::this_thread::yield();
+            }
+            std::unique_lock<std::mutex> lock (mutex);
+            ++sleeping;
+            std::atomic_thread_fence (std::memory_order_seq_cst);
+            cond.wait (lock, ready);
+            --sleeping;
+          }
+
+        FORCE_INLINE void wake (std::condition_variable& cond, std::atomic<size_t>& sleeping) {
+          std::atomic_thread_fence (std::memory_order_seq_cst);
+          if (sleeping.load (std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock (mutex);
+            cond.notify_one();
+          }
         }
 
-        FORCE_INLINE bool push (T*& item) {
-          std::unique_lock<std::mutex> lock (mutex);
-          more_space.wait (lock, [this]{ return !(full() && reader_count); });
-          if (!reader_count) return false;
-          *back = item;
-          back = inc (back);
+
+        FORCE_INLINE T* new_item () {
+          std::lock_guard<std::mutex> lock (mutex);
+          T* item;
           if (item_stack.empty()) {
             item = new T;
             items.push_back (std::unique_ptr<T> (item));
@@ -598,29 +678,57 @@ namespace MR
             item = item_stack.top();
             item_stack.pop();
           }
-          more_data.notify_one();
+          return item;
+        }
+
+        FORCE_INLINE T* get_item () {
+          T* item;
+          if (spare_items.pop (item))
+            return item;
+          return new_item();
+        }
+
+        FORCE_INLINE void recycle_item (T* item) {
+          if (spare_items.push (item))
+            return;
+          std::lock_guard<std::mutex> lock (mutex);
+          item_stack.push (item);
+        }
+
+
+        FORCE_INLINE bool push (T*& item) {
+          if (!reader_count)
+            return false;
+          if (!buffer.push (item)) {
+            bool pushed = false;
+            wait (more_space, sleeping_writers, [&]{ return !reader_count || (pushed = buffer.push (item)); });
+            if (!pushed)
+              return false;
+          }
+          wake (more_data, sleeping_readers);
+          item = get_item();
           return true;
         }
 
         FORCE_INLINE bool pop (T*& item) {
-          std::unique_lock<std::mutex> lock (mutex);
           if (item)
-            item_stack.push (item);
+            recycle_item (item);
           item = nullptr;
-          more_data.wait (lock, [this]{ return !(empty() && writer_count); });
-          if (empty() && !writer_count)
-            return false;
-          item = *front;
-          front = inc (front);
-          more_space.notify_one();
+          if (!buffer.pop (item)) {
+            bool popped = false;
+            // the writer count must be checked before attempting the pop,
+            // to ensure that all items pushed by the last writer are seen:
+            wait (more_data, sleeping_readers, [&]{
+                const bool no_writers = !writer_count;
+                return (popped = buffer.pop (item)) || no_writers; });
+            if (!popped) {
+              item = nullptr;
+              return false;
+            }
+          }
+          wake (more_space, sleeping_writers);
           return true;
         }
-
-        FORCE_INLINE T** inc (T** p) const {
-          ++p;
-          if (p >= buffer + capacity) p = buffer;
-          return p;
-        }
     };
 
 
@@ -0,0 +1,7 @@
+
+namespace MR {
+  namespace App {
+    const char* mrtrix_version = "3Tissue_v5.2.9";
+    const char* build_date = __DATE__;
+  }
+}
@@ -0,0 +1 @@
+__version__ = "3Tissue_v5.2.9"
@@ -17,9 +17,7 @@
 #include "connectome/enhance.h"
 #include "connectome/mat2vec.h"
 
-#include <set>
-
-#include "progressbar.h"
+#include "algo/union_find.h"
 
 
 namespace MR {
@@ -38,68 +36,42 @@ namespace MR {
 
       value_type NBS::operator() (const vector_type& in, const value_type T, vector_type& out) const
       {
+        assert (uint64_t(in.size()) == Mat2Vec (num_nodes).vec_size());
         out = vector_type::Zero (in.size());
-        value_type max_value = value_type(0);
-
-        for (ssize_t seed = 0; seed != in.size(); ++seed) {
-          if (std::isfinite (in[seed]) && in[seed] >= T && !out[seed]) {
-
-            BitSet visited (in.size());
-            visited[seed] = true;
-            vector<size_t> to_expand (1, seed);
-            size_t cluster_size = 0;
-
-            while (to_expand.size()) {
-
-              const uint32_t index = to_expand.back();
-              to_expand.pop_back();
-              cluster_size++;
-
-              for (vector<size_t>::const_iterator i = (*adjacency)[index].begin(); i != (*adjacency)[index].end(); ++i) {
-                if (!visited[*i] && std::isfinite(in[*i]) && in[*i] >= T) {
-                  visited[*i] = true;
-                  to_expand.push_back (*i);
-                }
-              }
-
-            }
-
-            max_value = std::max (max_value, value_type(cluster_size));
-            for (ssize_t i = 0; i != in.size(); ++i)
-              out[i] += (visited[i] ? 1.0 : 0.0) * cluster_size;
 
+        // Edge indices are traversed in the same order as defined by Mat2Vec
+        Algo::UnionFind<node_t> components (num_nodes);
+        ssize_t index = 0;
+        for (node_t row = 0; row != num_nodes; ++row) {
+          for (node_t column = row; column != num_nodes; ++column, ++index) {
+            if (std::isfinite (in[index]) && in[index] >= T)
+              components.unite (row, column);
           }
         }
 
-        return max_value;
-      }
-
-
+        // The size of each cluster is the number of suprathreshold edges
+        //   within the component, rather than the number of nodes
+        vector<size_t> cluster_sizes (num_nodes, 0);
+        index = 0;
+        for (node_t row = 0; row != num_nodes; ++row) {
+          for (node_t column = row; column != num_nodes; ++column, ++index) {
+            if (std::isfinite (in[index]) && in[index] >= T)
+              ++cluster_sizes[components.find (row)];
+          }
+        }
 
-      void NBS::initialise (const node_t num_nodes)
-      {
-        const Mat2Vec mat2vec (num_nodes);
-        const size_t num_edges = mat2vec.vec_size();
-        ProgressBar progress ("Pre-computing statistical correlation matrix...", num_edges);
-        adjacency.reset (new vector< vector<size_t> > (num_edges, vector<size_t>()));
+        value_type max_value = value_type(0);
+        index = 0;
         for (node_t row = 0; row != num_nodes; ++row) {
-          for (node_t column = row; column != num_nodes; ++column) {
-
-            const size_t index = mat2vec (row, column);
-            vector<size_t>& vector = (*adjacency)[index];
-            vector.reserve (2 * (num_nodes-1));
-            // Should be able to expand from this edge to any other edge connected to either row or column
-            for (node_t r = 0; r != num_nodes; ++r) {
-              if (r != row)
-                vector.push_back (mat2vec (r, column));
-            }
-            for (node_t c = 0; c != num_nodes; ++c) {
-              if (c != column)
-                vector.push_back (mat2vec (row, c));
+          for (node_t column = row; column != num_nodes; ++column, ++index) {
+            if (std::isfinite (in[index]) && in[index] >= T) {
+              out[index] = cluster_sizes[components.find (row)];
+              max_value = std::max (max_value, out[index]);
             }
-            ++progress;
           }
         }
+
+        return max_value;
       }
 
 
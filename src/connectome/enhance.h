@@ -20,7 +20,6 @@
 #include <memory>
 #include <stdint.h>
 
-#include "bitset.h"
 #include "types.h"
 
 #include "connectome/mat2vec.h"
@@ -54,13 +53,17 @@ namespace MR {
 
 
 
+      // Edge-to-edge adjacency is implicit: two edges are adjacent if they
+      //   share a node. Suprathreshold components are therefore found by
+      //   merging the nodes of suprathreshold edges, without storing any
+      //   data beyond the number of nodes.
       class NBS : public Stats::TFCE::EnhancerBase
       { MEMALIGN (NBS)
         public:
 
           NBS () = delete;
-          NBS (const node_t i) : threshold (0.0) { initialise (i); }
-          NBS (const node_t i, const value_type t) : threshold (t) { initialise (i); }
+          NBS (const node_t i) : num_nodes (i), threshold (0.0) { }
+          NBS (const node_t i, const value_type t) : num_nodes (i), threshold (t) { }
           NBS (const NBS& that) = default;
           virtual ~NBS() { }
 
@@ -73,12 +76,9 @@ namespace MR {
           value_type operator() (const vector_type&, const value_type, vector_type&) const override;
 
         protected:
-          std::shared_ptr< vector< vector<size_t> > > adjacency;
+          node_t num_nodes;
           value_type threshold;
 
-        private:
-          void initialise (const node_t);
-
       };
 
 
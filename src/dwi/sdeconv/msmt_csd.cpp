@@ -37,6 +37,13 @@ namespace MR
                 "non-negativity constraint (default = " + str(DEFAULT_MSMTCSD_NEG_LAMBDA, 2) + ").")
       + Argument ("value").type_float (0.0)
 
+      + Option ("warm_start",
+                "initialise the constrained solver in each voxel from the set of active "
+                "constraints found in the previous voxel. This typically reduces processing "
+                "time, but since voxels are distributed across threads in an order that "
+                "depends on scheduling, results may then differ between runs (at the level "
+                "of the solver tolerance).")
+
       + Option ("predicted_signal",
                 "output the predicted dwi image.")
       + Argument ("image").type_image_out();
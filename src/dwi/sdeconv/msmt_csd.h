@@ -47,11 +47,17 @@ namespace MR
           class Shared { MEMALIGN(Shared)
             public:
               Shared (const Header& dwi_header) :
-                  grad (DWI::get_valid_DW_scheme (dwi_header)),
+                  Shared (DWI::get_valid_DW_scheme (dwi_header)) { }
+
+              // for use when the DW scheme does not originate from an image
+              //   header, e.g. when the data to be deconvolved are generated in memory
+              Shared (const Eigen::MatrixXd& dw_scheme) :
+                  grad (dw_scheme),
                   shells (grad),
                   HR_dirs (DWI::Directions::electrostatic_repulsion_300()),
                   solution_min_norm_regularisation (DEFAULT_MSMTCSD_NORM_LAMBDA),
-                  constraint_min_norm_regularisation (DEFAULT_MSMTCSD_NEG_LAMBDA) { shells.select_shells(false,false,false); }
+                  constraint_min_norm_regularisation (DEFAULT_MSMTCSD_NEG_LAMBDA),
+                  warm_start (false) { shells.select_shells(false,false,false); }
 
 
               void parse_cmdline_options()
@@ -69,6 +75,7 @@ namespace MR
                 opt = get_options ("neg_lambda");
                 if (opt.size())
                   constraint_min_norm_regularisation = opt[0][0];
+                warm_start = get_options ("warm_start").size();
               }
 
 
@@ -227,6 +234,7 @@ namespace MR
               vector<Eigen::MatrixXd> responses;
               Math::ICLS::Problem<double> problem;
               double solution_min_norm_regularisation, constraint_min_norm_regularisation;
+              bool warm_start;
 
 
             private:
@@ -261,11 +269,23 @@ namespace MR
               shared (shared_data),
               solver (shared.problem) { }
 
+          // if warm_start is set, the solver is initialised from the active
+          // set of the previous invocation, which for neighbouring voxels is
+          // usually close to the final active set; otherwise each voxel is
+          // solved from an empty active set, such that results do not depend
+          // on the order in which voxels are processed:
           void operator() (const Eigen::VectorXd& data, Eigen::VectorXd& output) {
-            niter = solver (output, data);
+            niter = shared.warm_start ? solver (output, data, solver.active_set()) : solver (output, data);
+          }
+
+          // deconvolve a block of voxels at once, stored as the columns of
+          // data; the number of iterations for each is stored in niter_block
+          void operator() (const Eigen::MatrixXd& data, Eigen::MatrixXd& output) {
+            solver (output, data, niter_block, shared.warm_start);
           }
 
           size_t niter;
+          vector<size_t> niter_block;
           const Shared& shared;
 
         private:
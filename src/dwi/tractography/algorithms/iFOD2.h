@@ -163,8 +163,10 @@ namespace MR
               calib_positions (S.num_samples),
               tangents (S.num_samples),
               calib_tangents (S.num_samples),
-              sample_idx (S.num_samples)
+              sample_idx (S.num_samples),
+              path_amplitudes (S.lmax, &S.precomputer)
           {
+            path_amplitudes.resize (S.num_samples);
             calibrate (*this);
           }
 
@@ -182,8 +184,10 @@ namespace MR
               calib_positions (S.num_samples),
               tangents (S.num_samples),
               calib_tangents (S.num_samples),
-              sample_idx (S.num_samples)
+              sample_idx (S.num_samples),
+              path_amplitudes (S.lmax, &S.precomputer)
           {
+            path_amplitudes.resize (S.num_samples);
           }
 
 
@@ -353,6 +357,10 @@ end_init:
             //   in the arc - more dense structural image sampling
             size_t sample_idx;
 
+            // SH basis along the tangents of the current path; each sample
+            //   requires only a dot product with the interpolated coefficients
+            Math::SH::BlockValue<float> path_amplitudes;
+
 
 
             FORCE_INLINE float FOD (const Eigen::Vector3f& direction) const
@@ -363,13 +371,6 @@ end_init:
                   );
             }
 
-            FORCE_INLINE float FOD (const Eigen::Vector3f& position, const Eigen::Vector3f& direction)
-            {
-              if (!get_data (source, position))
-                return NaN;
-              return FOD (direction);
-            }
-
 
 
 
@@ -395,7 +396,10 @@ end_init:
               float log_prob = half_log_prob0;
               for (size_t i = 0; i < S.num_samples; ++i) {
 
-                float fod_amp = FOD (positions[i], tangents[i]);
+                if (!get_data (source, positions[i]))
+                  return NaN;
+                path_amplitudes.set_direction (i, tangents[i]);
+                float fod_amp = path_amplitudes.value (i, values);
                 if (std::isnan (fod_amp))
                   return NaN;
                 if (fod_amp < S.threshold)
@@ -461,6 +465,7 @@ end_init:
                   P (method),
                   fod (P.values),
                   vox (P.S.vox()),
+                  block (P.S.lmax),
                   positions (P.S.num_samples),
                   tangents (P.S.num_samples) {
                     Math::SH::delta (fod, Eigen::Vector3f (0.0, 0.0, 1.0), P.S.lmax);
@@ -471,10 +476,12 @@ end_init:
                 {
                   P.pos = { 0.0f, 0.0f, 0.0f };
                   P.get_path (positions, tangents, Eigen::Vector3f (std::sin (el), 0.0, std::cos(el)));
+                  block.set_directions (tangents);
+                  block (amplitudes, fod);
 
                   float log_prob = init_log_prob;
                   for (size_t i = 0; i < P.S.num_samples; ++i) {
-                    float prob = Math::SH::value (P.values, tangents[i], P.S.lmax) * (1.0 - (positions[i][0] / vox));
+                    float prob = amplitudes[i] * (1.0 - (positions[i][0] / vox));
                     if (prob <= 0.0)
                       return 0.0;
                     prob = std::log (prob);
@@ -492,6 +499,8 @@ end_init:
                 Eigen::VectorXf& fod;
                 const float vox;
                 float init_log_prob;
+                Math::SH::BlockValue<float> block;
+                Eigen::VectorXf amplitudes;
                 vector<Eigen::Vector3f> positions, tangents;
             };
 
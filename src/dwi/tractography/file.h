@@ -24,6 +24,7 @@
 #include "memory.h"
 #include "file/config.h"
 #include "file/key_value.h"
+#include "file/mmap.h"
 #include "file/ofstream.h"
 #include "dwi/tractography/file_base.h"
 #include "dwi/tractography/properties.h"
@@ -65,6 +66,12 @@ namespace MR
 
 
       //! A class to read streamlines data
+      /*! Where possible, the streamline data are memory-mapped, and each
+       * streamline is decoded in bulk: the delimiter is located by scanning
+       * the mapped data, and all of its points are then converted (or, if
+       * the file data type matches \a ValueType in native byte order, copied)
+       * in one operation. If memory-mapping fails, the data are instead read
+       * from the file one point at a time. */
       template <class ValueType = float>
       class Reader : public __ReaderBase__, public ReaderInterface<ValueType>
       { NOMEMALIGN
@@ -74,6 +81,7 @@ namespace MR
           Reader (const std::string& file, Properties& properties) :
             current_index (0) {
               open (file, "tracks", properties);
+              map_data();
               auto opt = App::get_options ("tck_weights_in");
               if (opt.size())
                 weights = load_vector<ValueType> (opt[0][0]);
@@ -84,6 +92,9 @@ namespace MR
             bool operator() (Streamline<ValueType>& tck) {
               tck.clear();
 
+              if (mmap)
+                return read_mapped (tck);
+
               if (!in.is_open())
                 return false;
 
@@ -101,24 +112,10 @@ namespace MR
                 }
 
                 if (std::isnan (p[0])) {
-                  tck.index = current_index++;
-
-                  if (weights.size()) {
-
-                    if (tck.index < size_t(weights.size())) {
-                      tck.weight = weights[tck.index];
-                    } else {
-                      WARN ("Streamline weights file contains less entries (" + str(weights.size()) + ") than .tck file; "
-                            "ceasing reading of streamline data");
-                      in.close();
-                      tck.clear();
-                      return false;
-                    }
-
-                  } else {
-                    tck.weight = 1.0;
+                  if (!assign_weight (tck)) {
+                    in.close();
+                    return false;
                   }
-
                   return true;
                 }
 
@@ -130,13 +127,117 @@ namespace MR
             }
 
 
+            void close () {
+              mmap.reset();
+              __ReaderBase__::close();
+            }
+
+
 
         protected:
           using __ReaderBase__::in;
           using __ReaderBase__::dtype;
+          using __ReaderBase__::data_name;
+          using __ReaderBase__::data_offset;
 
           uint64_t current_index;
           Eigen::Matrix<ValueType, Eigen::Dynamic, 1> weights;
+          std::unique_ptr<File::MMap> mmap;
+          const uint8_t* mapped_position;
+
+
+          void map_data ()
+          {
+            try {
+              std::unique_ptr<File::MMap> map (new File::MMap (File::Entry (data_name, data_offset)));
+              if (map->size() < 0)
+                return;
+              mmap = std::move (map);
+              mapped_position = mmap->address();
+              in.close();
+            } catch (Exception& e) {
+              DEBUG ("unable to memory-map track data in file \"" + data_name + "\"; reading from stream instead");
+            }
+          }
+
+
+          //! set the index and weight of a completed streamline
+          bool assign_weight (Streamline<ValueType>& tck)
+          {
+            tck.index = current_index++;
+
+            if (weights.size()) {
+
+              if (tck.index < size_t(weights.size())) {
+                tck.weight = weights[tck.index];
+              } else {
+                WARN ("Streamline weights file contains less entries (" + str(weights.size()) + ") than .tck file; "
+                      "ceasing reading of streamline data");
+                tck.clear();
+                return false;
+              }
+
+            } else {
+              tck.weight = 1.0;
+            }
+
+            return true;
+          }
+
+
+          bool read_mapped (Streamline<ValueType>& tck)
+          {
+            bool complete = false;
+            switch (dtype()) {
+              case DataType::Float32LE: complete = decode_mapped<float>  (tck, false); break;
+              case DataType::Float32BE: complete = decode_mapped<float>  (tck, true);  break;
+              case DataType::Float64LE: complete = decode_mapped<double> (tck, false); break;
+              case DataType::Float64BE: complete = decode_mapped<double> (tck, true);  break;
+              default: assert (0); break;
+            }
+            if (!complete) {
+              mmap.reset();
+              tck.clear();
+              check_excess_weights();
+              return false;
+            }
+            if (!assign_weight (tck)) {
+              mmap.reset();
+              return false;
+            }
+            return true;
+          }
+
+
+          //! decode the next streamline from the memory-mapped data
+          /*! returns false if the end of the data is reached before a
+           * streamline delimiter */
+          template <typename FileValueType>
+            bool decode_mapped (Streamline<ValueType>& tck, const bool is_big_endian)
+            {
+              constexpr size_t point_size = 3 * sizeof (FileValueType);
+              const uint8_t* const end = mmap->address() + mmap->size();
+              const uint8_t* delimiter = mapped_position;
+              while (delimiter + point_size <= end && std::isfinite (Raw::fetch_<FileValueType> (delimiter, is_big_endian)))
+                delimiter += point_size;
+              if (delimiter + point_size > end || std::isinf (Raw::fetch_<FileValueType> (delimiter, is_big_endian)))
+                return false;
+
+              const size_t num_points = (delimiter - mapped_position) / point_size;
+              tck.resize (num_points);
+              if (num_points) {
+                ValueType* out = tck[0].data();
+                if (std::is_same<FileValueType, ValueType>::value && is_big_endian == MRTRIX_IS_BIG_ENDIAN) {
+                  memcpy (out, mapped_position, num_points * point_size);
+                } else {
+                  for (size_t n = 0; n != 3 * num_points; ++n)
+                    out[n] = ValueType (Raw::fetch_<FileValueType> (mapped_position + n * sizeof (FileValueType), is_big_endian));
+                }
+              }
+              mapped_position = delimiter + point_size;
+              return true;
+            }
+
 
           //! takes care of byte ordering issues
 
@@ -79,6 +79,8 @@ namespace MR {
         if (!in)
           throw Exception ("error opening " + type  + " data file \"" + fname + "\": " + strerror(errno));
         in.seekg (offset);
+        data_name = fname;
+        data_offset = offset;
       }
 
     }
@@ -53,6 +53,9 @@ namespace MR
 
           std::ifstream  in;
           DataType  dtype;
+          // location of the data, for readers that access it directly
+          std::string data_name;
+          int64_t data_offset;
       };
 
 
@@ -61,8 +61,9 @@ namespace MR
             {
               if (!source.scanner (position))
                 return false;
-              for (auto l = Loop (3) (source); l; ++l)
-                values[source.index(3)] = source.value();
+              // The source image is loaded with axis 3 contiguous, such that
+              //   all coefficients are interpolated in a single operation
+              source.row (3, values);
               return !std::isnan (values[0]);
             }
 
@@ -118,17 +118,30 @@ namespace MR
 
 
 
+      /*
+      * For each voxel, the input FOD is first projected onto the weights of the apodised PSFs
+      * (a single matrix-vector product with a precomputed matrix); the output FOD is then
+      * accumulated as the weighted sum of the SH deltas along the transformed directions
+      * (using precomputed Legendre recursion coefficients), with the aPSF convolution applied
+      * once to the result. This is mathematically identical to forming the full (n_SH x n_SH)
+      * transformation for each voxel, but avoids the matrix-matrix product and the
+      * per-direction convolution.
+      */
       template <class FODImageType>
       class NonLinearKernel { MEMALIGN(NonLinearKernel<FODImageType>)
 
         public:
           NonLinearKernel (const ssize_t n_SH, Image<default_type>& warp, const Eigen::MatrixXd& directions, const bool modulate) :
                            n_SH (n_SH),
+                           lmax (Math::SH::LforN (n_SH)),
                            jacobian_adapter (warp),
                            directions (directions),
                            modulate (modulate),
                            FOD_to_aPSF_transform (Math::pinv (aPSF_weights_to_FOD_transform (n_SH, directions))),
-                           fod (n_SH) {}
+                           aPSF_RH (Math::SH::aPSF<default_type> (lmax).RH_coefs()),
+                           delta_generator (lmax),
+                           fod (n_SH),
+                           delta (n_SH) {}
 
 
           void operator() (FODImageType& image) {
@@ -136,35 +149,32 @@ namespace MR
             if (image.value() > 0) {  // only reorient voxels that contain a FOD
               for (size_t dim = 0; dim < 3; ++dim)
                 jacobian_adapter.index(dim) = image.index(dim);
-              Eigen::MatrixXd jacobian = jacobian_adapter.value().inverse().template cast<default_type>();
-              Eigen::MatrixXd transformed_directions = jacobian * directions;
-
-              if (modulate) {
-                Eigen::MatrixXd modulation_factors = transformed_directions.colwise().norm() / jacobian.determinant();
-                transformed_directions.colwise().normalize();
-
-                Eigen::MatrixXd temp = aPSF_weights_to_FOD_transform (n_SH, transformed_directions);
-                for (ssize_t i = 0; i < temp.cols(); ++i)
-                  temp.col(i) = temp.col(i) * modulation_factors(0,i);
-
-                transform.noalias() = temp * FOD_to_aPSF_transform;
-              } else {
-                transformed_directions.colwise().normalize();
-                transform.noalias() = aPSF_weights_to_FOD_transform (n_SH, transformed_directions) * FOD_to_aPSF_transform;
-              }
+              Eigen::Matrix3d jacobian = jacobian_adapter.value().inverse().template cast<default_type>();
+              transformed_directions.noalias() = jacobian * directions;
+
               fod = image.row(3);
-              fod = transform * fod;
+              aPSF_weights.noalias() = FOD_to_aPSF_transform * fod;
+              if (modulate)
+                aPSF_weights.array() *= transformed_directions.colwise().norm().transpose().array() / jacobian.determinant();
+
+              fod.setZero();
+              for (ssize_t i = 0; i < transformed_directions.cols(); ++i)
+                fod += aPSF_weights[i] * delta_generator (delta, transformed_directions.col(i).normalized());
+              Math::SH::sconv (fod, aPSF_RH);
               image.row(3) = fod;
             }
           }
           protected:
             const ssize_t n_SH;
+            const int lmax;
             Adapter::Jacobian<Image<default_type> > jacobian_adapter;
             const Eigen::MatrixXd& directions;
             const bool modulate;
             const Eigen::MatrixXd FOD_to_aPSF_transform;
-            Eigen::MatrixXd transform;
-            Eigen::VectorXd fod;
+            const Eigen::VectorXd aPSF_RH;
+            const Math::SH::PrecomputedDelta<default_type> delta_generator;
+            Eigen::Matrix3Xd transformed_directions;
+            Eigen::VectorXd aPSF_weights, fod, delta;
       };
 
 
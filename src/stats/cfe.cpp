@@ -16,6 +16,17 @@
 
 #include "stats/cfe.h"
 
+#include "datatype.h"
+#include "file/key_value.h"
+#include "file/ofstream.h"
+
+// Number of fixel-fixel pairs buffered by each thread before being added
+//   to the shared connectivity matrix
+#define CFE_CONNECTIVITY_PAIR_BUFFER_SIZE (1<<22)
+// Number of blocks of rows of the connectivity matrix, each of which may be
+//   modified by one thread at a time
+#define CFE_CONNECTIVITY_ROW_BLOCKS 1024
+
 namespace MR
 {
   namespace Stats
@@ -36,7 +47,38 @@ namespace MR
                                         fixel_mask           (fixel_mask),
                                         fixel_TDI            (fixel_TDI),
                                         connectivity_matrix  (connectivity_matrix),
-                                        angular_threshold_dp (std::cos (angular_threshold * (Math::pi/180.0))) { }
+                                        angular_threshold_dp (std::cos (angular_threshold * (Math::pi/180.0))),
+                                        shared               (new Shared (fixel_TDI.size())),
+                                        local_TDI            (fixel_TDI.size(), 0) { }
+
+
+
+      TrackProcessor::TrackProcessor (const TrackProcessor& that) :
+          fixel_indexer        (that.fixel_indexer),
+          fixel_directions     (that.fixel_directions),
+          fixel_mask           (that.fixel_mask),
+          fixel_TDI            (that.fixel_TDI),
+          connectivity_matrix  (that.connectivity_matrix),
+          angular_threshold_dp (that.angular_threshold_dp),
+          shared               (that.shared),
+          local_TDI            (that.fixel_TDI.size(), 0) { }
+
+
+
+      TrackProcessor::~TrackProcessor()
+      {
+        flush();
+        std::lock_guard<std::mutex> lock (shared->TDI_mutex);
+        for (size_t i = 0; i != local_TDI.size(); ++i)
+          fixel_TDI[i] += local_TDI[i];
+      }
+
+
+
+      TrackProcessor::Shared::Shared (const size_t num_fixels) :
+          rows_per_block (std::max (size_t(1), (num_fixels + CFE_CONNECTIVITY_ROW_BLOCKS - 1) / CFE_CONNECTIVITY_ROW_BLOCKS)),
+          row_mutexes ((num_fixels + rows_per_block - 1) / rows_per_block),
+          next_block (0) { }
 
 
 
@@ -68,7 +110,7 @@ namespace MR
             }
             if (closest_fixel_index != num_fixels && largest_dp > angular_threshold_dp) {
               tract_fixel_indices.push_back (closest_fixel_index);
-              fixel_TDI[closest_fixel_index]++;
+              local_TDI[closest_fixel_index]++;
             }
           }
         }
@@ -76,10 +118,12 @@ namespace MR
         try {
           for (size_t i = 0; i < tract_fixel_indices.size(); i++) {
             for (size_t j = i + 1; j < tract_fixel_indices.size(); j++) {
-              connectivity_matrix[tract_fixel_indices[i]][tract_fixel_indices[j]].value++;
-              connectivity_matrix[tract_fixel_indices[j]][tract_fixel_indices[i]].value++;
+              pairs.push_back ((uint64_t(tract_fixel_indices[i]) << 32) | tract_fixel_indices[j]);
+              pairs.push_back ((uint64_t(tract_fixel_indices[j]) << 32) | tract_fixel_indices[i]);
             }
           }
+          if (pairs.size() >= CFE_CONNECTIVITY_PAIR_BUFFER_SIZE)
+            flush();
           return true;
         } catch (...) {
           throw Exception ("Error assigning memory for CFE connectivity matrix");
@@ -89,12 +133,247 @@ namespace MR
 
 
 
+      void TrackProcessor::flush()
+      {
+        if (pairs.empty())
+          return;
+        std::sort (pairs.begin(), pairs.end());
+        // Different threads start from different blocks of rows, such that
+        //   they are unlikely to wait on one another
+        const size_t num_blocks = shared->row_mutexes.size();
+        const size_t first_block = shared->next_block++;
+        for (size_t n = 0; n != num_blocks; ++n) {
+          const size_t block = (first_block + n) % num_blocks;
+          auto begin = std::lower_bound (pairs.begin(), pairs.end(), uint64_t(block * shared->rows_per_block) << 32);
+          const auto end = std::lower_bound (begin, pairs.end(), uint64_t((block+1) * shared->rows_per_block) << 32);
+          if (begin == end)
+            continue;
+          std::lock_guard<std::mutex> lock (shared->row_mutexes[block]);
+          while (begin != end) {
+            auto run_end = begin + 1;
+            while (run_end != end && *run_end == *begin)
+              ++run_end;
+            connectivity_matrix[*begin >> 32][uint32_t(*begin)].value += run_end - begin;
+            begin = run_end;
+          }
+        }
+        pairs.clear();
+      }
+
+
+
+
+
+
 
 
+      // The file format relies on each element being stored as a packed
+      //   (index, value) pair, so that the matrix can be accessed in-place
+      static_assert (sizeof (NormMatrixElement) == sizeof (index_type) + sizeof (connectivity_value_type),
+                     "NormMatrixElement must not contain padding");
 
+      namespace {
+        // Offsets of the binary data within the file are rounded up to
+        //   a multiple of the largest type stored, such that all data
+        //   are naturally aligned once memory-mapped
+        inline size_t pad (const size_t offset)
+        {
+          return (offset + sizeof (uint64_t) - 1) & ~(sizeof (uint64_t) - 1);
+        }
+      }
+
+
+
+      CompressedMatrix::CompressedMatrix (norm_connectivity_matrix_type&& matrix) :
+          num_rows (matrix.size())
+      {
+        offset_storage.reserve (num_rows + 1);
+        offset_storage.push_back (0);
+        for (const auto& row : matrix)
+          offset_storage.push_back (offset_storage.back() + row.size());
+        element_storage.reserve (offset_storage.back());
+        for (auto& row : matrix) {
+          for (const auto& element : row)
+            element_storage.push_back (element);
+          vector<NormMatrixElement>().swap (row);
+        }
+        norm_connectivity_matrix_type().swap (matrix);
+        offsets = offset_storage.data();
+        elements = element_storage.data();
+      }
+
+
+
+      CompressedMatrix::CompressedMatrix (std::shared_ptr<File::MMap> mmap, const size_t offset, const size_t num_rows) :
+          num_rows (num_rows),
+          offsets (nullptr),
+          elements (nullptr),
+          mmap (mmap)
+      {
+        // Sizes are compared against the space available in the file
+        //   rather than computed from the stored offsets, so that corrupt
+        //   or hostile offsets cannot cause an arithmetic overflow
+        const size_t file_size = mmap->size();
+        if (offset > file_size || num_rows >= (file_size - offset) / sizeof (uint64_t))
+          throw Exception ("fixel connectivity file \"" + mmap->name() + "\" is truncated");
+        offsets = reinterpret_cast<const uint64_t*> (mmap->address() + offset);
+        elements = reinterpret_cast<const NormMatrixElement*> (offsets + num_rows + 1);
+        const size_t max_elements = (file_size - offset - (num_rows+1) * sizeof (uint64_t)) / sizeof (NormMatrixElement);
+        const uint64_t total = offsets[num_rows];
+        if (offsets[0] || total > max_elements)
+          throw Exception ("fixel connectivity file \"" + mmap->name() + "\" is malformed or truncated");
+        // Verify that the data are consistent, so that invalid memory
+        //   accesses cannot occur during statistical enhancement:
+        //   all offsets must be validated before any row is accessed
+        for (size_t row = 0; row != num_rows; ++row) {
+          if (offsets[row+1] < offsets[row] || offsets[row+1] > total)
+            throw Exception ("fixel connectivity file \"" + mmap->name() + "\" is malformed");
+        }
+        for (size_t row = 0; row != num_rows; ++row) {
+          for (const auto& element : (*this)[row]) {
+            if (element.index() >= num_rows)
+              throw Exception ("fixel connectivity file \"" + mmap->name() + "\" is malformed");
+          }
+        }
+      }
+
+
+
+      void CompressedMatrix::write (std::ostream& stream) const
+      {
+        if (!num_rows) {
+          const uint64_t zero = 0;
+          stream.write (reinterpret_cast<const char*> (&zero), sizeof (uint64_t));
+          return;
+        }
+        stream.write (reinterpret_cast<const char*> (offsets), (num_rows+1) * sizeof (uint64_t));
+        stream.write (reinterpret_cast<const char*> (elements), num_elements() * sizeof (NormMatrixElement));
+      }
+
+
+
+
+
+
+
+
+      void save_connectivity (const std::string& path,
+                              const vector<int32_t>& fixel2row,
+                              const CompressedMatrix& connectivity,
+                              const CompressedMatrix& smoothing,
+                              const KeyValues& properties)
+      {
+        const size_t num_rows = connectivity.size();
+        assert (smoothing.size() == num_rows);
+        assert (size_t(std::count_if (fixel2row.begin(), fixel2row.end(), [] (const int32_t row) { return row >= 0; })) == num_rows);
+
+        DataType datatype = DataType::Float32;
+        datatype.set_byte_order_native();
+
+        std::stringstream header;
+        header << "mrtrix fixel connectivity\n";
+        for (const auto& p : properties)
+          header << p.first << ": " << p.second << "\n";
+        header << "num_fixels: " << fixel2row.size() << "\n";
+        header << "num_rows: " << num_rows << "\n";
+        header << "connectivity_elements: " << connectivity.num_elements() << "\n";
+        header << "smoothing_elements: " << smoothing.num_elements() << "\n";
+        header << "datatype: " << datatype.specifier() << "\n";
+        header << "file: . ";
+
+        // Reserve sufficient space for the offset itself and the END line
+        std::string text = header.str();
+        const size_t data_offset = pad (text.size() + 32);
+        text += str(data_offset) + "\nEND\n";
+        assert (text.size() <= data_offset);
+        text.resize (data_offset, '\0');
+
+        File::OFStream out (path);
+        out.write (text.data(), text.size());
+        out.write (reinterpret_cast<const char*> (fixel2row.data()), fixel2row.size() * sizeof (int32_t));
+        const std::string padding (pad (fixel2row.size() * sizeof (int32_t)) - fixel2row.size() * sizeof (int32_t), '\0');
+        out.write (padding.data(), padding.size());
+        connectivity.write (out);
+        smoothing.write (out);
+        if (!out.good())
+          throw Exception ("error writing fixel connectivity file \"" + path + "\": " + strerror (errno));
+      }
 
 
-      Enhancer::Enhancer (const norm_connectivity_matrix_type& connectivity_matrix,
+
+      void load_connectivity (const std::string& path,
+                              vector<int32_t>& fixel2row,
+                              CompressedMatrix& connectivity,
+                              CompressedMatrix& smoothing,
+                              KeyValues& properties)
+      {
+        properties.clear();
+        std::string data_file;
+        int64_t data_offset = -1;
+        {
+          File::KeyValue kv (path, "mrtrix fixel connectivity");
+          while (kv.next()) {
+            if (kv.key() == "file") {
+              std::istringstream stream (kv.value());
+              stream >> data_file >> data_offset;
+            } else {
+              properties[kv.key()] = kv.value();
+            }
+          }
+        }
+        if (data_file != "." || data_offset <= 0 || size_t(data_offset) != pad (data_offset))
+          throw Exception ("missing or invalid data file entry in fixel connectivity file \"" + path + "\"");
+
+        auto get = [&] (const std::string& key) {
+          const auto it = properties.find (key);
+          if (it == properties.end())
+            throw Exception ("missing entry \"" + key + "\" in fixel connectivity file \"" + path + "\"");
+          return to<size_t> (it->second);
+        };
+        const size_t num_fixels = get ("num_fixels");
+        const size_t num_rows = get ("num_rows");
+        const size_t connectivity_elements = get ("connectivity_elements");
+        const size_t smoothing_elements = get ("smoothing_elements");
+
+        DataType datatype = DataType::Float32;
+        datatype.set_byte_order_native();
+        if (properties["datatype"] != datatype.specifier())
+          throw Exception ("fixel connectivity file \"" + path + "\" has unsupported data type \"" + properties["datatype"] + "\""
+                           " (expected \"" + datatype.specifier() + "\")");
+
+        auto mmap = std::make_shared<File::MMap> (File::Entry (path, data_offset));
+        // The sizes of the two matrices are validated against the data
+        //   themselves when they are constructed below
+        if (num_fixels > size_t(mmap->size()) / sizeof (int32_t))
+          throw Exception ("fixel connectivity file \"" + path + "\" is truncated");
+        const size_t fixel2row_size = pad (num_fixels * sizeof (int32_t));
+
+        const int32_t* data = reinterpret_cast<const int32_t*> (mmap->address());
+        fixel2row.assign (data, data + num_fixels);
+        size_t mask_fixels = 0;
+        for (const auto row : fixel2row) {
+          if (row >= 0) {
+            if (size_t(row) != mask_fixels++)
+              throw Exception ("fixel connectivity file \"" + path + "\" is malformed");
+          }
+        }
+        if (mask_fixels != num_rows)
+          throw Exception ("fixel connectivity file \"" + path + "\" is malformed");
+
+        connectivity = CompressedMatrix (mmap, fixel2row_size, num_rows);
+        smoothing = CompressedMatrix (mmap, fixel2row_size + connectivity.storage_size(), num_rows);
+        if (connectivity.num_elements() != connectivity_elements || smoothing.num_elements() != smoothing_elements)
+          throw Exception ("fixel connectivity file \"" + path + "\" is malformed");
+      }
+
+
+
+
+
+
+
+
+      Enhancer::Enhancer (const CompressedMatrix& connectivity_matrix,
                           const value_type dh,
                           const value_type E,
                           const value_type H) :
@@ -109,7 +388,7 @@ namespace MR
       {
         enhanced_stats = vector_type::Zero (stats.size());
         value_type max_enhanced_stat = 0.0;
-        vector<NormMatrixElement>::const_iterator connected_fixel;
+        const NormMatrixElement* connected_fixel;
         for (size_t fixel = 0; fixel < connectivity_matrix.size(); ++fixel) {
           for (value_type h = this->dh; h < stats[fixel]; h +=  this->dh) {
             value_type extent = 0.0;
@@ -127,6 +406,109 @@ namespace MR
 
 
 
+
+
+
+
+
+      FastEnhancer::FastEnhancer (const CompressedMatrix& connectivity_matrix,
+                                  const value_type dh,
+                                  const value_type E,
+                                  const value_type H) :
+          Enhancer (connectivity_matrix, dh, E, H),
+          exact_sums (connectivity_matrix.size(), true)
+      {
+        // The connectivity values are single-precision, and are summed in
+        //   double precision. If all values are integer multiples of the
+        //   finest granularity among them, and their total is small enough
+        //   for it to be represented exactly at that granularity, then the
+        //   sum of any subset is exact, regardless of the order of summation.
+        for (size_t fixel = 0; fixel < connectivity_matrix.size(); ++fixel) {
+          int min_exponent = std::numeric_limits<int>::max();
+          value_type sum = 0.0;
+          for (const auto& connected_fixel : connectivity_matrix[fixel]) {
+            if (!std::isfinite (connected_fixel.value())) {
+              min_exponent = std::numeric_limits<int>::min();
+              break;
+            }
+            if (connected_fixel.value()) {
+              int exponent;
+              std::frexp (connected_fixel.value(), &exponent);
+              min_exponent = std::min (min_exponent, exponent - std::numeric_limits<connectivity_value_type>::digits);
+              sum += abs (connected_fixel.value());
+            }
+          }
+          if (min_exponent == std::numeric_limits<int>::min() ||
+              (min_exponent != std::numeric_limits<int>::max() &&
+               sum >= std::ldexp (value_type(1.0), std::numeric_limits<value_type>::digits - 1 + min_exponent)))
+            exact_sums[fixel] = false;
+        }
+      }
+
+
+
+      value_type FastEnhancer::operator() (const vector_type& stats, vector_type& enhanced_stats) const
+      {
+        enhanced_stats = vector_type::Zero (stats.size());
+
+        // Heights at which the extent is evaluated, accumulated exactly as in
+        //   Enhancer, along with the height term for each:
+        value_type max_stat = 0.0;
+        for (ssize_t fixel = 0; fixel < stats.size(); ++fixel)
+          if (stats[fixel] > max_stat)
+            max_stat = stats[fixel];
+        vector<value_type> heights, height_terms;
+        for (value_type h = this->dh; h < max_stat; h += this->dh) {
+          heights.push_back (h);
+          height_terms.push_back (std::pow (h, H));
+        }
+
+        // For each fixel, the number of heights that its statistic exceeds:
+        vector<uint32_t> levels (stats.size());
+        for (ssize_t fixel = 0; fixel < stats.size(); ++fixel)
+          levels[fixel] = std::lower_bound (heights.begin(), heights.end(), stats[fixel]) - heights.begin();
+
+        value_type max_enhanced_stat = 0.0;
+        vector<value_type> extents (heights.size() + 1);
+        for (size_t fixel = 0; fixel < connectivity_matrix.size(); ++fixel) {
+          const uint32_t level = levels[fixel];
+          if (!level)
+            continue;
+
+          if (exact_sums[fixel]) {
+            // Bin the connected fixels by the number of heights (up to that
+            //   of this fixel) for which they contribute to the extent:
+            std::fill (extents.begin(), extents.begin() + level + 1, value_type(0.0));
+            for (const auto& connected_fixel : connectivity_matrix[fixel]) {
+              const uint32_t connected_level = std::min (levels[connected_fixel.index()], level);
+              if (connected_level)
+                extents[connected_level] += connected_fixel.value();
+            }
+            // Cumulative sum from the highest bin down yields the extent
+            //   at each height:
+            for (uint32_t n = level - 1; n > 0; --n)
+              extents[n] += extents[n+1];
+            for (uint32_t n = 1; n <= level; ++n)
+              enhanced_stats[fixel] += std::pow (extents[n], E) * height_terms[n-1];
+          } else {
+            for (uint32_t n = 0; n < level; ++n) {
+              value_type extent = 0.0;
+              for (const auto& connected_fixel : connectivity_matrix[fixel])
+                if (stats[connected_fixel.index()] > heights[n])
+                  extent += connected_fixel.value();
+              enhanced_stats[fixel] += std::pow (extent, E) * height_terms[n];
+            }
+          }
+
+          if (enhanced_stats[fixel] > max_enhanced_stat)
+            max_enhanced_stat = enhanced_stats[fixel];
+        }
+
+        return max_enhanced_stat;
+      }
+
+
+
     }
   }
 }
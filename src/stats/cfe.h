@@ -17,9 +17,13 @@
 #ifndef __stats_cfe_h__
 #define __stats_cfe_h__
 
+#include <atomic>
+#include <mutex>
+
 #include "image.h"
 #include "image_helpers.h"
 #include "types.h"
+#include "file/mmap.h"
 #include "math/math.h"
 #include "math/stats/typedefs.h"
 
@@ -80,8 +84,97 @@ namespace MR
 
 
 
+      //! Compressed sparse row storage of a normalised connectivity matrix
+      /*! The elements of all rows are stored contiguously, with row \a i
+       * spanning elements [ offsets[i], offsets[i+1] ). The data may either
+       * be held in RAM, or memory-mapped directly from a file written using
+       * save_connectivity(), in which case no further memory is allocated. */
+      class CompressedMatrix { NOMEMALIGN
+        public:
+          class Row { NOMEMALIGN
+            public:
+              Row (const NormMatrixElement* first, const NormMatrixElement* last) :
+                  first (first), last (last) { }
+              const NormMatrixElement* begin() const { return first; }
+              const NormMatrixElement* end() const { return last; }
+              size_t size() const { return last - first; }
+              bool empty() const { return first == last; }
+            private:
+              const NormMatrixElement* first;
+              const NormMatrixElement* last;
+          };
+
+          CompressedMatrix () : num_rows (0), offsets (nullptr), elements (nullptr) { }
+          //! pack \a matrix; the memory of each of its rows is released once copied
+          CompressedMatrix (norm_connectivity_matrix_type&& matrix);
+          //! access a matrix stored in \a mmap, starting at byte \a offset
+          CompressedMatrix (std::shared_ptr<File::MMap> mmap, const size_t offset, const size_t num_rows);
+          CompressedMatrix (CompressedMatrix&&) = default;
+          CompressedMatrix& operator= (CompressedMatrix&&) = default;
+
+          size_t size() const { return num_rows; }
+          size_t num_elements() const { return num_rows ? offsets[num_rows] : 0; }
+          //! the number of bytes occupied by this matrix when written to file
+          size_t storage_size() const { return storage_size (num_rows, num_elements()); }
+          static size_t storage_size (const size_t num_rows, const size_t num_elements) {
+            return (num_rows+1) * sizeof (uint64_t) + num_elements * sizeof (NormMatrixElement);
+          }
+
+          Row operator[] (const size_t row) const {
+            assert (row < num_rows);
+            return Row (elements + offsets[row], elements + offsets[row+1]);
+          }
+
+          void write (std::ostream& stream) const;
+
+        private:
+          size_t num_rows;
+          const uint64_t* offsets;
+          const NormMatrixElement* elements;
+          vector<uint64_t> offset_storage;
+          vector<NormMatrixElement> element_storage;
+          std::shared_ptr<File::MMap> mmap;
+      };
+
+
+
+      //! Write the normalised fixel-fixel connectivity and smoothing matrices to file
+      /*! This allows the costly mapping of streamlines to fixels to be
+       * skipped on subsequent analyses using the same template, mask, and
+       * connectivity parameters. The file consists of a text header, in
+       * which \a properties are stored alongside the dimensions of the
+       * data, followed by the binary data in native byte order: the mapping
+       * from template fixel index to matrix row (-1 for fixels outside the
+       * mask), then each of the two matrices in compressed sparse row form.
+       * The binary data are aligned such that they can be accessed in-place
+       * following memory-mapping by load_connectivity(). */
+      void save_connectivity (const std::string& path,
+                              const vector<int32_t>& fixel2row,
+                              const CompressedMatrix& connectivity,
+                              const CompressedMatrix& smoothing,
+                              const KeyValues& properties);
+
+      //! Memory-map a file written by save_connectivity()
+      /*! \a properties is filled with all entries of the text header. */
+      void load_connectivity (const std::string& path,
+                              vector<int32_t>& fixel2row,
+                              CompressedMatrix& connectivity,
+                              CompressedMatrix& smoothing,
+                              KeyValues& properties);
+
+
+
       /**
        * Process each track by converting each streamline to a set of dixels, and map these to fixels.
+       *
+       * This functor may be run using Thread::multi(). Each copy accumulates
+       * fixel-fixel pairs into its own buffer, and fixel TDI values into its
+       * own vector; once the buffer is full (and on destruction), its
+       * contents are sorted and added to the shared connectivity matrix,
+       * which is partitioned into blocks of rows each protected by its own
+       * mutex, such that copies rarely contend for the same lock. All
+       * accumulated values are integer counts, so the result does not
+       * depend on the number of threads.
        */
       class TrackProcessor { MEMALIGN(TrackProcessor)
 
@@ -92,16 +185,34 @@ namespace MR
                           vector<uint16_t>& fixel_TDI,
                           init_connectivity_matrix_type& connectivity_matrix,
                           const value_type angular_threshold);
+          TrackProcessor (const TrackProcessor& that);
+          ~TrackProcessor();
 
           bool operator () (const SetVoxelDir& in);
 
         private:
+          class Shared { NOMEMALIGN
+            public:
+              Shared (const size_t num_fixels);
+              const size_t rows_per_block;
+              vector<std::mutex> row_mutexes;
+              std::mutex TDI_mutex;
+              std::atomic<size_t> next_block;
+          };
+
           Image<index_type> fixel_indexer;
           const vector<direction_type>& fixel_directions;
           Image<bool> fixel_mask;
           vector<uint16_t>& fixel_TDI;
           init_connectivity_matrix_type& connectivity_matrix;
           const value_type angular_threshold_dp;
+
+          std::shared_ptr<Shared> shared;
+          // Fixel pairs, encoded as (row << 32) | column
+          vector<uint64_t> pairs;
+          vector<uint16_t> local_TDI;
+
+          void flush();
       };
 
 
@@ -109,7 +220,7 @@ namespace MR
 
       class Enhancer : public Stats::EnhancerBase { MEMALIGN (Enhancer)
         public:
-          Enhancer (const norm_connectivity_matrix_type& connectivity_matrix,
+          Enhancer (const CompressedMatrix& connectivity_matrix,
                     const value_type dh, const value_type E, const value_type H);
           virtual ~Enhancer() { }
 
@@ -118,11 +229,40 @@ namespace MR
 
 
         protected:
-          const norm_connectivity_matrix_type& connectivity_matrix;
+          const CompressedMatrix& connectivity_matrix;
           const value_type dh, E, H;
       };
 
 
+
+      //! Faster alternative to Enhancer, providing identical results
+      /*! Rather than re-evaluating the extent at each height increment by
+       * looping over all connected fixels, each connected fixel is binned
+       * according to the number of height increments its statistic exceeds;
+       * the extent at each height is then obtained as a cumulative sum over
+       * these bins. This reduces the cost per fixel from O(h-steps x
+       * neighbours) to O(h-steps + neighbours).
+       *
+       * The results are bitwise identical to those of Enhancer provided the
+       * sums of connectivity values are exact in floating-point, regardless
+       * of summation order; this is verified for each fixel on construction,
+       * and any fixel for which it cannot be guaranteed is processed as in
+       * Enhancer. */
+      class FastEnhancer : public Enhancer { MEMALIGN (FastEnhancer)
+        public:
+          FastEnhancer (const CompressedMatrix& connectivity_matrix,
+                        const value_type dh, const value_type E, const value_type H);
+          virtual ~FastEnhancer() { }
+
+
+          value_type operator() (const vector_type& stats, vector_type& enhanced_stats) const override;
+
+
+        protected:
+          vector<bool> exact_sums;
+      };
+
+
       //! @}
 
     }
@@ -18,6 +18,8 @@
 
 #include <algorithm>
 
+#include "algo/union_find.h"
+
 namespace MR
 {
   namespace Stats
@@ -41,6 +43,94 @@ namespace MR
 
 
 
+
+      value_type ClusterSizeTFCE::operator() (const vector_type& stats, vector_type& enhanced_stats) const
+      {
+        const size_t num_voxels = stats.size();
+        assert (connector.adjacent_indices.size() == num_voxels);
+        enhanced_stats = vector_type::Zero (num_voxels);
+
+        // Heights as generated by TFCE::Wrapper; cluster formation
+        //   compares against each in single precision, as in Connector
+        vector<float> thresholds;
+        vector<value_type> cumulative_terms (1, 0.0);
+        const value_type max_input_value = stats.maxCoeff();
+        for (value_type h = dH; (h-dH) < max_input_value; h += dH) {
+          thresholds.push_back (h);
+          cumulative_terms.push_back (cumulative_terms.back() + std::pow (h, H));
+        }
+
+        // Number of heights for which each voxel is suprathreshold, and the
+        //   voxels bucketed accordingly
+        vector<uint32_t> levels (num_voxels);
+        vector<vector<uint32_t>> voxels_by_level (thresholds.size() + 1);
+        uint32_t max_level = 0;
+        for (size_t i = 0; i != num_voxels; ++i) {
+          levels[i] = std::lower_bound (thresholds.begin(), thresholds.end(), stats[i]) - thresholds.begin();
+          voxels_by_level[levels[i]].push_back (i);
+          max_level = std::max (max_level, levels[i]);
+        }
+
+        // With an extent exponent of zero, every voxel (suprathreshold or not)
+        //   receives the height term at every height for which any
+        //   cluster exists
+        if (!E) {
+          enhanced_stats.fill (cumulative_terms[max_level]);
+          return enhanced_stats.maxCoeff();
+        }
+
+        // For each cluster, identified by its representative voxel, the
+        //   lowest height index at which the TFCE integral has been
+        //   accumulated; and the integral itself. Once a cluster is merged
+        //   into another, its integral is stored relative to that of the
+        //   cluster into which it was merged.
+        Algo::UnionFind<uint32_t> clusters (num_voxels);
+        vector<uint32_t> accumulated_to (levels);
+        vector<value_type> integral (num_voxels, 0.0);
+        vector<std::pair<uint32_t, uint32_t>> merges;
+
+        // Heights are indexed from 1 here, such that an index of 0 denotes
+        //   that integration is complete
+        auto accumulate = [&] (const uint32_t root, const uint32_t level) {
+          if (accumulated_to[root] > level) {
+            integral[root] += std::pow (value_type (clusters.count (root)), E) * (cumulative_terms[accumulated_to[root]] - cumulative_terms[level]);
+            accumulated_to[root] = level;
+          }
+        };
+
+        for (uint32_t level = max_level; level > 0; --level) {
+          for (const auto voxel : voxels_by_level[level]) {
+            for (const auto neighbour : connector.adjacent_indices[voxel]) {
+              if (levels[neighbour] < level)
+                continue;
+              const uint32_t a = clusters.find (voxel);
+              const uint32_t b = clusters.find (neighbour);
+              if (a == b)
+                continue;
+              accumulate (a, level);
+              accumulate (b, level);
+              const uint32_t root = clusters.unite (a, b);
+              const uint32_t child = (root == a) ? b : a;
+              integral[child] -= integral[root];
+              merges.push_back (std::make_pair (child, root));
+            }
+          }
+        }
+
+        for (uint32_t voxel = 0; voxel != num_voxels; ++voxel) {
+          if (levels[voxel] && clusters.find (voxel) == voxel) {
+            accumulate (voxel, 0);
+            enhanced_stats[voxel] = integral[voxel];
+          }
+        }
+        for (auto m = merges.rbegin(); m != merges.rend(); ++m)
+          enhanced_stats[m->first] = integral[m->first] + enhanced_stats[m->second];
+
+        return enhanced_stats.maxCoeff();
+      }
+
+
+
     }
   }
 }
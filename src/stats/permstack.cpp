@@ -16,6 +16,8 @@
 
 #include "stats/permstack.h"
 
+#include "thread.h"
+
 namespace MR
 {
   namespace Stats
@@ -25,8 +27,20 @@ namespace MR
 
 
 
+      namespace {
+        // Smaller batches are used if necessary for all threads to be kept busy
+        size_t choose_batch_size (const size_t num_permutations)
+        {
+          const size_t num_threads = std::max (size_t(1), Thread::number_of_threads());
+          return std::max (size_t(1), std::min (size_t(PERMUTATION_BATCH_SIZE), num_permutations / num_threads));
+        }
+      }
+
+
+
       PermutationStack::PermutationStack (const size_t num_permutations, const size_t num_samples, const std::string msg, const bool include_default) :
           num_permutations (num_permutations),
+          batch_size (choose_batch_size (num_permutations)),
           counter (0),
           progress (msg, num_permutations)
       {
@@ -35,6 +49,7 @@ namespace MR
 
       PermutationStack::PermutationStack (vector <vector<size_t> >& permutations, const std::string msg) :
           num_permutations (permutations.size()),
+          batch_size (choose_batch_size (permutations.size())),
           permutations (permutations),
           counter (0),
           progress (msg, permutations.size()) { }
@@ -57,6 +72,19 @@ namespace MR
 
 
 
+      bool PermutationStack::operator() (PermutationBatch& out)
+      {
+        out.index = counter;
+        out.data.clear();
+        while (counter < num_permutations && out.data.size() < batch_size) {
+          out.data.push_back (permutations[counter++]);
+          ++progress;
+        }
+        return out.data.size();
+      }
+
+
+
     }
   }
 }
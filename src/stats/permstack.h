@@ -24,6 +24,9 @@
 #include "types.h"
 #include "math/stats/permutation.h"
 
+// Maximal number of permutations handed out by a PermutationStack at once
+#define PERMUTATION_BATCH_SIZE 8
+
 namespace MR
 {
   namespace Stats
@@ -40,6 +43,16 @@ namespace MR
       };
 
 
+      //! a set of consecutive permutations, to be processed together
+      class PermutationBatch
+      { MEMALIGN (PermutationBatch)
+        public:
+          //! the index of the first permutation within the batch
+          size_t index;
+          vector< vector<size_t> > data;
+      };
+
+
       class PermutationStack 
       { MEMALIGN (PermutationStack)
         public:
@@ -48,6 +61,7 @@ namespace MR
           PermutationStack (vector <vector<size_t> >& permutations, const std::string msg);
 
           bool operator() (Permutation&);
+          bool operator() (PermutationBatch&);
 
           const vector<size_t>& operator[] (size_t index) const {
             return permutations[index];
@@ -55,6 +69,9 @@ namespace MR
 
           const size_t num_permutations;
 
+          //! the number of permutations handed out within each PermutationBatch
+          const size_t batch_size;
+
         protected:
           vector< vector<size_t> > permutations;
           size_t counter;
@@ -74,14 +74,17 @@ namespace MR
               }
             }
 
-            bool operator() (const Permutation& permutation)
+            bool operator() (const PermutationBatch& batch)
             {
-              stats_calculator (permutation.data, stats);
-              (*enhancer) (stats, enhanced_stats);
-              for (ssize_t i = 0; i < enhanced_stats.size(); ++i) {
-                if (enhanced_stats[i] > 0.0) {
-                  enhanced_sum[i] += enhanced_stats[i];
-                  enhanced_count[i]++;
+              stats_calculator (batch.data, stats_batch);
+              for (size_t p = 0; p != batch.data.size(); ++p) {
+                stats = stats_batch.col (p).array();
+                (*enhancer) (stats, enhanced_stats);
+                for (ssize_t i = 0; i < enhanced_stats.size(); ++i) {
+                  if (enhanced_stats[i] > 0.0) {
+                    enhanced_sum[i] += enhanced_stats[i];
+                    enhanced_count[i]++;
+                  }
                 }
               }
               return true;
@@ -94,6 +97,7 @@ namespace MR
             vector<size_t>& global_enhanced_count;
             vector_type enhanced_sum;
             vector<size_t> enhanced_count;
+            Math::Stats::matrix_type stats_batch;
             vector_type stats;
             vector_type enhanced_stats;
             std::shared_ptr<std::mutex> mutex;
@@ -140,21 +144,31 @@ namespace MR
               }
 
 
-              bool operator() (const Permutation& permutation)
+              bool operator() (const PermutationBatch& batch)
+              {
+                stats_calculator (batch.data, statistics_batch);
+                for (size_t p = 0; p != batch.data.size(); ++p) {
+                  statistics = statistics_batch.col (p).array();
+                  process (batch.index + p);
+                }
+                return true;
+              }
+
+            protected:
+              void process (const size_t index)
               {
-                stats_calculator (permutation.data, statistics);
                 if (enhancer) {
-                  perm_dist_pos[permutation.index] = (*enhancer) (statistics, enhanced_statistics);
+                  perm_dist_pos[index] = (*enhancer) (statistics, enhanced_statistics);
                 } else {
                   enhanced_statistics = statistics;
-                  perm_dist_pos[permutation.index] = enhanced_statistics.maxCoeff();
+                  perm_dist_pos[index] = enhanced_statistics.maxCoeff();
                 }
 
                 if (empirical_enhanced_statistics.size()) {
-                  perm_dist_pos[permutation.index] = 0.0;
+                  perm_dist_pos[index] = 0.0;
                   for (ssize_t i = 0; i < enhanced_statistics.size(); ++i) {
                     enhanced_statistics[i] /= empirical_enhanced_statistics[i];
-                    perm_dist_pos[permutation.index] = std::max(perm_dist_pos[permutation.index], enhanced_statistics[i]);
+                    perm_dist_pos[index] = std::max(perm_dist_pos[index], enhanced_statistics[i]);
                   }
                 }
 
@@ -167,13 +181,13 @@ namespace MR
                 if (perm_dist_neg) {
                   statistics = -statistics;
 
-                  (*perm_dist_neg)[permutation.index] = (*enhancer) (statistics, enhanced_statistics);
+                  (*perm_dist_neg)[index] = (*enhancer) (statistics, enhanced_statistics);
 
                   if (empirical_enhanced_statistics.size()) {
-                    (*perm_dist_neg)[permutation.index] = 0.0;
+                    (*perm_dist_neg)[index] = 0.0;
                     for (ssize_t i = 0; i < enhanced_statistics.size(); ++i) {
                       enhanced_statistics[i] /= empirical_enhanced_statistics[i];
-                      (*perm_dist_neg)[permutation.index] = std::max ((*perm_dist_neg)[permutation.index], enhanced_statistics[i]);
+                      (*perm_dist_neg)[index] = std::max ((*perm_dist_neg)[index], enhanced_statistics[i]);
                     }
                   }
 
@@ -182,15 +196,14 @@ namespace MR
                       (*uncorrected_pvalue_counter_neg)[i]++;
                   }
                 }
-                return true;
               }
 
-            protected:
               StatsType stats_calculator;
               std::shared_ptr<EnhancerBase> enhancer;
               const vector_type& empirical_enhanced_statistics;
               const vector_type& default_enhanced_statistics;
               const std::shared_ptr<vector_type> default_enhanced_statistics_neg;
+              Math::Stats::matrix_type statistics_batch;
               vector_type statistics;
               vector_type enhanced_statistics;
               vector<size_t> uncorrected_pvalue_counter;
@@ -212,7 +225,7 @@ namespace MR
             vector<size_t> global_enhanced_count (empirical_statistic.size(), 0);
             {
               PreProcessor<StatsType> preprocessor (stats_calculator, enhancer, empirical_statistic, global_enhanced_count);
-              Thread::run_queue (perm_stack, Permutation(), Thread::multi (preprocessor));
+              Thread::run_queue (perm_stack, PermutationBatch(), Thread::multi (preprocessor));
             }
             for (ssize_t i = 0; i < empirical_statistic.size(); ++i) {
               if (global_enhanced_count[i] > 0)
@@ -277,7 +290,7 @@ namespace MR
                                                 default_enhanced_statistics, default_enhanced_statistics_neg,
                                                 perm_dist_pos, perm_dist_neg,
                                                 global_uncorrected_pvalue_count, global_uncorrected_pvalue_count_neg);
-                Thread::run_queue (perm_stack, Permutation(), Thread::multi (processor));
+                Thread::run_queue (perm_stack, PermutationBatch(), Thread::multi (processor));
               }
 
               for (size_t i = 0; i < stats_calculator.num_elements(); ++i) {
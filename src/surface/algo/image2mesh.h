@@ -18,9 +18,10 @@
 #define __surface_algo_image2mesh_h__
 
 #include <array>
-#include <map>
+#include <unordered_map>
 
 #include "image_helpers.h"
+#include "thread_queue.h"
 #include "transform.h"
 #include "types.h"
 
@@ -64,7 +65,7 @@ namespace MR
         ImageType voxel (input_image), neighbour (input_image);
         VertexList vertices;
         TriangleList triangles;
-        std::map<Vox, size_t> vox2vertindex;
+        std::unordered_map<uint64_t, uint32_t> vox2vertindex;
 
         // Perform all initial calculations in voxel space;
         //   only once the final vertex position in voxel space is determined
@@ -73,7 +74,8 @@ namespace MR
 
         // Also, for initial calculations, do this such that a voxel location actually
         //   refers to the lower corner of the voxel; that way searches for existing
-        //   vertices can be done using a simple map
+        //   vertices can be done using a hash of the linear index of that corner
+        const uint64_t corner_strides[3] = { 1, uint64_t(voxel.size(0)+1), uint64_t(voxel.size(0)+1) * uint64_t(voxel.size(1)+1) };
 
         Vox pos;
         for (auto loop = Loop(voxel) (voxel); loop; ++loop) {
@@ -119,9 +121,11 @@ namespace MR
                   // Triangle 0 uses vertices (0, 1, 2); triangle 1 uses vertices (0, 2, 3)
                   for (size_t out_vertex = 0; out_vertex != 3; ++out_vertex) {
                     const size_t in_vertex = out_vertex + (tri_index && out_vertex ? 1 : 0);
-                    const auto existing = vox2vertindex.find (voxels[in_vertex]);
+                    const uint64_t corner_index = voxels[in_vertex][0] * corner_strides[0] + voxels[in_vertex][1] * corner_strides[1] + voxels[in_vertex][2] * corner_strides[2];
+                    const auto existing = vox2vertindex.find (corner_index);
                     if (existing == vox2vertindex.end()) {
                       triangle_vertices[out_vertex] = vertices.size();
+                      vox2vertindex.insert (std::make_pair (corner_index, uint32_t(vertices.size())));
                       Eigen::Vector3 pos_voxelspace (default_type(voxels[in_vertex][0]) - 0.5, default_type(voxels[in_vertex][1]) - 0.5, default_type(voxels[in_vertex][2]) - 0.5);
                       vertices.push_back (transform.voxel2scanner * pos_voxelspace);
                     } else {
@@ -437,89 +441,152 @@ namespace MR
         {0, 3, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
         {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1} };
 
-      VertexList vertices;
-      TriangleList triangles;
-
       Transform transform (input_image);
 
-      ImageType voxel (input_image);
-      float in_vertex_values[8];
-      std::map< Vox, std::map<Vox, size_t> > input_vertex_pair_to_output_vertex_index_map;
-      Vox lower_corner;
-      for (lower_corner[2] = -1; lower_corner[2] != voxel.size(2); ++lower_corner[2]) {
-        for (lower_corner[1] = -1; lower_corner[1] != voxel.size(1); ++lower_corner[1]) {
-          for (lower_corner[0] = -1; lower_corner[0] != voxel.size(0); ++lower_corner[0]) {
-
-            // This is our lower corner for our region of 8 voxels
-            uint8_t code = 0x00;
-            for (size_t neighbour_index = 0; neighbour_index != 8; ++neighbour_index) {
-              assign_pos_of (lower_corner + neighbour_offsets[neighbour_index]).to (voxel);
-              in_vertex_values[neighbour_index] = 0.0f;
-              if (!is_out_of_bounds (voxel))
-                in_vertex_values[neighbour_index] = voxel.value();
-              if (in_vertex_values[neighbour_index] > threshold)
-                code |= (1 << neighbour_index);
-            }
-            // Our code here acts as a lookup index to the table cube_edge_flags
-            const uint32_t edge_flags = cube_edge_flags[code];
-            // Now we find out which edges are intersected, based on this flag
-            // For all relevant output vertices, we need to store the output index
-            //   of that vertex
-            std::array<uint32_t, 12> edge_to_output_vertex;
-            edge_to_output_vertex.fill (0);
-            for (size_t edge_index = 0; edge_index != 12; ++edge_index) {
-              if (edge_flags & (1 << edge_index)) {
-
-                // OK, so now we have two vertices corresponding to this edge
-                // However, we don't want to duplicate vertices
-                // Therefore, need to do a lookup
-                // Remember: we have the lower corner position, and 8 offsets from that
-                std::array<uint8_t, 2> vertex_indices;
-                std::array<Vox,     2> vertex_positions;
-
-                for (size_t i = 0; i != 2; ++i) {
-                  const uint8_t vertex_index = edge_vertices[edge_index][i];
-                  vertex_indices[i] = vertex_index;
-                  vertex_positions[i] = lower_corner + neighbour_offsets[vertex_index];
-                }
-                // Has a vertex already been generated somewhere along this edge?
-                auto lookup_zero_it = input_vertex_pair_to_output_vertex_index_map.find (vertex_positions[0]);
-                if (lookup_zero_it == input_vertex_pair_to_output_vertex_index_map.end())
-                  lookup_zero_it = input_vertex_pair_to_output_vertex_index_map.insert (std::make_pair (vertex_positions[0], std::map<Vox, size_t>())).first;
-                auto lookup_one_it = input_vertex_pair_to_output_vertex_index_map.find (vertex_positions[1]);
-                if (lookup_one_it == input_vertex_pair_to_output_vertex_index_map.end())
-                  lookup_one_it = input_vertex_pair_to_output_vertex_index_map.insert (std::make_pair (vertex_positions[1], std::map<Vox, size_t>())).first;
-                auto& lookup_zero = lookup_zero_it->second;
-                auto& lookup_one  = lookup_one_it ->second;
-                auto existing_zero = lookup_zero.find (vertex_positions[1]);
-                if (existing_zero == lookup_zero.end()) {
-                  lookup_zero.insert (std::make_pair (vertex_positions[1], vertices.size()));
-                  lookup_one .insert (std::make_pair (vertex_positions[0], vertices.size()));
-                  edge_to_output_vertex[edge_index] = vertices.size();
-                  // Calculate the precise position of this vertex, based on the
-                  //   image intensities in the two relevant voxels
-                  const default_type alpha = (threshold - in_vertex_values[vertex_indices[0]]) / (in_vertex_values[vertex_indices[1]] - in_vertex_values[vertex_indices[0]]);
-                  const Vertex pos_voxelspace = vertex_positions[0].cast<default_type>() + (alpha * (vertex_positions[1] - vertex_positions[0]).cast<default_type>());
-                  vertices.push_back (transform.voxel2scanner * pos_voxelspace);
-                } else {
-                  edge_to_output_vertex[edge_index] = existing_zero->second;
+      // Each vertex generated lies on an edge between two adjacent grid points,
+      //   including the implicit layer of zero-valued voxels surrounding the image;
+      //   identify each such edge uniquely using the linear index of its lower
+      //   grid point (offset by one to accommodate that layer) and its axis
+      const uint64_t grid_strides[3] = { 3,
+                                         3 * uint64_t(input_image.size(0)+2),
+                                         3 * uint64_t(input_image.size(0)+2) * uint64_t(input_image.size(1)+2) };
+      auto grid_edge = [&] (const Vox& a, const Vox& b) -> uint64_t {
+        const Vox lower (a.min (b));
+        const size_t axis = a[0] != b[0] ? 0 : (a[1] != b[1] ? 1 : 2);
+        return (lower[0]+1) * grid_strides[0] + (lower[1]+1) * grid_strides[1] + (lower[2]+1) * grid_strides[2] + axis;
+      };
+
+      // The volume is processed in slabs along the third axis, which can be
+      //   processed independently; each yields its own vertices & triangles,
+      //   together with the edge from which each of its vertices was generated
+      class Slab { MEMALIGN(Slab)
+        public:
+          int begin, end;
+          VertexList vertices;
+          vector<uint64_t> vertex_edges;
+          std::unordered_map<uint64_t, uint32_t> edge_to_vertex;
+          TriangleList triangles;
+      };
+      const int slab_thickness = 8;
+      vector<Slab> slabs;
+      for (int z = -1; z < int(input_image.size(2)); z += slab_thickness) {
+        slabs.push_back (Slab());
+        slabs.back().begin = z;
+        slabs.back().end = std::min (z + slab_thickness, int(input_image.size(2)));
+      }
+
+      auto process_slab = [&] (const size_t& slab_index)
+      {
+        Slab& slab (slabs[slab_index]);
+        ImageType voxel (input_image);
+        float in_vertex_values[8];
+        Vox lower_corner;
+        for (lower_corner[2] = slab.begin; lower_corner[2] != slab.end; ++lower_corner[2]) {
+          for (lower_corner[1] = -1; lower_corner[1] != voxel.size(1); ++lower_corner[1]) {
+            for (lower_corner[0] = -1; lower_corner[0] != voxel.size(0); ++lower_corner[0]) {
+
+              // This is our lower corner for our region of 8 voxels
+              uint8_t code = 0x00;
+              for (size_t neighbour_index = 0; neighbour_index != 8; ++neighbour_index) {
+                assign_pos_of (lower_corner + neighbour_offsets[neighbour_index]).to (voxel);
+                in_vertex_values[neighbour_index] = 0.0f;
+                if (!is_out_of_bounds (voxel))
+                  in_vertex_values[neighbour_index] = voxel.value();
+                if (in_vertex_values[neighbour_index] > threshold)
+                  code |= (1 << neighbour_index);
+              }
+              // Our code here acts as a lookup index to the table cube_edge_flags
+              const uint32_t edge_flags = cube_edge_flags[code];
+              // Now we find out which edges are intersected, based on this flag
+              // For all relevant output vertices, we need to store the output index
+              //   of that vertex
+              std::array<uint32_t, 12> edge_to_output_vertex;
+              edge_to_output_vertex.fill (0);
+              for (size_t edge_index = 0; edge_index != 12; ++edge_index) {
+                if (edge_flags & (1 << edge_index)) {
+
+                  // OK, so now we have two vertices corresponding to this edge
+                  // However, we don't want to duplicate vertices
+                  // Therefore, need to do a lookup
+                  // Remember: we have the lower corner position, and 8 offsets from that
+                  std::array<uint8_t, 2> vertex_indices;
+                  std::array<Vox,     2> vertex_positions;
+
+                  for (size_t i = 0; i != 2; ++i) {
+                    const uint8_t vertex_index = edge_vertices[edge_index][i];
+                    vertex_indices[i] = vertex_index;
+                    vertex_positions[i] = lower_corner + neighbour_offsets[vertex_index];
+                  }
+                  // Has a vertex already been generated somewhere along this edge?
+                  const uint64_t edge = grid_edge (vertex_positions[0], vertex_positions[1]);
+                  const auto existing = slab.edge_to_vertex.find (edge);
+                  if (existing == slab.edge_to_vertex.end()) {
+                    edge_to_output_vertex[edge_index] = slab.vertices.size();
+                    slab.edge_to_vertex.insert (std::make_pair (edge, uint32_t(slab.vertices.size())));
+                    slab.vertex_edges.push_back (edge);
+                    // Calculate the precise position of this vertex, based on the
+                    //   image intensities in the two relevant voxels
+                    const default_type alpha = (threshold - in_vertex_values[vertex_indices[0]]) / (in_vertex_values[vertex_indices[1]] - in_vertex_values[vertex_indices[0]]);
+                    const Vertex pos_voxelspace = vertex_positions[0].cast<default_type>() + (alpha * (vertex_positions[1] - vertex_positions[0]).cast<default_type>());
+                    slab.vertices.push_back (transform.voxel2scanner * pos_voxelspace);
+                  } else {
+                    edge_to_output_vertex[edge_index] = existing->second;
+                  }
+
                 }
+              }
 
+              // OK, so now the relevant edges have an output vertex index associated with them
+              // Based on the code for this voxel, now we use the table cube_triangle_table to see
+              //   which edges need to have triangles constructed from the relevant generated vertices
+              // Note that flipping the last two vertex indices is deliberate; the provided
+              //   lookup table does not use a right-hand rule axis convention, so this is necessary
+              //   to calculate the correct surface normals
+              for (const int8_t* first_edge = cube_triangle_table[code]; *first_edge >= 0; first_edge += 3) {
+                const uint32_t indices[3] { edge_to_output_vertex[*first_edge], edge_to_output_vertex[*(first_edge+2)], edge_to_output_vertex[*(first_edge+1)] };
+                slab.triangles.push_back (Triangle (indices));
               }
-            }
 
-            // OK, so now the relevant edges have an output vertex index associated with them
-            // Based on the code for this voxel, now we use the table cube_triangle_table to see
-            //   which edges need to have triangles constructed from the relevant generated vertices
-            // Note that flipping the last two vertex indices is deliberate; the provided
-            //   lookup table does not use a right-hand rule axis convention, so this is necessary
-            //   to calculate the correct surface normals
-            for (const int8_t* first_edge = cube_triangle_table[code]; *first_edge >= 0; first_edge += 3) {
-              const uint32_t indices[3] { edge_to_output_vertex[*first_edge], edge_to_output_vertex[*(first_edge+2)], edge_to_output_vertex[*(first_edge+1)] };
-              triangles.push_back (Triangle (indices));
-            }
+        } } } // Finished looping over all voxels in this slab
+        return true;
+      };
 
-      } } } // Finished looping over all voxels in the input image
+      size_t next_slab = 0;
+      auto slab_source = [&] (size_t& slab_index) { slab_index = next_slab++; return (slab_index < slabs.size()); };
+      Thread::run_queue (slab_source, Thread::batch (size_t()), Thread::multi (process_slab));
+
+      // Stitch the slabs together in order: the only vertices that may have been
+      //   generated by two slabs lie on the edges within the plane shared between
+      //   them, and these take the index already assigned within the earlier slab;
+      //   the result is therefore identical to processing the whole volume in one pass
+      VertexList vertices;
+      TriangleList triangles;
+      vector<uint32_t> prev_slab_to_output, slab_to_output;
+      for (size_t slab_index = 0; slab_index != slabs.size(); ++slab_index) {
+        Slab& slab (slabs[slab_index]);
+        const uint64_t boundary_plane = uint64_t(slab.begin+1) * grid_strides[2];
+        slab_to_output.resize (slab.vertices.size());
+        for (size_t v = 0; v != slab.vertices.size(); ++v) {
+          const uint64_t edge = slab.vertex_edges[v];
+          if (slab_index && edge >= boundary_plane && edge < boundary_plane + grid_strides[2] && edge % 3 != 2) {
+            const Slab& prev_slab (slabs[slab_index-1]);
+            const auto existing = prev_slab.edge_to_vertex.find (edge);
+            if (existing != prev_slab.edge_to_vertex.end()) {
+              slab_to_output[v] = prev_slab_to_output[existing->second];
+              continue;
+            }
+          }
+          slab_to_output[v] = vertices.size();
+          vertices.push_back (slab.vertices[v]);
+        }
+        for (const auto& t : slab.triangles) {
+          const uint32_t indices[3] { slab_to_output[t[0]], slab_to_output[t[1]], slab_to_output[t[2]] };
+          triangles.push_back (Triangle (indices));
+        }
+        if (slab_index)
+          slabs[slab_index-1] = Slab();
+        std::swap (prev_slab_to_output, slab_to_output);
+      }
 
       // Write the result to the output class
       out.load (vertices, triangles);
@@ -16,7 +16,8 @@
 
 #include "surface/algo/mesh2image.h"
 
-#include <map>
+#include <algorithm>
+#include <stack>
 
 #include "header.h"
 #include "progressbar.h"
@@ -38,6 +39,9 @@ namespace MR
       constexpr size_t pve_os_ratio = 10;
       constexpr size_t pve_nsamples = Math::pow3 (pve_os_ratio);
 
+      // Number of polygons mapped to the underlying voxels within a single job
+      constexpr size_t poly_block_size = 256;
+
 
       void mesh2image (const Mesh& mesh_realspace, Image<float>& image)
       {
@@ -49,12 +53,14 @@ namespace MR
         Mesh mesh;
         vector<Eigen::Vector3> polygon_normals;
 
-        // For every edge voxel, stores those polygons that may intersect the voxel
-        using Vox2Poly = std::map< Vox, vector<size_t> >;
-        Vox2Poly voxel2poly;
+        // For every edge voxel, stores those polygons that may intersect the voxel:
+        //   for edge voxel mesh_voxels[i], these are the entries of voxel_polys
+        //   from index voxel_poly_offsets[i] up to voxel_poly_offsets[i+1]
+        vector<Vox> mesh_voxels;
+        vector<size_t> voxel_poly_offsets, voxel_polys;
 
         {
-          ProgressBar progress ("Performing voxel-based segmentation of surface", 8);
+          ProgressBar progress ("Performing voxel-based segmentation of surface", 7);
 
           Filter::VertexTransform transform (image);
           transform.set_real2voxel();
@@ -65,13 +71,6 @@ namespace MR
           if (!mesh.have_normals())
             mesh.calculate_normals();
 
-          static const Vox adj_voxels[6] = { { -1,  0,  0 },
-                                             { +1,  0,  0 },
-                                             {  0, -1,  0 },
-                                             {  0, +1,  0 },
-                                             {  0,  0, -1 },
-                                             {  0,  0, +1 } };
-
           // Compute normals for polygons
           polygon_normals.reserve (mesh.num_polygons());
           for (TriangleList::const_iterator p = mesh.get_triangles().begin(); p != mesh.get_triangles().end(); ++p)
@@ -80,136 +79,151 @@ namespace MR
             polygon_normals.push_back (normal (mesh, *p));
           ++progress;
 
-          // Create some memory to work with:
-          // Stores a flag for each voxel as encoded in enum vox_mesh_t
+          // All voxel-wise data are stored in flat arrays, indexed as per a
+          //   contiguous image with the first axis varying fastest
           Header H (image);
-          auto init_seg = Image<uint8_t>::scratch (H);
-          for (auto l = Loop(init_seg) (init_seg); l; ++l)
-            init_seg.value() = vox_mesh_t::UNDEFINED;
-
-          // Map each polygon to the underlying voxels
-          for (size_t poly_index = 0; poly_index != mesh.num_polygons(); ++poly_index) {
-
-            const size_t num_vertices = (poly_index < mesh.num_triangles()) ? 3 : 4;
-
-            // Figure out the voxel extent of this polygon in three dimensions
-            Vox lower_bound (H.size(0)-1, H.size(1)-1, H.size(2)-1), upper_bound (0, 0, 0);
-            VertexList this_poly_verts;
-            if (num_vertices == 3)
-              mesh.load_triangle_vertices (this_poly_verts, poly_index);
-            else
-              mesh.load_quad_vertices (this_poly_verts, poly_index - mesh.num_triangles());
-            for (VertexList::const_iterator v = this_poly_verts.begin(); v != this_poly_verts.end(); ++v) {
-              for (size_t axis = 0; axis != 3; ++axis) {
-                const int this_axis_voxel = std::round((*v)[axis]);
-                lower_bound[axis] = std::min (lower_bound[axis], this_axis_voxel);
-                upper_bound[axis] = std::max (upper_bound[axis], this_axis_voxel);
-              }
-            }
-
-            // Constrain to lie within the dimensions of the image
-            for (size_t axis = 0; axis != 3; ++axis) {
-              lower_bound[axis] = std::max(0,                   lower_bound[axis]);
-              upper_bound[axis] = std::min(int(H.size(axis)-1), upper_bound[axis]);
-            }
+          const size_t strides[3] = { 1, size_t(H.size(0)), size_t(H.size(0)) * size_t(H.size(1)) };
+          const size_t num_voxels = strides[2] * size_t(H.size(2));
+          auto linear_index = [&] (const Vox& v) -> size_t { return v[0] * strides[0] + v[1] * strides[1] + v[2] * strides[2]; };
 
-            // For all voxels within this rectangular region, assign this polygon to the map
-            // Use the Separating Axis Theorem to be more stringent as to which voxels this
-            //   polygon will be processed in
-            auto overlap = [&] (const Vox& vox, const size_t poly_index) -> bool {
+          // Stores a flag for each voxel as encoded in enum vox_mesh_t
+          vector<uint8_t> init_seg (num_voxels, vox_mesh_t::UNDEFINED);
 
-              VertexList vertices;
+          // Map each polygon to the underlying voxels
+          // Blocks of polygons are processed in parallel, each yielding a list of
+          //   (voxel, polygon) pairs; these are subsequently gathered into a single
+          //   index, sorted by voxel
+          using VoxPolyPair = std::pair<size_t, size_t>;
+          vector<vector<VoxPolyPair>> block_pairs ((mesh.num_polygons() + poly_block_size - 1) / poly_block_size);
+          auto map_polygons = [&] (const size_t& block)
+          {
+            vector<VoxPolyPair>& pairs (block_pairs[block]);
+            VertexList vertices;
+            const size_t end = std::min (mesh.num_polygons(), (block+1) * poly_block_size);
+            for (size_t poly_index = block * poly_block_size; poly_index != end; ++poly_index) {
+
+              const size_t num_vertices = (poly_index < mesh.num_triangles()) ? 3 : 4;
+
+              // Figure out the voxel extent of this polygon in three dimensions
+              Vox lower_bound (H.size(0)-1, H.size(1)-1, H.size(2)-1), upper_bound (0, 0, 0);
               if (num_vertices == 3)
                 mesh.load_triangle_vertices (vertices, poly_index);
               else
                 mesh.load_quad_vertices (vertices, poly_index - mesh.num_triangles());
-
-              // Test whether or not the two objects can be separated via projection onto an axis
-              auto separating_axis = [&] (const Eigen::Vector3& axis) -> bool {
-                default_type voxel_low  =  std::numeric_limits<default_type>::infinity();
-                default_type voxel_high = -std::numeric_limits<default_type>::infinity();
-                default_type poly_low   =  std::numeric_limits<default_type>::infinity();
-                default_type poly_high  = -std::numeric_limits<default_type>::infinity();
-
-                static const Eigen::Vector3 voxel_offsets[8] = { { -0.5, -0.5, -0.5 },
-                                                                 { -0.5, -0.5,  0.5 },
-                                                                 { -0.5,  0.5, -0.5 },
-                                                                 { -0.5,  0.5,  0.5 },
-                                                                 {  0.5, -0.5, -0.5 },
-                                                                 {  0.5, -0.5,  0.5 },
-                                                                 {  0.5,  0.5, -0.5 },
-                                                                 {  0.5,  0.5,  0.5 } };
-
-                for (size_t i = 0; i != 8; ++i) {
-                  const Eigen::Vector3 v (vox.matrix().cast<default_type>() + voxel_offsets[i]);
-                  const default_type projection = axis.dot (v);
-                  voxel_low  = std::min (voxel_low,  projection);
-                  voxel_high = std::max (voxel_high, projection);
+              for (VertexList::const_iterator v = vertices.begin(); v != vertices.end(); ++v) {
+                for (size_t axis = 0; axis != 3; ++axis) {
+                  const int this_axis_voxel = std::round((*v)[axis]);
+                  lower_bound[axis] = std::min (lower_bound[axis], this_axis_voxel);
+                  upper_bound[axis] = std::max (upper_bound[axis], this_axis_voxel);
                 }
+              }
 
-                for (const auto& v : vertices) {
-                  const default_type projection = axis.dot (v);
-                  poly_low  = std::min (poly_low,  projection);
-                  poly_high = std::max (poly_high, projection);
-                }
+              // Constrain to lie within the dimensions of the image
+              for (size_t axis = 0; axis != 3; ++axis) {
+                lower_bound[axis] = std::max(0,                   lower_bound[axis]);
+                upper_bound[axis] = std::min(int(H.size(axis)-1), upper_bound[axis]);
+              }
 
-                // Is this a separating axis?
-                return (poly_low > voxel_high || voxel_low > poly_high);
-              };
+              // For all voxels within this rectangular region, assign this polygon to the map
+              // Use the Separating Axis Theorem to be more stringent as to which voxels this
+              //   polygon will be processed in
+              auto overlap = [&] (const Vox& vox, const size_t poly_index) -> bool {
+
+                // Test whether or not the two objects can be separated via projection onto an axis
+                auto separating_axis = [&] (const Eigen::Vector3& axis) -> bool {
+                  default_type voxel_low  =  std::numeric_limits<default_type>::infinity();
+                  default_type voxel_high = -std::numeric_limits<default_type>::infinity();
+                  default_type poly_low   =  std::numeric_limits<default_type>::infinity();
+                  default_type poly_high  = -std::numeric_limits<default_type>::infinity();
+
+                  static const Eigen::Vector3 voxel_offsets[8] = { { -0.5, -0.5, -0.5 },
+                                                                   { -0.5, -0.5,  0.5 },
+                                                                   { -0.5,  0.5, -0.5 },
+                                                                   { -0.5,  0.5,  0.5 },
+                                                                   {  0.5, -0.5, -0.5 },
+                                                                   {  0.5, -0.5,  0.5 },
+                                                                   {  0.5,  0.5, -0.5 },
+                                                                   {  0.5,  0.5,  0.5 } };
+
+                  for (size_t i = 0; i != 8; ++i) {
+                    const Eigen::Vector3 v (vox.matrix().cast<default_type>() + voxel_offsets[i]);
+                    const default_type projection = axis.dot (v);
+                    voxel_low  = std::min (voxel_low,  projection);
+                    voxel_high = std::max (voxel_high, projection);
+                  }
 
-              // The following axes need to be tested as potential separating axes:
-              //   x, y, z
-              //   All cross-products between voxel and polygon edges
-              //   Polygon normal
-              for (size_t i = 0; i != 3; ++i) {
-                Eigen::Vector3 axis (0.0, 0.0, 0.0);
-                axis[i] = 1.0;
-                if (separating_axis (axis))
-                  return false;
-                for (size_t j = 0; j != num_vertices-1; ++j) {
-                  if (separating_axis (axis.cross (vertices[j+1] - vertices[j])))
+                  for (const auto& v : vertices) {
+                    const default_type projection = axis.dot (v);
+                    poly_low  = std::min (poly_low,  projection);
+                    poly_high = std::max (poly_high, projection);
+                  }
+
+                  // Is this a separating axis?
+                  return (poly_low > voxel_high || voxel_low > poly_high);
+                };
+
+                // The following axes need to be tested as potential separating axes:
+                //   x, y, z
+                //   All cross-products between voxel and polygon edges
+                //   Polygon normal
+                for (size_t i = 0; i != 3; ++i) {
+                  Eigen::Vector3 axis (0.0, 0.0, 0.0);
+                  axis[i] = 1.0;
+                  if (separating_axis (axis))
+                    return false;
+                  for (size_t j = 0; j != num_vertices-1; ++j) {
+                    if (separating_axis (axis.cross (vertices[j+1] - vertices[j])))
+                      return false;
+                  }
+                  if (separating_axis (axis.cross (vertices[num_vertices-1] - vertices[0])))
                     return false;
                 }
-                if (separating_axis (axis.cross (vertices[num_vertices-1] - vertices[0])))
+                if (separating_axis (polygon_normals[poly_index]))
                   return false;
-              }
-              if (separating_axis (polygon_normals[poly_index]))
-                return false;
 
-              // No axis has been found that separates the two objects
-              // Therefore, the two objects overlap
-              return true;
-            };
+                // No axis has been found that separates the two objects
+                // Therefore, the two objects overlap
+                return true;
+              };
 
-            Vox voxel;
-            for (voxel[2] = lower_bound[2]; voxel[2] <= upper_bound[2]; ++voxel[2]) {
-              for (voxel[1] = lower_bound[1]; voxel[1] <= upper_bound[1]; ++voxel[1]) {
-                for (voxel[0] = lower_bound[0]; voxel[0] <= upper_bound[0]; ++voxel[0]) {
-                  // Rather than adding this polygon to the list of polygons to test for
-                  //   every single voxel within this 3D bounding box, only test it within
-                  //   those voxels that the polygon actually intersects
-                  if (overlap (voxel, poly_index)) {
-                    vector<size_t> this_voxel_polys;
-                    // Has this voxel already been intersected by at least one polygon?
-                    // If it has, we need to concatenate this polygon to the list
-                    //   (which involves deleting the existing entry then re-writing the concatenated list);
-                    // If it has not, we're adding a new entry to the list of voxels to be tested,
-                    //   with only one entry in the list for that voxel
-                    Vox2Poly::const_iterator existing = voxel2poly.find (voxel);
-                    if (existing != voxel2poly.end()) {
-                      this_voxel_polys = existing->second;
-                      voxel2poly.erase (existing);
-                    } else {
-                      // Only call this once each voxel, regardless of the number of intersecting polygons
-                      assign_pos_of (voxel).to (init_seg);
-                      init_seg.value() = vox_mesh_t::ON_MESH;
-                    }
-                    this_voxel_polys.push_back (poly_index);
-                    voxel2poly.insert (std::make_pair (voxel, this_voxel_polys));
-                  } } } }
+              Vox voxel;
+              for (voxel[2] = lower_bound[2]; voxel[2] <= upper_bound[2]; ++voxel[2]) {
+                for (voxel[1] = lower_bound[1]; voxel[1] <= upper_bound[1]; ++voxel[1]) {
+                  for (voxel[0] = lower_bound[0]; voxel[0] <= upper_bound[0]; ++voxel[0]) {
+                    // Rather than adding this polygon to the list of polygons to test for
+                    //   every single voxel within this 3D bounding box, only test it within
+                    //   those voxels that the polygon actually intersects
+                    if (overlap (voxel, poly_index))
+                      pairs.push_back (std::make_pair (linear_index (voxel), poly_index));
+                  } } }
+
+            }
+            return true;
+          };
 
+          {
+            size_t next_block = 0;
+            auto block_source = [&] (size_t& block) { block = next_block++; return (block < block_pairs.size()); };
+            Thread::run_queue (block_source, size_t(), Thread::multi (map_polygons));
+          }
 
+          // Sorting the pairs retains ascending polygon order within each voxel
+          vector<VoxPolyPair> pairs;
+          for (auto& block : block_pairs) {
+            pairs.insert (pairs.end(), block.begin(), block.end());
+            vector<VoxPolyPair>().swap (block);
           }
+          std::sort (pairs.begin(), pairs.end());
+          voxel_polys.reserve (pairs.size());
+          for (const auto& pair : pairs) {
+            if (init_seg[pair.first] != vox_mesh_t::ON_MESH) {
+              init_seg[pair.first] = vox_mesh_t::ON_MESH;
+              mesh_voxels.push_back (Vox (pair.first % strides[1], (pair.first / strides[1]) % size_t(H.size(1)), pair.first / strides[2]));
+              voxel_poly_offsets.push_back (voxel_polys.size());
+            }
+            voxel_polys.push_back (pair.second);
+          }
+          voxel_poly_offsets.push_back (voxel_polys.size());
           ++progress;
 
 
@@ -218,30 +232,31 @@ namespace MR
           //   by the normal at the vertex.
           // Each voxel not directly on the mesh should then be assigned as prelim_inside or prelim_outside
           //   depending on whether the summed value is positive or negative
-          auto sum_distances = Image<float>::scratch (H, "Sum of distances from polygon planes");
-          Vox adj_voxel;
-          for (size_t i = 0; i != mesh.num_vertices(); ++i) {
-            const Vox centre_voxel (mesh.vert(i));
-            for (adj_voxel[2] = centre_voxel[2]-1; adj_voxel[2] <= centre_voxel[2]+1; ++adj_voxel[2]) {
-              for (adj_voxel[1] = centre_voxel[1]-1; adj_voxel[1] <= centre_voxel[1]+1; ++adj_voxel[1]) {
-                for (adj_voxel[0] = centre_voxel[0]-1; adj_voxel[0] <= centre_voxel[0]+1; ++adj_voxel[0]) {
-                  if (!is_out_of_bounds (H, adj_voxel) && (adj_voxel - centre_voxel).any()) {
-                    const Eigen::Vector3 offset (adj_voxel.cast<default_type>().matrix() - mesh.vert(i));
-                    const default_type dp_normal = offset.dot (mesh.norm(i));
-                    const default_type offset_on_plane = (offset - (mesh.norm(i) * dp_normal)).norm();
-                    assign_pos_of (adj_voxel).to (sum_distances);
-                    // If offset_on_plane is close to zero, this vertex should contribute strongly toward
-                    //   the sum of distances from the surface within this voxel
-                    sum_distances.value() += (1.0 / (1.0 + offset_on_plane)) * dp_normal;
+          {
+            vector<float> sum_distances (num_voxels, 0.0f);
+            Vox adj_voxel;
+            for (size_t i = 0; i != mesh.num_vertices(); ++i) {
+              const Vox centre_voxel (mesh.vert(i));
+              for (adj_voxel[2] = centre_voxel[2]-1; adj_voxel[2] <= centre_voxel[2]+1; ++adj_voxel[2]) {
+                for (adj_voxel[1] = centre_voxel[1]-1; adj_voxel[1] <= centre_voxel[1]+1; ++adj_voxel[1]) {
+                  for (adj_voxel[0] = centre_voxel[0]-1; adj_voxel[0] <= centre_voxel[0]+1; ++adj_voxel[0]) {
+                    if (!is_out_of_bounds (H, adj_voxel) && (adj_voxel - centre_voxel).any()) {
+                      const Eigen::Vector3 offset (adj_voxel.cast<default_type>().matrix() - mesh.vert(i));
+                      const default_type dp_normal = offset.dot (mesh.norm(i));
+                      const default_type offset_on_plane = (offset - (mesh.norm(i) * dp_normal)).norm();
+                      // If offset_on_plane is close to zero, this vertex should contribute strongly toward
+                      //   the sum of distances from the surface within this voxel
+                      sum_distances[linear_index (adj_voxel)] += float ((1.0 / (1.0 + offset_on_plane)) * dp_normal);
+                    }
                   }
                 }
               }
             }
-          }
-          ++progress;
-          for (auto l = Loop(init_seg) (init_seg, sum_distances); l; ++l) {
-            if (static_cast<float> (sum_distances.value()) != 0.0f && init_seg.value() != vox_mesh_t::ON_MESH)
-              init_seg.value() = sum_distances.value() < 0.0 ? vox_mesh_t::PRELIM_INSIDE : vox_mesh_t::PRELIM_OUTSIDE;
+            ++progress;
+            for (size_t i = 0; i != num_voxels; ++i) {
+              if (sum_distances[i] != 0.0f && init_seg[i] != vox_mesh_t::ON_MESH)
+                init_seg[i] = sum_distances[i] < 0.0f ? vox_mesh_t::PRELIM_INSIDE : vox_mesh_t::PRELIM_OUTSIDE;
+            }
           }
           ++progress;
 
@@ -251,34 +266,54 @@ namespace MR
           //   - Select voxels both inside and outside the mesh to expand
           //   - When expanding each region, count the number of pre-assigned voxels both inside and outside
           //   - For the final region selection, assign values to voxels based on a majority vote
-          Image<uint8_t> seed (init_seg);
-          vector<Vox> to_fill;
-          std::stack<Vox> to_expand;
-          for (auto l = Loop(seed) (seed); l; ++l) {
-            if (seed.value() == vox_mesh_t::PRELIM_INSIDE || seed.value() == vox_mesh_t::PRELIM_OUTSIDE) {
+          // Each region is expanded using a scanline fill: the complete run of fillable voxels
+          //   along the first image axis is filled in one step, and only the first voxel of
+          //   each fillable run within the four adjacent rows is queued for further expansion
+          auto fillable = [&] (const size_t i) -> bool {
+            const uint8_t value = init_seg[i];
+            return (value == vox_mesh_t::UNDEFINED || value == vox_mesh_t::PRELIM_INSIDE || value == vox_mesh_t::PRELIM_OUTSIDE);
+          };
+          const ssize_t adj_row_offsets[4] = { -ssize_t(strides[1]), ssize_t(strides[1]), -ssize_t(strides[2]), ssize_t(strides[2]) };
+          vector<std::pair<size_t, size_t>> to_fill;
+          std::stack<size_t> to_expand;
+          for (size_t seed = 0; seed != num_voxels; ++seed) {
+            if (init_seg[seed] == vox_mesh_t::PRELIM_INSIDE || init_seg[seed] == vox_mesh_t::PRELIM_OUTSIDE) {
               size_t prelim_inside_count = 0, prelim_outside_count = 0;
-              if (seed.value() == vox_mesh_t::PRELIM_INSIDE)
-                prelim_inside_count = 1;
-              else
-                prelim_outside_count = 1;
-              to_expand.push (Vox (seed.index(0), seed.index(1), seed.index(2)));
-              to_fill.assign (1, to_expand.top());
+              to_expand.push (seed);
               do {
-                const Vox voxel (to_expand.top());
+                const size_t voxel = to_expand.top();
                 to_expand.pop();
-                for (size_t adj_vox_idx = 0; adj_vox_idx != 6; ++adj_vox_idx) {
-                  const Vox adj_voxel (voxel + adj_voxels[adj_vox_idx]);
-                  assign_pos_of (adj_voxel).to (init_seg);
-                  if (!is_out_of_bounds (init_seg)) {
-                    const uint8_t adj_value = init_seg.value();
-                    if (adj_value == vox_mesh_t::UNDEFINED || adj_value == vox_mesh_t::PRELIM_INSIDE || adj_value == vox_mesh_t::PRELIM_OUTSIDE) {
-                      if (adj_value == vox_mesh_t::PRELIM_INSIDE)
-                        ++prelim_inside_count;
-                      else if (adj_value == vox_mesh_t::PRELIM_OUTSIDE)
-                        ++prelim_outside_count;
-                      to_expand.push (adj_voxel);
-                      to_fill.push_back (adj_voxel);
-                      init_seg.value() = vox_mesh_t::FILL_TEMP;
+                if (!fillable (voxel))
+                  continue;
+                const size_t row_begin = voxel - (voxel % strides[1]);
+                const size_t row_end = row_begin + strides[1];
+                size_t run_begin = voxel, run_end = voxel + 1;
+                while (run_begin != row_begin && fillable (run_begin - 1))
+                  --run_begin;
+                while (run_end != row_end && fillable (run_end))
+                  ++run_end;
+                for (size_t i = run_begin; i != run_end; ++i) {
+                  if (init_seg[i] == vox_mesh_t::PRELIM_INSIDE)
+                    ++prelim_inside_count;
+                  else if (init_seg[i] == vox_mesh_t::PRELIM_OUTSIDE)
+                    ++prelim_outside_count;
+                  init_seg[i] = vox_mesh_t::FILL_TEMP;
+                }
+                to_fill.push_back (std::make_pair (run_begin, run_end));
+                const size_t y = (voxel / strides[1]) % size_t(H.size(1));
+                const size_t z = voxel / strides[2];
+                const bool adj_row_valid[4] = { y != 0, y != size_t(H.size(1)-1), z != 0, z != size_t(H.size(2)-1) };
+                for (size_t adj_row = 0; adj_row != 4; ++adj_row) {
+                  if (adj_row_valid[adj_row]) {
+                    bool in_run = false;
+                    for (size_t i = run_begin + adj_row_offsets[adj_row]; i != run_end + adj_row_offsets[adj_row]; ++i) {
+                      if (fillable (i)) {
+                        if (!in_run)
+                          to_expand.push (i);
+                        in_run = true;
+                      } else {
+                        in_run = false;
+                      }
                     }
                   }
                 }
@@ -286,26 +321,18 @@ namespace MR
               if (prelim_inside_count == prelim_outside_count)
                 throw Exception ("Mapping mesh to image failed: Unable to label connected voxel region as inside or outside mesh");
               const vox_mesh_t fill_value = (prelim_inside_count > prelim_outside_count ? vox_mesh_t::INSIDE : vox_mesh_t::OUTSIDE);
-              for (auto voxel : to_fill) {
-                assign_pos_of (voxel).to (init_seg);
-                init_seg.value() = fill_value;
-              }
+              for (const auto& run : to_fill)
+                std::fill (init_seg.begin() + run.first, init_seg.begin() + run.second, uint8_t(fill_value));
               to_fill.clear();
             }
           }
           ++progress;
 
-          // Any voxel not yet processed must lie outside the structure(s)
-          for (auto l = Loop(init_seg) (init_seg); l; ++l) {
-            if (init_seg.value() == vox_mesh_t::UNDEFINED)
-              init_seg.value() = vox_mesh_t::OUTSIDE;
-          }
-          ++progress;
-
           // Write initial ternary segmentation
-          for (auto l = Loop (init_seg) (init_seg, image); l; ++l) {
-            switch (init_seg.value()) {
-              case vox_mesh_t (UNDEFINED): throw Exception ("Code error: poor filling of initial mesh estimate"); break;
+          // Any voxel not yet processed must lie outside the structure(s)
+          for (auto l = Loop (image) (image); l; ++l) {
+            switch (init_seg[image.index(0) * strides[0] + image.index(1) * strides[1] + image.index(2) * strides[2]]) {
+              case vox_mesh_t (UNDEFINED): image.value() = 0.0; break;
               case vox_mesh_t (ON_MESH):   image.value() = 0.5; break;
               case vox_mesh_t (OUTSIDE):   image.value() = 0.0; break;
               case vox_mesh_t (INSIDE):    image.value() = 1.0; break;
@@ -318,32 +345,36 @@ namespace MR
         // Construct class functors necessary to calculate, for each voxel intersected by the
         //   surface, the partial volume fraction
         class Source
-        { MEMALIGN(Source)
+        { NOMEMALIGN
           public:
-            Source (const Vox2Poly& data) :
-                data (data),
-                i (data.begin()) { }
+            Source (const size_t count) :
+                count (count),
+                i (0) { }
 
-            bool operator() (std::pair<Vox, vector<size_t>>& out)
+            bool operator() (size_t& out)
             {
-              if (i == data.end())
-                return false;
-              out = std::make_pair (i->first, i->second);
-              ++i;
-              return true;
+              out = i++;
+              return (out < count);
             }
 
           private:
-            const Vox2Poly& data;
-            Vox2Poly::const_iterator i;
+            const size_t count;
+            size_t i;
         };
 
         class Pipe
         { NOMEMALIGN
           public:
-            Pipe (const Mesh& mesh, const vector<Eigen::Vector3>& polygon_normals) :
+            Pipe (const Mesh& mesh,
+                  const vector<Eigen::Vector3>& polygon_normals,
+                  const vector<Vox>& mesh_voxels,
+                  const vector<size_t>& voxel_poly_offsets,
+                  const vector<size_t>& voxel_polys) :
                 mesh (mesh),
-                polygon_normals (polygon_normals)
+                polygon_normals (polygon_normals),
+                mesh_voxels (mesh_voxels),
+                voxel_poly_offsets (voxel_poly_offsets),
+                voxel_polys (voxel_polys)
 
             {
               // Generate a set of points within this voxel that need to be tested individually
@@ -361,9 +392,30 @@ namespace MR
               }
             }
 
-            bool operator() (const std::pair<Vox, vector<size_t>>& in, std::pair<Vox, float>& out) const
+            bool operator() (const size_t& in, std::pair<Vox, float>& out)
             {
-              const Vox& voxel (in.first);
+              const Vox& voxel (mesh_voxels[in]);
+
+              // Those quantities for each polygon that do not depend on the point being
+              //   tested are computed only once for this voxel
+              const size_t num_polys = voxel_poly_offsets[in+1] - voxel_poly_offsets[in];
+              polys.resize (num_polys);
+              for (size_t i = 0; i != num_polys; ++i) {
+                PolygonData& data (polys[i]);
+                data.index = voxel_polys[voxel_poly_offsets[in] + i];
+                const Eigen::Vector3& n (polygon_normals[data.index]);
+                VertexList& v (data.vertices);
+                if (data.index < mesh.num_triangles()) {
+                  mesh.load_triangle_vertices (v, data.index);
+                  data.centre = (v[0] + v[1] + v[2]) * (1.0/3.0);
+                  data.edge_normals[0] = (v[1]-v[2]).cross (n); data.edge_normals[0].normalize();
+                  data.edge_normals[1] = (v[2]-v[0]).cross (n); data.edge_normals[1].normalize();
+                  data.edge_normals[2] = (v[0]-v[1]).cross (n); data.edge_normals[2].normalize();
+                } else {
+                  mesh.load_quad_vertices (v, data.index - mesh.num_triangles());
+                  data.centre = (v[0] + v[1] + v[2] + v[3]) * 0.25;
+                }
+              }
 
               // Count the number of these points that lie inside the mesh
               size_t inside_mesh_count = 0;
@@ -376,11 +428,9 @@ namespace MR
                 default_type best_min_distance_from_interior_projection = std::numeric_limits<default_type>::infinity();
 
                 // Only test against those polygons that are near this voxel
-                for (vector<size_t>::const_iterator polygon_index = in.second.begin(); polygon_index != in.second.end(); ++polygon_index) {
-                  const Eigen::Vector3& n (polygon_normals[*polygon_index]);
-
-                  const size_t polygon_num_vertices = (*polygon_index < mesh.num_triangles()) ? 3 : 4;
-                  VertexList v;
+                for (const auto& poly : polys) {
+                  const Eigen::Vector3& n (polygon_normals[poly.index]);
+                  const VertexList& v (poly.vertices);
 
                   bool is_inside = false;
                   default_type min_edge_distance_on_plane = std::numeric_limits<default_type>::infinity();
@@ -393,13 +443,10 @@ namespace MR
                   // If point does lie within projection of polygon (potentially more than one), then the
                   //   polygon to which the distance from the plane is minimal classifies the point
 
-                  if (polygon_num_vertices == 3) {
-
-                    mesh.load_triangle_vertices (v, *polygon_index);
+                  if (v.size() == 3) {
 
                     // First: is it aligned with the normal?
-                    const Vertex poly_centre ((v[0] + v[1] + v[2]) * (1.0/3.0));
-                    const Vertex diff (p - poly_centre);
+                    const Vertex diff (p - poly.centre);
                     distance_from_plane = diff.dot (n);
                     is_inside = (distance_from_plane <= 0.0);
 
@@ -407,24 +454,18 @@ namespace MR
                     const Vertex p_on_plane (p - (n * (diff.dot (n))));
 
                     std::array<default_type, 3> edge_distances;
-                    Vertex zero = (v[1]-v[2]).cross (n); zero.normalize();
-                    Vertex one  = (v[2]-v[0]).cross (n); one .normalize();
-                    Vertex two  = (v[0]-v[1]).cross (n); two .normalize();
-                    edge_distances[0] = (p_on_plane-v[2]).dot (zero);
-                    edge_distances[1] = (p_on_plane-v[0]).dot (one);
-                    edge_distances[2] = (p_on_plane-v[1]).dot (two);
+                    edge_distances[0] = (p_on_plane-v[2]).dot (poly.edge_normals[0]);
+                    edge_distances[1] = (p_on_plane-v[0]).dot (poly.edge_normals[1]);
+                    edge_distances[2] = (p_on_plane-v[1]).dot (poly.edge_normals[2]);
                     min_edge_distance_on_plane = std::min ( { edge_distances[0], edge_distances[1], edge_distances[2] } );
 
                   } else {
 
-                    mesh.load_quad_vertices (v, *polygon_index);
-
                     // This may be slightly ill-posed with a quad; no guarantee of fixed normal
                     // Proceed regardless
 
                     // First: is it aligned with the normal?
-                    const Vertex poly_centre ((v[0] + v[1] + v[2] + v[3]) * 0.25);
-                    const Vertex diff (p - poly_centre);
+                    const Vertex diff (p - poly.centre);
                     distance_from_plane = diff.dot (n);
                     is_inside = (distance_from_plane <= 0.0);
 
@@ -482,9 +523,22 @@ namespace MR
           private:
             const Mesh& mesh;
             const vector<Eigen::Vector3>& polygon_normals;
+            const vector<Vox>& mesh_voxels;
+            const vector<size_t>& voxel_poly_offsets;
+            const vector<size_t>& voxel_polys;
 
             std::shared_ptr<vector<Eigen::Vector3>> offsets_to_test;
 
+            class PolygonData
+            { MEMALIGN(PolygonData)
+              public:
+                size_t index;
+                VertexList vertices;
+                Vertex centre;
+                Vertex edge_normals[3];
+            };
+            vector<PolygonData> polys;
+
         };
 
         class Sink
@@ -509,12 +563,12 @@ namespace MR
 
         };
 
-        Source source (voxel2poly);
-        Pipe pipe (mesh, polygon_normals);
-        Sink sink (image, voxel2poly.size());
+        Source source (mesh_voxels.size());
+        Pipe pipe (mesh, polygon_normals, mesh_voxels, voxel_poly_offsets, voxel_polys);
+        Sink sink (image, mesh_voxels.size());
 
         Thread::run_queue (source,
-                           std::pair<Vox, vector<size_t>>(),
+                           size_t(),
                            Thread::multi (pipe),
                            std::pair<Vox, float>(),
                            sink);
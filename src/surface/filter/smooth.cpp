@@ -16,8 +16,10 @@
 
 #include "surface/filter/smooth.h"
 
-#include <set>
+#include <algorithm>
+#include <limits>
 
+#include "thread_queue.h"
 #include "surface/utils.h"
 
 namespace MR
@@ -28,6 +30,70 @@ namespace MR
     {
 
 
+
+      namespace {
+
+        // Process each vertex of the mesh in parallel
+        template <class Functor>
+        void run_over_vertices (const size_t V, Functor&& functor)
+        {
+          size_t next = 0;
+          auto source = [&] (size_t& v) { v = next++; return (v < V); };
+          Thread::run_queue (source, Thread::batch (size_t()), Thread::multi (functor));
+        }
+
+
+
+        // Find the polygons within a fixed number of edge-sharing steps of each vertex
+        class Neighbourhood { NOMEMALIGN
+          public:
+            Neighbourhood (const vector< vector<uint32_t> >& vert_adjacent_polys,
+                           const vector< vector<uint32_t> >& poly_neighbours,
+                           vector< vector<uint32_t> >& vert_polys) :
+                vert_adjacent_polys (vert_adjacent_polys),
+                poly_neighbours (poly_neighbours),
+                vert_polys (vert_polys),
+                visited (poly_neighbours.size(), std::numeric_limits<uint32_t>::max()) { }
+
+            bool operator() (const size_t& v)
+            {
+              vector<uint32_t>& polys (vert_polys[v]);
+              polys = vert_adjacent_polys[v];
+              for (const auto p : polys)
+                visited[p] = v;
+
+              // Find polygons at the outer edge of this expanding front, and add them to the neighbourhood for this vertex
+              // TODO Will want to develop a better heuristic for this
+              size_t front_begin = 0;
+              for (size_t iter = 0; iter != 8; ++iter) {
+                const size_t front_end = polys.size();
+                for (size_t front = front_begin; front != front_end; ++front) {
+                  for (const auto expansion : poly_neighbours[polys[front]]) {
+                    if (visited[expansion] != v) {
+                      visited[expansion] = v;
+                      polys.push_back (expansion);
+                    }
+                  }
+                }
+                front_begin = front_end;
+              }
+
+              std::sort (polys.begin(), polys.end());
+              return true;
+            }
+
+          private:
+            const vector< vector<uint32_t> >& vert_adjacent_polys;
+            const vector< vector<uint32_t> >& poly_neighbours;
+            vector< vector<uint32_t> >& vert_polys;
+            // Polygons already in the neighbourhood of the current vertex are marked with its index
+            vector<uint32_t> visited;
+        };
+
+      }
+
+
+
       void Smooth::operator() (const Mesh& in, Mesh& out) const
       {
         std::unique_ptr<ProgressBar> progress;
@@ -67,53 +133,41 @@ namespace MR
         //
         // Initialisation is different to iterations: Need a single pass to find those
         //   polygons that actually use the vertex
-        vector< std::set<uint32_t> > vert_polys (V, std::set<uint32_t>());
-        // For each vertex, don't just want to store the polygons within the neighbourhood;
-        //   also want to store those that will be expanded from in the next iteration
-        vector< vector<uint32_t> > vert_polys_to_expand (V, vector<uint32_t>());
-
+        vector< vector<uint32_t> > vert_adjacent_polys (V, vector<uint32_t>());
         for (uint32_t t = 0; t != T; ++t) {
-          for (uint32_t i = 0; i != 3; ++i) {
-            vert_polys[(in.triangles[t])[i]].insert (t);
-            vert_polys_to_expand[(in.triangles[t])[i]].push_back (t);
-          }
+          for (uint32_t i = 0; i != 3; ++i)
+            vert_adjacent_polys[(in.triangles[t])[i]].push_back (t);
         }
         if (progress) ++(*progress);
 
         // Now, we want to expand this selection outwards for each vertex
         // To do this, also want to produce a list for each polygon: containing those polygons
         //   that share a common edge (i.e. two vertices)
+        // Any such polygon must also use one of the vertices of this polygon, so only those
+        //   polygons adjacent to its vertices need to be tested
         vector< vector<uint32_t> > poly_neighbours (T, vector<uint32_t>());
         for (uint32_t i = 0; i != T; ++i) {
-          for (uint32_t j = i+1; j != T; ++j) {
-            if (in.triangles[i].shares_edge (in.triangles[j])) {
-              poly_neighbours[i].push_back (j);
-              poly_neighbours[j].push_back (i);
-
+          for (uint32_t v = 0; v != 3; ++v) {
+            for (const auto j : vert_adjacent_polys[(in.triangles[i])[v]]) {
+              if (j > i && in.triangles[i].shares_edge (in.triangles[j])) {
+                poly_neighbours[i].push_back (j);
+                poly_neighbours[j].push_back (i);
+              }
             }
           }
         }
+        // Polygons sharing an edge are found once through each of the two shared vertices
+        for (auto& neighbours : poly_neighbours) {
+          std::sort (neighbours.begin(), neighbours.end());
+          neighbours.erase (std::unique (neighbours.begin(), neighbours.end()), neighbours.end());
+        }
         if (progress) ++(*progress);
 
-        // TODO Will want to develop a better heuristic for this
-        for (size_t iter = 0; iter != 8; ++iter) {
-          for (uint32_t v = 0; v != V; ++v) {
-
-            // Find polygons at the outer edge of this expanding front, and add them to the neighbourhood for this vertex
-            vector<uint32_t> next_front;
-            for (vector<uint32_t>::const_iterator front = vert_polys_to_expand[v].begin(); front != vert_polys_to_expand[v].end(); ++front) {
-              for (vector<uint32_t>::const_iterator expansion = poly_neighbours[*front].begin(); expansion != poly_neighbours[*front].end(); ++expansion) {
-                const std::set<uint32_t>::const_iterator existing = vert_polys[v].find (*expansion);
-                if (existing == vert_polys[v].end()) {
-                  vert_polys[v].insert (*expansion);
-                  next_front.push_back (*expansion);
-                }
-              }
-            }
-            vert_polys_to_expand[v] = std::move (next_front);
-
-          }
-        }
+        // For each vertex, perform a breadth-first expansion from the polygons that use it
+        // The list of polygons within each neighbourhood is sorted, such that the summations
+        //   below are always performed in the same order
+        vector< vector<uint32_t> > vert_polys (V, vector<uint32_t>());
+        run_over_vertices (V, Neighbourhood (vert_adjacent_polys, poly_neighbours, vert_polys));
         if (progress) ++(*progress);
 
 
@@ -121,21 +175,17 @@ namespace MR
         // Need to perform a first mollification pass, where the polygon normals are
         //   smoothed but the vertices are not perturbed
         // However, in order to calculate these new normals, we need to calculate new vertex positions!
-        VertexList mollified_vertices;
+        VertexList mollified_vertices (V);
         // Use half standard spatial factor for mollification
         // Denominator = 2(SF/2)^2
         const default_type spatial_mollification_power_multiplier = -2.0 / Math::pow2 (spatial);
         // No need to normalise the Gaussian; have to explicitly normalise afterwards
-        for (uint32_t v = 0; v != V; ++v) {
+        run_over_vertices (V, [&] (const size_t& v) {
 
           Vertex new_pos (0.0, 0.0, 0.0);
           default_type sum_weights = 0.0;
 
-          // For now, just use every polygon as part of the estimate
-          // Eventually, restrict this to some form of mesh neighbourhood
-          //for (size_t i = 0; i != centroids.size(); ++i) {
-          for (std::set<uint32_t>::const_iterator it = vert_polys[v].begin(); it != vert_polys[v].end(); ++it) {
-            const uint32_t i = *it;
+          for (const auto i : vert_polys[v]) {
             default_type this_weight = areas[i];
             const default_type distance_sq = (centroids[i] - in.vertices[v]).squaredNorm();
             this_weight *= std::exp (distance_sq * spatial_mollification_power_multiplier);
@@ -145,9 +195,10 @@ namespace MR
           }
 
           new_pos *= (1.0 / sum_weights);
-          mollified_vertices.push_back (new_pos);
+          mollified_vertices[v] = new_pos;
+          return true;
 
-        }
+        });
         if (progress) ++(*progress);
 
         // Have new vertices; compute polygon normals based on these vertices
@@ -161,14 +212,13 @@ namespace MR
         // Now perform the actual smoothing
         const default_type spatial_power_multiplier = -0.5 / Math::pow2 (spatial);
         const default_type influence_power_multiplier = -0.5 / Math::pow2 (influence);
-        for (size_t v = 0; v != V; ++v) {
+        out.vertices.resize (V);
+        run_over_vertices (V, [&] (const size_t& v) {
 
           Vertex new_pos (0.0, 0.0, 0.0);
           default_type sum_weights = 0.0;
 
-          //for (size_t i = 0; i != centroids.size(); ++i) {
-          for (std::set<uint32_t>::const_iterator it = vert_polys[v].begin(); it != vert_polys[v].end(); ++it) {
-            const uint32_t i = *it;
+          for (const auto i : vert_polys[v]) {
             default_type this_weight = areas[i];
             const default_type distance_sq = (centroids[i] - in.vertices[v]).squaredNorm();
             this_weight *= std::exp (distance_sq * spatial_power_multiplier);
@@ -180,9 +230,10 @@ namespace MR
           }
 
           new_pos *= (1.0 / sum_weights);
-          out.vertices.push_back (new_pos);
+          out.vertices[v] = new_pos;
+          return true;
 
-        }
+        });
         if (progress) ++(*progress);
 
         out.triangles = in.triangles;